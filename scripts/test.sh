@@ -26,7 +26,7 @@ mkdir -p "$TEST_DIR"
 cd "$TEST_DIR"
 
 # Create test directory
-echo "[1/10] Creating test repository..."
+echo "[1/15] Creating test repository..."
 mkdir -p test_repo
 cd test_repo
 
@@ -34,7 +34,7 @@ cd test_repo
 NIT_BINARY="$PROJECT_ROOT/nit"
 
 # Test 1: Initialize repository
-echo "[2/10] Testing: nit init"
+echo "[2/15] Testing: nit init"
 "$NIT_BINARY" init
 if [ ! -d ".vcs" ]; then
     echo "FAIL: .vcs directory not created"
@@ -44,52 +44,60 @@ echo "PASS: Repository initialized"
 echo ""
 
 # Test 2: Create test files
-echo "[3/10] Creating test files..."
+echo "[3/15] Creating test files..."
 echo "Hello nit" > file1.txt
 echo "Test file 2" > file2.txt
 echo "PASS: Test files created"
 echo ""
 
 # Test 3: Add files
-echo "[4/10] Testing: nit add"
+echo "[4/15] Testing: nit add"
 "$NIT_BINARY" add file1.txt
 "$NIT_BINARY" add file2.txt
 echo "PASS: Files added to staging area"
 echo ""
 
 # Test 4: Check status
-echo "[5/10] Testing: nit status"
+echo "[5/15] Testing: nit status"
 "$NIT_BINARY" status
 echo "PASS: Status displayed"
 echo ""
 
 # Test 5: Create commit
-echo "[6/10] Testing: nit commit"
+echo "[6/15] Testing: nit commit"
 "$NIT_BINARY" commit -m "Initial commit"
+if (mkdir ../conflict_repo && cd ../conflict_repo && "$NIT_BINARY" init > /dev/null &&
+    echo 1 > a && echo 2 > a-b && "$NIT_BINARY" add . > /dev/null &&
+    "$NIT_BINARY" commit -m "File a" > /dev/null &&
+    rm a && mkdir a && echo 3 > a/x && "$NIT_BINARY" add a/x > /dev/null &&
+    "$NIT_BINARY" commit -m "Directory a" 2> /dev/null > /dev/null); then
+    echo "FAIL: committed 'a' as both a file and a directory"
+    exit 1
+fi
 echo "PASS: Commit created"
 echo ""
 
 # Test 6: View log
-echo "[7/10] Testing: nit log"
+echo "[7/15] Testing: nit log"
 "$NIT_BINARY" log
 echo "PASS: Log displayed"
 echo ""
 
 # Test 7: Create branch
-echo "[8/10] Testing: nit branch"
+echo "[8/15] Testing: nit branch"
 "$NIT_BINARY" branch test-branch
 "$NIT_BINARY" branch
 echo "PASS: Branch created and listed"
 echo ""
 
 # Test 8: Checkout branch
-echo "[9/10] Testing: nit checkout"
+echo "[9/15] Testing: nit checkout"
 "$NIT_BINARY" checkout test-branch
 echo "PASS: Checked out branch"
 echo ""
 
 # Test 9: Make changes and commit
-echo "[10/10] Testing: commit on new branch"
+echo "[10/15] Testing: commit on new branch"
 echo "Modified content" >> file1.txt
 "$NIT_BINARY" add file1.txt
 "$NIT_BINARY" commit -m "Second commit on test-branch"
@@ -97,6 +105,120 @@ echo "Modified content" >> file1.txt
 echo "PASS: Commit on new branch created"
 echo ""
 
+# Test 10: Pack loose objects
+echo "[11/15] Testing: nit repack"
+"$NIT_BINARY" repack
+if find .vcs/objects -path .vcs/objects/pack -prune -o -type f -print | grep -q .; then
+    echo "FAIL: loose objects left after repack"
+    exit 1
+fi
+"$NIT_BINARY" log -n 1
+"$NIT_BINARY" repack -a
+"$NIT_BINARY" checkout master > /dev/null
+if grep -q "Modified content" file1.txt; then
+    echo "FAIL: checkout did not update the working tree"
+    exit 1
+fi
+cp file1.txt file1.txt.orig
+echo "Local edit" >> file1.txt
+if "$NIT_BINARY" checkout test-branch 2> /dev/null; then
+    echo "FAIL: checkout overwrote a local change"
+    exit 1
+fi
+mv file1.txt.orig file1.txt
+"$NIT_BINARY" checkout test-branch > /dev/null
+if ! grep -q "Modified content" file1.txt; then
+    echo "FAIL: checkout did not restore the branch"
+    exit 1
+fi
+echo "PASS: Objects packed and readable, checkout writes them"
+echo ""
+
+# Test 11: Inspect objects
+echo "[12/15] Testing: nit cat-file"
+BLOB=$("$NIT_BINARY" cat-file -p "$(sed -n 's/^tree //p' <("$NIT_BINARY" cat-file -p "$("$NIT_BINARY" log -n 1 | sed -n 's/^commit //p')"))" | awk '$4 == "file2.txt" {print $3}')
+if [ "$("$NIT_BINARY" cat-file -t "$BLOB")" != "blob" ] ||
+   [ "$("$NIT_BINARY" cat-file -s "$BLOB")" != "12" ] ||
+   [ "$("$NIT_BINARY" cat-file -p "$BLOB")" != "Test file 2" ]; then
+    echo "FAIL: cat-file output mismatch"
+    exit 1
+fi
+echo "PASS: Object type, size and content read back"
+echo ""
+
+# Test 12: Ignore rules and subdirectories
+echo "[13/15] Testing: .nitignore"
+mkdir -p build src/sub
+echo "generated" > build/out.o
+echo "noise" > debug.log
+echo "int main;" > src/sub/code.c
+printf 'build/\n*.log\n' > .nitignore
+"$NIT_BINARY" add .
+STATUS=$("$NIT_BINARY" status)
+if ! grep -q "src/sub/code.c" <<< "$STATUS" ||
+   grep -q -e "build/" -e "debug.log" <<< "$STATUS"; then
+    echo "FAIL: ignored files staged or subdirectory missed"
+    exit 1
+fi
+"$NIT_BINARY" sparse-checkout set docs
+if [ -e src/sub/code.c ] || grep -q "deleted:" <<< "$("$NIT_BINARY" status)"; then
+    echo "FAIL: sparse checkout kept a file or reported it deleted"
+    exit 1
+fi
+"$NIT_BINARY" sparse-checkout disable
+if [ "$(cat src/sub/code.c)" != "int main;" ]; then
+    echo "FAIL: disabling sparse checkout did not restore the file"
+    exit 1
+fi
+echo "PASS: Ignored paths skipped, subdirectories added and sparsely checked out"
+echo ""
+
+# Test 13: Filesystem monitor
+echo "[14/15] Testing: fsmonitor"
+if "$NIT_BINARY" fsmonitor start; then
+    "$NIT_BINARY" status > /dev/null
+    echo "int changed;" >> src/sub/code.c
+    STATUS=$("$NIT_BINARY" status)
+    "$NIT_BINARY" fsmonitor stop
+    if ! grep -q "modified:   src/sub/code.c" <<< "$STATUS"; then
+        echo "FAIL: change made while monitored not reported"
+        exit 1
+    fi
+    echo "PASS: fsmonitor reports changed files"
+else
+    echo "SKIP: fsmonitor unavailable"
+fi
+echo ""
+
+# Test 14: Content diff
+echo "[15/15] Testing: nit diff"
+"$NIT_BINARY" add . > /dev/null
+"$NIT_BINARY" commit -m "Ignore rules" > /dev/null
+printf 'one\ntwo\nthree\n' > file1.txt
+"$NIT_BINARY" add file1.txt
+"$NIT_BINARY" commit -m "Three lines" > /dev/null
+printf 'one\n2\nthree\n' > file1.txt
+DIFF=$("$NIT_BINARY" diff)
+if ! grep -qx -- "-two" <<< "$DIFF" || ! grep -qx -- "+2" <<< "$DIFF" ||
+   [ "$("$NIT_BINARY" diff --numstat)" != "$(printf '1\t1\tfile1.txt')" ]; then
+    echo "FAIL: diff output mismatch"
+    exit 1
+fi
+"$NIT_BINARY" add file1.txt
+if ! grep -q "modified:   file1.txt" <<< "$("$NIT_BINARY" status)" ||
+   [ -z "$("$NIT_BINARY" diff --cached)" ] || [ -n "$("$NIT_BINARY" diff)" ]; then
+    echo "FAIL: staged change not reported"
+    exit 1
+fi
+printf 'one\ntwo\nthree\n' > copy.txt
+"$NIT_BINARY" add copy.txt
+if ! grep -qx "$(printf 'C100\tfile1.txt\tcopy.txt')" <<< "$("$NIT_BINARY" diff --cached -C --name-status)"; then
+    echo "FAIL: copy not detected"
+    exit 1
+fi
+echo "PASS: Line changes, staged changes and copies shown"
+echo ""
+
 echo "==========================="
 echo "All tests passed!"
 echo "==========================="
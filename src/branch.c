@@ -1,13 +1,13 @@
 #include "vcs.h"
 
 // Create branch
-int create_branch(const char *branch_name, const char *commit_sha1) {
+int create_branch(const char *branch_name, const ObjectId *commit) {
     if (branch_exists(branch_name)) {
         fprintf(stderr, "Error: Branch '%s' already exists\n", branch_name);
         return -1;
     }
 
-    return write_ref(branch_name, commit_sha1);
+    return write_ref(branch_name, commit);
 }
 
 // Delete branch
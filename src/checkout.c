@@ -1,4 +1,514 @@
 #include "vcs.h"
+#include <fcntl.h>
+
+// Files written by one checkout job
+#define CHECKOUT_BATCH_COUNT 32
+
+// What checkout does with a path
+typedef enum {
+    CHECKOUT_WRITE,         // write the file and stage it, or remove both
+    CHECKOUT_SKIP,          // outside the sparse checkout: stage it without a file
+    CHECKOUT_HIDE           // leaving the sparse checkout: remove the file only
+} CheckoutAction;
+
+// A path whose content differs between the current and the target commit,
+// or that enters or leaves the sparse checkout
+typedef struct {
+    char *path;
+    CheckoutAction action;
+    ObjectId oid;           // target blob; null when the path is removed
+    uint32_t mode;          // target tree mode
+    struct stat st;         // the written file
+    int written;            // set by the worker once the file is complete
+} CheckoutFile;
+
+// Unit of work for the checkout worker pool: a run of files to inflate and
+// write. Workers touch nothing but the job and its files.
+typedef struct {
+    CheckoutFile *files;
+    size_t count;
+    int failed;
+} CheckoutJob;
+
+// Paths to update, gathered and checked against the index and the working
+// tree before anything is changed
+typedef struct {
+    Index *idx;
+    const SparsePatterns *sparse;   // NULL without a sparse checkout
+    CheckoutFile *files;
+    size_t count;
+    size_t capacity;
+    int conflicts;
+} CheckoutPlan;
+
+static void checkout_plan_free(CheckoutPlan *plan) {
+    for (size_t i = 0; i < plan->count; i++) {
+        free(plan->files[i].path);
+    }
+    free(plan->files);
+}
+
+// Tree of a commit; the null ID (empty tree) for a null commit
+static int commit_tree(const ObjectId *commit, ObjectId *tree) {
+    if (oid_is_null(commit)) {
+        oid_clear(tree);
+        return 0;
+    }
+    Commit *c = read_commit(commit);
+    if (!c) {
+        fprintf(stderr, "Error: Failed to read commit %s\n", oid_hex(commit));
+        return -1;
+    }
+    *tree = c->tree;
+    commit_free(c);
+    return 0;
+}
+
+// Whether an index entry (or its absence) holds the given side of a change
+static int checkout_index_matches(const IndexEntry *entry, const ObjectId *oid, uint32_t mode) {
+    if (!entry || oid_is_null(oid)) {
+        return !entry && oid_is_null(oid);
+    }
+    return oid_equal(&entry->oid, oid) && !(entry->mode & 0111) == !(mode & 0111);
+}
+
+// Whether a tracked file still has its staged content
+static int checkout_file_clean(Index *idx, const IndexEntry *entry, const char *path,
+                               const struct stat *st) {
+    ObjectId oid;
+    if (index_entry_uptodate(idx, entry, st)) {
+        return 1;
+    }
+    return S_ISREG(st->st_mode) && hash_object_file(path, OBJ_BLOB, &oid) == 0 &&
+           oid_equal(&oid, &entry->oid);
+}
+
+// Whether a leading directory of path exists as something other than a
+// directory that the index does not track (and the checkout would not remove)
+static int checkout_parent_blocked(Index *idx, const char *path) {
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        struct stat st;
+        int blocked = lstat(dir, &st) == 0 && !S_ISDIR(st.st_mode) && !index_find_entry(idx, dir);
+        *slash = '/';
+        if (blocked) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int checkout_plan_add(CheckoutPlan *plan, const char *path, CheckoutAction action,
+                             const ObjectId *oid, uint32_t mode) {
+    if (plan->count == plan->capacity) {
+        size_t capacity = plan->capacity ? plan->capacity * 2 : 64;
+        CheckoutFile *files = realloc(plan->files, capacity * sizeof(CheckoutFile));
+        if (!files) {
+            return -1;
+        }
+        plan->files = files;
+        plan->capacity = capacity;
+    }
+    CheckoutFile *file = &plan->files[plan->count];
+    if (!(file->path = strdup(path))) {
+        return -1;
+    }
+    file->action = action;
+    file->oid = *oid;
+    file->mode = mode;
+    file->written = 0;
+    plan->count++;
+    return 0;
+}
+
+// Decide what to do with one path that differs between the two commits.
+// An index entry already at the target is kept with its working tree file,
+// like any path the two commits agree on. Otherwise the entry must still be
+// at the current commit and the file must be clean, missing, or a directory
+// of tracked files, or the checkout would lose work. Paths outside the
+// sparse checkout without a file are only staged, never looked up on disk.
+static int checkout_collect(const DiffChange *change, void *data) {
+    CheckoutPlan *plan = data;
+    IndexEntry *entry = index_find_entry(plan->idx, change->path);
+    if (checkout_index_matches(entry, &change->new_oid, change->new_mode)) {
+        return 0;
+    }
+
+    int skip = (entry ? (entry->flags & INDEX_ENTRY_SKIP_WORKTREE) != 0
+                      : !sparse_includes(plan->sparse, change->path));
+    const char *conflict = NULL;
+    struct stat st;
+    if (!checkout_index_matches(entry, &change->old_oid, change->old_mode)) {
+        conflict = "staged changes to";
+    } else if (skip) {
+        return checkout_plan_add(plan, change->path, CHECKOUT_SKIP, &change->new_oid,
+                                 change->new_mode);
+    } else if (lstat(change->path, &st) == 0) {
+        if (S_ISDIR(st.st_mode)) {
+            char prefix[MAX_PATH];
+            int found;
+            snprintf(prefix, sizeof(prefix), "%s/", change->path);
+            size_t pos = index_position(plan->idx, prefix, &found);
+            if (entry || pos >= plan->idx->count ||
+                strncmp(index_path(plan->idx, &plan->idx->entries[pos]), prefix,
+                        strlen(prefix)) != 0) {
+                conflict = "untracked files in the way of";
+            }
+        } else if (!entry) {
+            conflict = "untracked file";
+        } else if (!checkout_file_clean(plan->idx, entry, change->path, &st)) {
+            conflict = "local changes to";
+        }
+    }
+    if (!conflict && !oid_is_null(&change->new_oid) &&
+        checkout_parent_blocked(plan->idx, change->path)) {
+        conflict = "an untracked file in the way of";
+    }
+    if (conflict) {
+        fprintf(stderr, "Error: Checkout would overwrite %s '%s'\n", conflict, change->path);
+        plan->conflicts++;
+        return 0;
+    }
+    return checkout_plan_add(plan, change->path, CHECKOUT_WRITE, &change->new_oid,
+                             change->new_mode);
+}
+
+// Create the leading directories of path; they may appear concurrently
+static int checkout_make_parents(const char *path) {
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+            return -1;
+        }
+        *slash = '/';
+    }
+    return 0;
+}
+
+// Write one blob to its path, streaming it so large files are not held in
+// memory, and record the new file's stat data
+static int checkout_write_file(CheckoutFile *file) {
+    ObjectType type;
+    size_t size;
+    ObjectStream *stream = object_stream_open(&file->oid, &type, &size);
+    if (!stream || type != OBJ_BLOB) {
+        if (stream) {
+            object_stream_close(stream);
+        }
+        fprintf(stderr, "Error: Failed to read the blob for '%s'\n", file->path);
+        return -1;
+    }
+
+    // Replace rather than truncate, so the new file gets the target mode
+    if (checkout_make_parents(file->path) != 0 ||
+        (unlink(file->path) != 0 && errno != ENOENT && rmdir(file->path) != 0)) {
+        fprintf(stderr, "Error: Cannot create '%s': %s\n", file->path, strerror(errno));
+        object_stream_close(stream);
+        return -1;
+    }
+    int fd = open(file->path, O_WRONLY | O_CREAT | O_EXCL, (file->mode & 0111) ? 0777 : 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create '%s': %s\n", file->path, strerror(errno));
+        object_stream_close(stream);
+        return -1;
+    }
+
+    unsigned char buf[65536];
+    ssize_t n;
+    int ret = 0;
+    while (ret == 0 && (n = object_stream_read(stream, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            ret = -1;
+            break;
+        }
+        for (ssize_t done = 0; done < n;) {
+            ssize_t written = write(fd, buf + done, n - done);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                ret = -1;
+                break;
+            }
+            done += written;
+        }
+    }
+    object_stream_close(stream);
+    if (ret == 0 && fstat(fd, &file->st) != 0) {
+        ret = -1;
+    }
+    if (close(fd) != 0) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Error: Failed to write '%s'\n", file->path);
+    }
+    return ret;
+}
+
+static void checkout_job_run(void *arg) {
+    CheckoutJob *job = arg;
+    for (size_t i = 0; i < job->count; i++) {
+        if (checkout_write_file(&job->files[i]) == 0) {
+            job->files[i].written = 1;
+        } else {
+            job->failed = 1;
+        }
+    }
+}
+
+// Queue the index updates for a finished job's written files; returns 1 if
+// any file could not be written
+static int checkout_job_finish(CheckoutJob *job, IndexUpdate *updates, size_t *count) {
+    int failed = job->failed;
+    for (size_t i = 0; i < job->count; i++) {
+        if (!job->files[i].written) {
+            continue;
+        }
+        updates[*count].path = job->files[i].path;
+        updates[*count].oid = job->files[i].oid;
+        updates[*count].st = job->files[i].st;
+        (*count)++;
+    }
+    free(job);
+    return failed;
+}
+
+// Remove a file, then the directories it leaves empty
+static int checkout_remove_file(const char *path) {
+    if (unlink(path) != 0 && errno != ENOENT) {
+        fprintf(stderr, "Error: Cannot remove '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strrchr(dir, '/'); slash; slash = strrchr(dir, '/')) {
+        *slash = '\0';
+        if (rmdir(dir) != 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Whether a planned path gets a file written by a worker
+static int checkout_writes(const CheckoutFile *file) {
+    return file->action == CHECKOUT_WRITE && !oid_is_null(&file->oid);
+}
+
+// Carry out a checked plan: remove files first, so directories they leave
+// can become files, then write the rest on the worker pool, and stage the
+// result with the new stat data. Paths outside the sparse checkout are
+// staged without stat data and flagged skip-worktree.
+static int checkout_apply(CheckoutPlan *plan) {
+    size_t n = plan->count ? plan->count : 1;
+    const char **removed = malloc(n * sizeof(char *));
+    const char **skipped = malloc(n * sizeof(char *));
+    IndexUpdate *updates = malloc(n * sizeof(IndexUpdate));
+    if (!removed || !skipped || !updates) {
+        free(removed);
+        free(skipped);
+        free(updates);
+        return -1;
+    }
+
+    size_t removed_count = 0, skipped_count = 0, update_count = 0;
+    int failed = 0;
+    for (size_t i = 0; i < plan->count; i++) {
+        CheckoutFile *file = &plan->files[i];
+        if (file->action != CHECKOUT_SKIP && !checkout_writes(file)) {
+            failed |= checkout_remove_file(file->path) != 0;
+        }
+        if (oid_is_null(&file->oid)) {
+            removed[removed_count++] = file->path;
+        } else if (file->action != CHECKOUT_WRITE) {
+            skipped[skipped_count++] = file->path;
+        }
+        if (file->action == CHECKOUT_SKIP && !oid_is_null(&file->oid)) {
+            // Trees take the executable bit from the mode
+            IndexUpdate *update = &updates[update_count++];
+            memset(update, 0, sizeof(IndexUpdate));
+            update->path = file->path;
+            update->oid = file->oid;
+            update->st.st_mode = S_IFREG | ((file->mode & 0111) ? 0755 : 0644);
+        }
+    }
+
+    int threads = worker_thread_count();
+    WorkerPool *pool = worker_pool_new(threads, (size_t)threads * 2, checkout_job_run);
+    if (!pool) {
+        free(removed);
+        free(skipped);
+        free(updates);
+        return -1;
+    }
+    CheckoutJob *job;
+    for (size_t next = 0; next < plan->count;) {
+        if (!checkout_writes(&plan->files[next])) {
+            next++;
+            continue;
+        }
+        if (!(job = calloc(1, sizeof(CheckoutJob)))) {
+            failed = 1;
+            break;
+        }
+        job->files = &plan->files[next];
+        while (next < plan->count && job->count < CHECKOUT_BATCH_COUNT &&
+               checkout_writes(&plan->files[next])) {
+            job->count++;
+            next++;
+        }
+        if (worker_pool_full(pool)) {
+            failed |= checkout_job_finish(worker_pool_next(pool), updates, &update_count);
+        }
+        worker_pool_submit(pool, job);
+    }
+    while ((job = worker_pool_next(pool)) != NULL) {
+        failed |= checkout_job_finish(job, updates, &update_count);
+    }
+    worker_pool_free(pool);
+
+    // Stage what was written even if some files failed, so the index keeps
+    // describing the working tree
+    int ret = index_remove_entries(plan->idx, removed, removed_count);
+    if (ret == 0) {
+        ret = index_merge(plan->idx, updates, update_count);
+    }
+    for (size_t i = 0; ret == 0 && i < skipped_count; i++) {
+        int found;
+        size_t pos = index_position(plan->idx, skipped[i], &found);
+        if (found) {
+            ret = index_set_flags(plan->idx, pos, INDEX_ENTRY_SKIP_WORKTREE,
+                                  INDEX_ENTRY_FSMONITOR_VALID);
+        }
+    }
+    free(removed);
+    free(skipped);
+    free(updates);
+    return ret == 0 && !failed ? 0 : -1;
+}
+
+// Move the working tree and the index from HEAD to commit, touching only the
+// paths the two commits' trees disagree on. Nothing is changed if that would
+// overwrite staged or unstaged work.
+static int checkout_tree(const ObjectId *commit) {
+    ObjectId head, old_tree, new_tree;
+    if (get_head_commit(&head) != 0) {
+        oid_clear(&head);
+    }
+    if (commit_tree(&head, &old_tree) != 0 || commit_tree(commit, &new_tree) != 0) {
+        return -1;
+    }
+
+    Index *idx = index_new();
+    if (!idx) {
+        return -1;
+    }
+    if (index_lock(idx) != 0) {
+        index_free(idx);
+        return -1;
+    }
+
+    CheckoutPlan plan;
+    memset(&plan, 0, sizeof(plan));
+    plan.idx = idx;
+    SparsePatterns *sparse = NULL;
+    int ret = sparse_load(&sparse);
+    if (ret != 0) {
+        fprintf(stderr, "Error: Cannot read %s\n", SPARSE_FILE);
+    }
+    plan.sparse = sparse;
+    if (ret == 0) {
+        ret = diff_trees(&old_tree, &new_tree, checkout_collect, &plan);
+    }
+    if (ret == 0 && plan.conflicts > 0) {
+        fprintf(stderr, "Error: Commit your changes before switching; checkout aborted\n");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        int applied = checkout_apply(&plan);
+
+        // Directories that were not touched keep their cached trees; refill
+        // the rest so the next status and commit can skip them as well
+        ObjectId tree;
+        if (write_index_tree(idx, &tree) < 0 || index_commit(idx) != 0) {
+            ret = -1;
+        }
+        ret = applied == 0 ? ret : -1;
+    }
+    if (idx->lock) {
+        index_rollback(idx);
+    }
+    index_free(idx);
+    sparse_free(sparse);
+    checkout_plan_free(&plan);
+    return ret;
+}
+
+// Apply new sparse checkout patterns (NULL for none) to the working tree:
+// remove the clean files of paths leaving it, keeping their entries, and
+// write the files of paths entering it. HEAD does not change.
+int checkout_sparse(const SparsePatterns *sparse) {
+    Index *idx = index_new();
+    if (!idx) {
+        return -1;
+    }
+    if (index_lock(idx) != 0) {
+        index_free(idx);
+        return -1;
+    }
+
+    CheckoutPlan plan;
+    memset(&plan, 0, sizeof(plan));
+    plan.idx = idx;
+    plan.sparse = sparse;
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < idx->count; i++) {
+        IndexEntry *entry = &idx->entries[i];
+        const char *path = index_path(idx, entry);
+        int skipped = (entry->flags & INDEX_ENTRY_SKIP_WORKTREE) != 0;
+        if (sparse_includes(sparse, path) != skipped) {
+            continue;
+        }
+        // A file either way must already have the staged content
+        struct stat st;
+        if (lstat(path, &st) == 0 && !checkout_file_clean(idx, entry, path, &st)) {
+            fprintf(stderr, "Error: Sparse checkout would %s '%s'\n",
+                    skipped ? "overwrite the untracked file" : "remove local changes to", path);
+            plan.conflicts++;
+            continue;
+        }
+        ret = checkout_plan_add(&plan, path, skipped ? CHECKOUT_WRITE : CHECKOUT_HIDE,
+                                &entry->oid, entry->mode);
+    }
+    if (ret == 0 && plan.conflicts > 0) {
+        fprintf(stderr, "Error: Commit your changes before changing the sparse checkout\n");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        int applied = checkout_apply(&plan);
+
+        // Removed files leave directories the untracked cache still lists
+        index_drop_extension(idx, INDEX_EXT_UNTRACKED);
+        ObjectId tree;
+        if (write_index_tree(idx, &tree) < 0 || index_commit(idx) != 0) {
+            ret = -1;
+        }
+        ret = applied == 0 ? ret : -1;
+    }
+    if (idx->lock) {
+        index_rollback(idx);
+    }
+    index_free(idx);
+    checkout_plan_free(&plan);
+    return ret;
+}
 
 // Checkout branch
 int checkout_branch(const char *branch_name) {
@@ -7,12 +517,16 @@ int checkout_branch(const char *branch_name) {
         return -1;
     }
 
-    char *commit_sha1 = read_ref(branch_name);
-    if (!commit_sha1) {
+    ObjectId commit;
+    if (read_ref(branch_name, &commit) != 0) {
         fprintf(stderr, "Error: Failed to read branch reference\n");
         return -1;
     }
 
+    if (checkout_tree(&commit) != 0) {
+        return -1;
+    }
+
     // Update HEAD to point to branch
     if (update_head(branch_name) != 0) {
         return -1;
@@ -23,17 +537,21 @@ int checkout_branch(const char *branch_name) {
 }
 
 // Checkout commit (detached HEAD)
-int checkout_commit(const char *commit_sha1) {
-    if (!object_exists(commit_sha1)) {
-        fprintf(stderr, "Error: Commit '%s' does not exist\n", commit_sha1);
+int checkout_commit(const ObjectId *commit) {
+    if (!object_exists(commit)) {
+        fprintf(stderr, "Error: Commit '%s' does not exist\n", oid_hex(commit));
+        return -1;
+    }
+
+    if (checkout_tree(commit) != 0) {
         return -1;
     }
 
     // Update HEAD to point directly to commit
-    if (update_head(commit_sha1) != 0) {
+    if (detach_head(commit) != 0) {
         return -1;
     }
 
-    printf("HEAD is now at %.*s\n", 7, commit_sha1);
+    printf("HEAD is now at %.*s\n", 7, oid_hex(commit));
     return 0;
 }
@@ -16,15 +16,15 @@ void commit_free(Commit *commit) {
 }
 
 // Write commit object
-int write_commit(Commit *commit, char *sha1_out) {
+int write_commit(Commit *commit, ObjectId *oid_out) {
     char data[MAX_LINE * 4];
     int len = 0;
 
     // Build commit data
-    len += snprintf(data + len, sizeof(data) - len, "tree %s\n", commit->tree_sha1);
-    
-    if (strlen(commit->parent_sha1) > 0) {
-        len += snprintf(data + len, sizeof(data) - len, "parent %s\n", commit->parent_sha1);
+    len += snprintf(data + len, sizeof(data) - len, "tree %s\n", oid_hex(&commit->tree));
+
+    if (!oid_is_null(&commit->parent)) {
+        len += snprintf(data + len, sizeof(data) - len, "parent %s\n", oid_hex(&commit->parent));
     }
     
     len += snprintf(data + len, sizeof(data) - len, 
@@ -33,14 +33,14 @@ int write_commit(Commit *commit, char *sha1_out) {
                    "committer %s %ld\n", commit->committer, commit->timestamp);
     len += snprintf(data + len, sizeof(data) - len, "\n%s\n", commit->message);
 
-    return write_object(data, len, OBJ_COMMIT, sha1_out);
+    return write_object(data, len, OBJ_COMMIT, oid_out);
 }
 
 // Read commit object
-Commit *read_commit(const char *sha1) {
+Commit *read_commit(const ObjectId *oid) {
     size_t size;
     ObjectType type;
-    char *data = read_object(sha1, &size, &type);
+    char *data = read_object(oid, &size, &type);
 
     if (!data || type != OBJ_COMMIT) {
         free(data);
@@ -73,11 +73,9 @@ Commit *read_commit(const char *sha1) {
         }
 
         if (strncmp(line, "tree ", 5) == 0) {
-            strncpy(commit->tree_sha1, line + 5, SHA1_HEX_SIZE);
-            commit->tree_sha1[SHA1_HEX_SIZE] = '\0';
+            hex_to_oid(line + 5, &commit->tree);
         } else if (strncmp(line, "parent ", 7) == 0) {
-            strncpy(commit->parent_sha1, line + 7, SHA1_HEX_SIZE);
-            commit->parent_sha1[SHA1_HEX_SIZE] = '\0';
+            hex_to_oid(line + 7, &commit->parent);
         } else if (strncmp(line, "author ", 7) == 0) {
             char *timestamp_str = strrchr(line + 7, ' ');
             if (timestamp_str) {
@@ -0,0 +1,443 @@
+#include "vcs.h"
+#include <zlib.h>
+#include <stdint.h>
+#ifdef NIT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Compression backends for object storage.
+//
+// The codec is recognisable from the first bytes of the stored data, so
+// repositories may mix codecs and older zlib-only repositories keep working:
+//   zlib   CMF byte with method 8 (0x?8), as written by every older nit
+//   zstd   frame magic 28 b5 2f fd
+//   store  0x00 marker byte followed by the raw bytes
+#define STORE_MARKER 0x00
+#define ZSTD_MAGIC "\x28\xb5\x2f\xfd"
+#define PROBE_SAMPLE (32 * 1024)
+#define PROBE_MIN_SAMPLE 512
+
+struct Compressor {
+    CompressionCodec codec;
+    z_stream zlib;
+#ifdef NIT_HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+    int marker_pending;
+    int finished;
+};
+
+struct Decompressor {
+    CompressionCodec codec;
+    z_stream zlib;
+#ifdef NIT_HAVE_ZSTD
+    ZSTD_DCtx *zstd;
+#endif
+    int marker_pending;
+    int ended;
+};
+
+static int parse_codec(const char *name, CompressionCodec *codec) {
+    if (strcmp(name, "zlib") == 0) {
+        *codec = CODEC_ZLIB;
+    } else if (strcmp(name, "zstd") == 0) {
+        *codec = CODEC_ZSTD;
+    } else if (strcmp(name, "store") == 0 || strcmp(name, "none") == 0) {
+        *codec = CODEC_STORE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Codec and level for an object type from the [compression] config section:
+//   codec = zlib | zstd | store, level = N, blobLevel/treeLevel/commitLevel = N
+void compression_settings(ObjectType type, CompressionCodec *codec, int *level) {
+    *codec = CODEC_ZLIB;
+    const char *name = config_get("compression.codec");
+    if (name && parse_codec(name, codec) != 0) {
+        static int warned = 0;
+        if (!warned) {
+            fprintf(stderr, "Warning: unknown compression codec '%s', using zlib\n", name);
+            warned = 1;
+        }
+    }
+
+#ifndef NIT_HAVE_ZSTD
+    if (*codec == CODEC_ZSTD) {
+        static int warned = 0;
+        if (!warned) {
+            fprintf(stderr, "Warning: nit was built without zstd support, using zlib\n");
+            warned = 1;
+        }
+        *codec = CODEC_ZLIB;
+    }
+#endif
+
+    long default_level = *codec == CODEC_ZSTD ? 3 : Z_DEFAULT_COMPRESSION;
+    long value = config_get_int("compression.level", default_level);
+    switch (type) {
+        case OBJ_BLOB: value = config_get_int("compression.blobLevel", value); break;
+        case OBJ_TREE: value = config_get_int("compression.treeLevel", value); break;
+        case OBJ_COMMIT: value = config_get_int("compression.commitLevel", value); break;
+    }
+
+    // zlib level 0 would still wrap the data in deflate framing
+    if (*codec == CODEC_ZLIB && value == 0) {
+        *codec = CODEC_STORE;
+    }
+    if (*codec == CODEC_ZLIB && (value < -1 || value > 9)) {
+        value = Z_DEFAULT_COMPRESSION;
+    }
+    *level = (int)value;
+}
+
+// Compress a sample at the fastest zlib level; data that barely shrinks
+// (JPEGs, archives, already-compressed binaries) is not worth compressing
+int compression_probe_incompressible(const void *sample, size_t len) {
+    if (len < PROBE_MIN_SAMPLE || !config_get_bool("compression.probe", 1)) {
+        return 0;
+    }
+    if (len > PROBE_SAMPLE) {
+        len = PROBE_SAMPLE;
+    }
+
+    unsigned char out[PROBE_SAMPLE + PROBE_SAMPLE / 8 + 64];
+    uLongf out_len = sizeof(out);
+    if (compress2(out, &out_len, sample, len, 1) != Z_OK) {
+        return 0;
+    }
+    return out_len * 100 >= len * 97;
+}
+
+// Pick the codec for an object, probing blob content when a sample is given
+void compression_choose(ObjectType type, const void *sample, size_t sample_len,
+                        CompressionCodec *codec, int *level) {
+    compression_settings(type, codec, level);
+    if (type == OBJ_BLOB && *codec != CODEC_STORE && sample &&
+        compression_probe_incompressible(sample, sample_len)) {
+        *codec = CODEC_STORE;
+    }
+}
+
+Compressor *compressor_new(CompressionCodec codec, int level) {
+    Compressor *c = calloc(1, sizeof(Compressor));
+    if (!c) {
+        return NULL;
+    }
+    c->codec = codec;
+
+    switch (codec) {
+        case CODEC_ZLIB:
+            if (deflateInit(&c->zlib, level) != Z_OK) {
+                free(c);
+                return NULL;
+            }
+            break;
+        case CODEC_ZSTD:
+#ifdef NIT_HAVE_ZSTD
+            c->zstd = ZSTD_createCCtx();
+            if (!c->zstd) {
+                free(c);
+                return NULL;
+            }
+            ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel, level);
+            break;
+#else
+            free(c);
+            return NULL;
+#endif
+        case CODEC_STORE:
+            c->marker_pending = 1;
+            break;
+    }
+    return c;
+}
+
+void compressor_free(Compressor *c) {
+    if (!c) {
+        return;
+    }
+    if (c->codec == CODEC_ZLIB) {
+        deflateEnd(&c->zlib);
+    }
+#ifdef NIT_HAVE_ZSTD
+    if (c->zstd) {
+        ZSTD_freeCCtx(c->zstd);
+    }
+#endif
+    free(c);
+}
+
+// Consume input and produce output, advancing both buffers. With finish set,
+// keep calling with fresh output space until it returns 1 (stream complete).
+// Returns 0 when more output space or input is needed, -1 on error.
+int compressor_run(Compressor *c, const unsigned char **in, size_t *in_len,
+                   unsigned char **out, size_t *out_len, int finish) {
+    if (c->finished) {
+        return 1;
+    }
+
+    switch (c->codec) {
+        case CODEC_ZLIB: {
+            uInt in_chunk = *in_len > UINT32_MAX ? UINT32_MAX : (uInt)*in_len;
+            uInt out_chunk = *out_len > UINT32_MAX ? UINT32_MAX : (uInt)*out_len;
+            c->zlib.next_in = (Bytef *)*in;
+            c->zlib.avail_in = in_chunk;
+            c->zlib.next_out = *out;
+            c->zlib.avail_out = out_chunk;
+            int flush = (finish && in_chunk == *in_len) ? Z_FINISH : Z_NO_FLUSH;
+            int ret = deflate(&c->zlib, flush);
+            if (ret == Z_STREAM_ERROR) {
+                return -1;
+            }
+            size_t consumed = in_chunk - c->zlib.avail_in;
+            size_t produced = out_chunk - c->zlib.avail_out;
+            *in += consumed;
+            *in_len -= consumed;
+            *out += produced;
+            *out_len -= produced;
+            if (ret == Z_STREAM_END) {
+                c->finished = 1;
+                return 1;
+            }
+            return 0;
+        }
+#ifdef NIT_HAVE_ZSTD
+        case CODEC_ZSTD: {
+            ZSTD_inBuffer input = {*in, *in_len, 0};
+            ZSTD_outBuffer output = {*out, *out_len, 0};
+            size_t ret = ZSTD_compressStream2(c->zstd, &output, &input,
+                                              finish ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(ret)) {
+                return -1;
+            }
+            *in += input.pos;
+            *in_len -= input.pos;
+            *out += output.pos;
+            *out_len -= output.pos;
+            if (finish && ret == 0 && *in_len == 0) {
+                c->finished = 1;
+                return 1;
+            }
+            return 0;
+        }
+#endif
+        case CODEC_STORE: {
+            if (c->marker_pending) {
+                if (*out_len == 0) {
+                    return 0;
+                }
+                *(*out)++ = STORE_MARKER;
+                (*out_len)--;
+                c->marker_pending = 0;
+            }
+            size_t n = *in_len < *out_len ? *in_len : *out_len;
+            memcpy(*out, *in, n);
+            *in += n;
+            *in_len -= n;
+            *out += n;
+            *out_len -= n;
+            if (finish && *in_len == 0) {
+                c->finished = 1;
+                return 1;
+            }
+            return 0;
+        }
+        default:
+            return -1;
+    }
+}
+
+// Identify the codec from the first bytes of stored data
+Decompressor *decompressor_new(const unsigned char *head, size_t head_len) {
+    if (head_len == 0) {
+        return NULL;
+    }
+
+    Decompressor *d = calloc(1, sizeof(Decompressor));
+    if (!d) {
+        return NULL;
+    }
+
+    if (head[0] == STORE_MARKER) {
+        d->codec = CODEC_STORE;
+        d->marker_pending = 1;
+    } else if (head_len >= 4 && memcmp(head, ZSTD_MAGIC, 4) == 0) {
+        d->codec = CODEC_ZSTD;
+#ifdef NIT_HAVE_ZSTD
+        d->zstd = ZSTD_createDCtx();
+        if (!d->zstd) {
+            free(d);
+            return NULL;
+        }
+#else
+        fprintf(stderr, "Error: object is zstd-compressed but nit was built without zstd\n");
+        free(d);
+        return NULL;
+#endif
+    } else {
+        d->codec = CODEC_ZLIB;
+        if (inflateInit(&d->zlib) != Z_OK) {
+            free(d);
+            return NULL;
+        }
+    }
+    return d;
+}
+
+void decompressor_free(Decompressor *d) {
+    if (!d) {
+        return;
+    }
+    if (d->codec == CODEC_ZLIB) {
+        inflateEnd(&d->zlib);
+    }
+#ifdef NIT_HAVE_ZSTD
+    if (d->zstd) {
+        ZSTD_freeDCtx(d->zstd);
+    }
+#endif
+    free(d);
+}
+
+// Decode as much as fits, advancing both buffers. Returns 1 once the stream
+// is known to be complete, 0 on progress, -1 on corrupt input. Stored data has
+// no end marker; callers stop once they have the size from the object header.
+int decompressor_run(Decompressor *d, const unsigned char **in, size_t *in_len,
+                     unsigned char **out, size_t *out_len) {
+    if (d->ended) {
+        return 1;
+    }
+
+    switch (d->codec) {
+        case CODEC_ZLIB: {
+            uInt in_chunk = *in_len > UINT32_MAX ? UINT32_MAX : (uInt)*in_len;
+            uInt out_chunk = *out_len > UINT32_MAX ? UINT32_MAX : (uInt)*out_len;
+            d->zlib.next_in = (Bytef *)*in;
+            d->zlib.avail_in = in_chunk;
+            d->zlib.next_out = *out;
+            d->zlib.avail_out = out_chunk;
+            int ret = inflate(&d->zlib, Z_SYNC_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                return -1;
+            }
+            size_t consumed = in_chunk - d->zlib.avail_in;
+            size_t produced = out_chunk - d->zlib.avail_out;
+            *in += consumed;
+            *in_len -= consumed;
+            *out += produced;
+            *out_len -= produced;
+            if (ret == Z_STREAM_END) {
+                d->ended = 1;
+                return 1;
+            }
+            return 0;
+        }
+#ifdef NIT_HAVE_ZSTD
+        case CODEC_ZSTD: {
+            ZSTD_inBuffer input = {*in, *in_len, 0};
+            ZSTD_outBuffer output = {*out, *out_len, 0};
+            size_t ret = ZSTD_decompressStream(d->zstd, &output, &input);
+            if (ZSTD_isError(ret)) {
+                return -1;
+            }
+            *in += input.pos;
+            *in_len -= input.pos;
+            *out += output.pos;
+            *out_len -= output.pos;
+            if (ret == 0) {
+                d->ended = 1;
+                return 1;
+            }
+            return 0;
+        }
+#endif
+        case CODEC_STORE: {
+            if (d->marker_pending) {
+                if (*in_len == 0) {
+                    return 0;
+                }
+                (*in)++;
+                (*in_len)--;
+                d->marker_pending = 0;
+            }
+            size_t n = *in_len < *out_len ? *in_len : *out_len;
+            memcpy(*out, *in, n);
+            *in += n;
+            *in_len -= n;
+            *out += n;
+            *out_len -= n;
+            return 0;
+        }
+        default:
+            return -1;
+    }
+}
+
+// Compress a whole object payload with the codec configured for its type
+int compress_data(const void *src, size_t src_len, ObjectType type, void **dst, size_t *dst_len) {
+    CompressionCodec codec;
+    int level;
+    compression_choose(type, src, src_len, &codec, &level);
+
+    Compressor *c = compressor_new(codec, level);
+    if (!c) {
+        return -1;
+    }
+
+    size_t capacity = compressBound(src_len) + 16;
+#ifdef NIT_HAVE_ZSTD
+    if (codec == CODEC_ZSTD) {
+        capacity = ZSTD_compressBound(src_len);
+    }
+#endif
+    unsigned char *out = malloc(capacity);
+    if (!out) {
+        compressor_free(c);
+        return -1;
+    }
+
+    const unsigned char *in = src;
+    size_t in_len = src_len;
+    unsigned char *next_out = out;
+    size_t out_len = capacity;
+    int ret;
+    while ((ret = compressor_run(c, &in, &in_len, &next_out, &out_len, 1)) == 0) {
+        if (out_len == 0) {
+            ret = -1;
+            break;
+        }
+    }
+    compressor_free(c);
+
+    if (ret != 1) {
+        free(out);
+        return -1;
+    }
+    *dst = out;
+    *dst_len = next_out - out;
+    return 0;
+}
+
+// Decompress into a buffer whose exact size is already known
+int decompress_exact(const void *src, size_t src_len, void *dst, size_t dst_len) {
+    Decompressor *d = decompressor_new(src, src_len);
+    if (!d) {
+        return -1;
+    }
+
+    const unsigned char *in = src;
+    unsigned char *out = dst;
+    size_t out_len = dst_len;
+    int ret = 0;
+    while (out_len > 0 && ret == 0) {
+        size_t before = out_len;
+        ret = decompressor_run(d, &in, &src_len, &out, &out_len);
+        if (ret == 0 && out_len == before) {
+            ret = -1; // no progress: input exhausted early
+        }
+    }
+    decompressor_free(d);
+    return (ret >= 0 && out_len == 0) ? 0 : -1;
+}
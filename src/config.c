@@ -0,0 +1,121 @@
+#include "vcs.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <strings.h>
+
+// Parsed "section.key = value" pairs from .vcs/config
+typedef struct {
+    char name[128];
+    char value[256];
+} ConfigEntry;
+
+static ConfigEntry *config_entries = NULL;
+static size_t config_count = 0;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+// Parse the config file once; safe to reach from worker threads
+static void config_parse(void) {
+    FILE *fp = fopen(CONFIG_FILE, "r");
+    if (!fp) {
+        return;
+    }
+
+    char line[MAX_LINE];
+    char section[64] = "";
+    size_t capacity = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = trim(line);
+        if (*p == '\0' || *p == '#' || *p == ';') {
+            continue;
+        }
+
+        if (*p == '[') {
+            char *close = strchr(p, ']');
+            if (close) {
+                *close = '\0';
+                snprintf(section, sizeof(section), "%s", trim(p + 1));
+            }
+            continue;
+        }
+
+        char *eq = strchr(p, '=');
+        if (!eq) {
+            continue;
+        }
+        *eq = '\0';
+
+        if (config_count >= capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            ConfigEntry *entries = realloc(config_entries, sizeof(ConfigEntry) * capacity);
+            if (!entries) {
+                break;
+            }
+            config_entries = entries;
+        }
+
+        ConfigEntry *entry = &config_entries[config_count++];
+        snprintf(entry->name, sizeof(entry->name), "%s.%s", section, trim(p));
+        snprintf(entry->value, sizeof(entry->value), "%s", trim(eq + 1));
+    }
+
+    fclose(fp);
+}
+
+// Look up "section.key"; later definitions win, names are case-insensitive
+const char *config_get(const char *name) {
+    pthread_once(&config_once, config_parse);
+
+    for (size_t i = config_count; i > 0; i--) {
+        if (strcasecmp(config_entries[i - 1].name, name) == 0) {
+            return config_entries[i - 1].value;
+        }
+    }
+    return NULL;
+}
+
+// Integer value with optional k/m/g suffix
+long config_get_int(const char *name, long default_value) {
+    const char *value = config_get(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+
+    char *end;
+    long result = strtol(value, &end, 10);
+    switch (tolower((unsigned char)*end)) {
+        case 'k': result *= 1024L; break;
+        case 'm': result *= 1024L * 1024; break;
+        case 'g': result *= 1024L * 1024 * 1024; break;
+        default: break;
+    }
+    return result;
+}
+
+// Boolean value: true/yes/on/1 or false/no/off/0
+int config_get_bool(const char *name, int default_value) {
+    const char *value = config_get(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+    if (strcasecmp(value, "true") == 0 || strcasecmp(value, "yes") == 0 ||
+        strcasecmp(value, "on") == 0) {
+        return 1;
+    }
+    if (strcasecmp(value, "false") == 0 || strcasecmp(value, "no") == 0 ||
+        strcasecmp(value, "off") == 0) {
+        return 0;
+    }
+    return config_get_int(name, default_value) != 0;
+}
@@ -0,0 +1,320 @@
+#include "vcs.h"
+#include <stdint.h>
+
+// Delta format:
+//   varint source size | varint target size
+//   copy:   1xxxxxxx  offset bytes (flags 0-3)  size bytes (flags 4-6)
+//   insert: 0nnnnnnn  followed by n literal bytes (1-127)
+#define DELTA_BLOCK 16
+#define DELTA_MIN_COPY 20
+#define DELTA_MAX_INSERT 127
+#define DELTA_MAX_COPY 0xffffff
+#define DELTA_MAX_CANDIDATES 16
+#define DELTA_HASH_BASE 257u
+
+// Output buffer that refuses to grow beyond a limit
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+    size_t limit;
+} DeltaBuf;
+
+static int buf_reserve(DeltaBuf *buf, size_t extra) {
+    if (buf->len + extra > buf->limit) {
+        return -1;
+    }
+    if (buf->len + extra <= buf->capacity) {
+        return 0;
+    }
+
+    size_t capacity = buf->capacity ? buf->capacity * 2 : 256;
+    while (capacity < buf->len + extra) {
+        capacity *= 2;
+    }
+    unsigned char *data = realloc(buf->data, capacity);
+    if (!data) {
+        return -1;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+static int buf_put_varint(DeltaBuf *buf, size_t value) {
+    if (buf_reserve(buf, 10) != 0) {
+        return -1;
+    }
+    do {
+        unsigned char c = value & 0x7f;
+        value >>= 7;
+        buf->data[buf->len++] = c | (value ? 0x80 : 0);
+    } while (value);
+    return 0;
+}
+
+static int emit_insert(DeltaBuf *buf, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        size_t chunk = len > DELTA_MAX_INSERT ? DELTA_MAX_INSERT : len;
+        if (buf_reserve(buf, chunk + 1) != 0) {
+            return -1;
+        }
+        buf->data[buf->len++] = (unsigned char)chunk;
+        memcpy(buf->data + buf->len, data, chunk);
+        buf->len += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int emit_copy(DeltaBuf *buf, size_t offset, size_t len) {
+    while (len > 0) {
+        size_t chunk = len > DELTA_MAX_COPY ? DELTA_MAX_COPY : len;
+        if (buf_reserve(buf, 8) != 0) {
+            return -1;
+        }
+
+        size_t op_pos = buf->len++;
+        unsigned char op = 0x80;
+        for (int i = 0; i < 4; i++) {
+            unsigned char byte = (offset >> (i * 8)) & 0xff;
+            if (byte) {
+                op |= 1 << i;
+                buf->data[buf->len++] = byte;
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            unsigned char byte = (chunk >> (i * 8)) & 0xff;
+            if (byte) {
+                op |= 1 << (4 + i);
+                buf->data[buf->len++] = byte;
+            }
+        }
+        buf->data[op_pos] = op;
+
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static uint32_t block_hash(const unsigned char *p) {
+    uint32_t h = 0;
+    for (int i = 0; i < DELTA_BLOCK; i++) {
+        h = h * DELTA_HASH_BASE + p[i];
+    }
+    return h;
+}
+
+static uint32_t mix_hash(uint32_t h) {
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+    return h;
+}
+
+// Encode target as copy/insert instructions against source.
+// Fails when the delta would exceed max_size bytes.
+int create_delta(const void *src, size_t src_size, const void *dst, size_t dst_size,
+                 size_t max_size, void **delta_out, size_t *delta_size) {
+    const unsigned char *source = src;
+    const unsigned char *target = dst;
+
+    if (src_size < DELTA_BLOCK || src_size > UINT32_MAX || dst_size > UINT32_MAX) {
+        return -1;
+    }
+
+    // Index every aligned block of the source by its hash
+    size_t blocks = src_size / DELTA_BLOCK;
+    size_t buckets = 1;
+    while (buckets < blocks) {
+        buckets <<= 1;
+    }
+    uint32_t *head = malloc(sizeof(uint32_t) * buckets);
+    uint32_t *next = malloc(sizeof(uint32_t) * blocks);
+    if (!head || !next) {
+        free(head);
+        free(next);
+        return -1;
+    }
+    memset(head, 0xff, sizeof(uint32_t) * buckets);
+
+    // Insert back to front so chains prefer earlier source offsets
+    for (size_t b = blocks; b > 0; b--) {
+        uint32_t bucket = mix_hash(block_hash(source + (b - 1) * DELTA_BLOCK)) & (buckets - 1);
+        next[b - 1] = head[bucket];
+        head[bucket] = (uint32_t)(b - 1);
+    }
+
+    DeltaBuf buf = {NULL, 0, 0, max_size};
+    int ret = -1;
+    if (buf_put_varint(&buf, src_size) != 0 || buf_put_varint(&buf, dst_size) != 0) {
+        goto done;
+    }
+
+    // Rolling hash over the target: h = sum t[i+k] * BASE^(BLOCK-1-k)
+    uint32_t top_power = 1;
+    for (int i = 1; i < DELTA_BLOCK; i++) {
+        top_power *= DELTA_HASH_BASE;
+    }
+
+    size_t pos = 0;
+    size_t insert_start = 0;
+    uint32_t h = dst_size >= DELTA_BLOCK ? block_hash(target) : 0;
+
+    while (pos + DELTA_BLOCK <= dst_size) {
+        size_t best_len = 0;
+        size_t best_offset = 0;
+        uint32_t bucket = mix_hash(h) & (buckets - 1);
+        int candidates = 0;
+
+        for (uint32_t b = head[bucket]; b != UINT32_MAX && candidates < DELTA_MAX_CANDIDATES;
+             b = next[b], candidates++) {
+            size_t offset = (size_t)b * DELTA_BLOCK;
+            if (memcmp(source + offset, target + pos, DELTA_BLOCK) != 0) {
+                continue;
+            }
+            size_t len = DELTA_BLOCK;
+            while (offset + len < src_size && pos + len < dst_size &&
+                   source[offset + len] == target[pos + len]) {
+                len++;
+            }
+            if (len > best_len) {
+                best_len = len;
+                best_offset = offset;
+            }
+        }
+
+        if (best_len < DELTA_MIN_COPY) {
+            // Slide the window one byte
+            if (pos + DELTA_BLOCK < dst_size) {
+                h = (h - target[pos] * top_power) * DELTA_HASH_BASE + target[pos + DELTA_BLOCK];
+            }
+            pos++;
+            continue;
+        }
+
+        // Grow the match backwards into bytes still pending insertion
+        while (best_offset > 0 && pos > insert_start &&
+               source[best_offset - 1] == target[pos - 1]) {
+            best_offset--;
+            pos--;
+            best_len++;
+        }
+
+        if (emit_insert(&buf, target + insert_start, pos - insert_start) != 0 ||
+            emit_copy(&buf, best_offset, best_len) != 0) {
+            goto done;
+        }
+
+        pos += best_len;
+        insert_start = pos;
+        if (pos + DELTA_BLOCK <= dst_size) {
+            h = block_hash(target + pos);
+        }
+    }
+
+    if (emit_insert(&buf, target + insert_start, dst_size - insert_start) != 0) {
+        goto done;
+    }
+
+    *delta_out = buf.data;
+    *delta_size = buf.len;
+    buf.data = NULL;
+    ret = 0;
+
+done:
+    free(buf.data);
+    free(head);
+    free(next);
+    return ret;
+}
+
+static int read_varint(const unsigned char **p, const unsigned char *end, size_t *value) {
+    size_t result = 0;
+    int shift = 0;
+    unsigned char c;
+
+    do {
+        if (*p >= end || shift > 63) {
+            return -1;
+        }
+        c = *(*p)++;
+        result |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+
+    *value = result;
+    return 0;
+}
+
+// Rebuild a target from its base and delta into a NUL-terminated buffer
+int apply_delta(const void *base, size_t base_size, const void *delta, size_t delta_size,
+                void **out, size_t *out_size) {
+    const unsigned char *p = delta;
+    const unsigned char *end = p + delta_size;
+    size_t src_size, dst_size;
+
+    if (read_varint(&p, end, &src_size) != 0 || read_varint(&p, end, &dst_size) != 0 ||
+        src_size != base_size) {
+        return -1;
+    }
+
+    unsigned char *result = malloc(dst_size + 1);
+    if (!result) {
+        return -1;
+    }
+
+    size_t pos = 0;
+    while (p < end) {
+        unsigned char op = *p++;
+
+        if (op & 0x80) {
+            size_t offset = 0;
+            size_t len = 0;
+            for (int i = 0; i < 4; i++) {
+                if (op & (1 << i)) {
+                    if (p >= end) goto fail;
+                    offset |= (size_t)*p++ << (i * 8);
+                }
+            }
+            for (int i = 0; i < 3; i++) {
+                if (op & (1 << (4 + i))) {
+                    if (p >= end) goto fail;
+                    len |= (size_t)*p++ << (i * 8);
+                }
+            }
+            if (len == 0) {
+                len = 0x10000;
+            }
+            if (offset + len < offset || offset + len > base_size || pos + len > dst_size) {
+                goto fail;
+            }
+            memcpy(result + pos, (const unsigned char *)base + offset, len);
+            pos += len;
+        } else if (op) {
+            if ((size_t)(end - p) < op || pos + op > dst_size) {
+                goto fail;
+            }
+            memcpy(result + pos, p, op);
+            p += op;
+            pos += op;
+        } else {
+            goto fail;
+        }
+    }
+
+    if (pos != dst_size) {
+        goto fail;
+    }
+
+    result[dst_size] = '\0';
+    *out = result;
+    *out_size = dst_size;
+    return 0;
+
+fail:
+    free(result);
+    return -1;
+}
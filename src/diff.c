@@ -0,0 +1,388 @@
+#include "vcs.h"
+
+// One diff in progress. path holds the directory being compared, so changes
+// found in trees can be reported with their full path.
+typedef struct {
+    Index *idx;
+    DiffCallback fn;
+    void *data;
+    char path[MAX_PATH];
+    int stopped;
+} DiffWalk;
+
+// Tree entry mode of an index entry: executable if the file was when staged
+static uint32_t diff_index_mode(const IndexEntry *entry) {
+    return (entry->mode & 0111) ? 0100755 : 0100644;
+}
+
+// Compare two names of one directory level in tree order, where a
+// directory sorts as its name followed by '/'
+static int diff_name_cmp(const char *a, size_t a_len, int a_dir,
+                         const char *b, size_t b_len, int b_dir) {
+    size_t n = a_len < b_len ? a_len : b_len;
+    int cmp = memcmp(a, b, n);
+    if (cmp != 0) {
+        return cmp;
+    }
+    unsigned char ca = a_len > n ? (unsigned char)a[n] : (a_dir ? '/' : '\0');
+    unsigned char cb = b_len > n ? (unsigned char)b[n] : (b_dir ? '/' : '\0');
+    return (ca > cb) - (ca < cb);
+}
+
+static int diff_report(DiffWalk *w, DiffStatus status, const char *path,
+                       const ObjectId *old_oid, uint32_t old_mode,
+                       const ObjectId *new_oid, uint32_t new_mode) {
+    DiffChange change;
+    change.status = status;
+    change.path = path;
+    change.old_path = path;
+    change.similarity = 0;
+    if (old_oid) {
+        change.old_oid = *old_oid;
+    } else {
+        oid_clear(&change.old_oid);
+    }
+    if (new_oid) {
+        change.new_oid = *new_oid;
+    } else {
+        oid_clear(&change.new_oid);
+    }
+    change.old_mode = old_mode;
+    change.new_mode = new_mode;
+    int ret = w->fn(&change, w->data);
+    if (ret != 0) {
+        w->stopped = ret > 0;
+        return -1;
+    }
+    return 0;
+}
+
+// Append a name to the directory path in w->path; returns the new length
+static int diff_path_push(DiffWalk *w, size_t prefix_len, const char *name, size_t name_len,
+                          int dir) {
+    if (prefix_len + name_len + 2 > sizeof(w->path)) {
+        fprintf(stderr, "Error: Path too long: %.*s%.*s\n", (int)prefix_len, w->path,
+                (int)name_len, name);
+        return -1;
+    }
+    memcpy(w->path + prefix_len, name, name_len);
+    size_t len = prefix_len + name_len;
+    if (dir) {
+        w->path[len++] = '/';
+    }
+    w->path[len] = '\0';
+    return (int)len;
+}
+
+// Read a tree object for a diff; a null ID is the empty tree
+static unsigned char *diff_read_tree(const ObjectId *oid, size_t *size) {
+    ObjectType type;
+    if (!oid || oid_is_null(oid)) {
+        *size = 0;
+        return malloc(1);
+    }
+    unsigned char *data = read_object(oid, size, &type);
+    if (!data || type != OBJ_TREE) {
+        fprintf(stderr, "Error: Failed to read tree %s\n", oid_hex(oid));
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+static int diff_tree_pair(DiffWalk *w, const ObjectId *old_tree, const ObjectId *new_tree,
+                          size_t prefix_len);
+
+// Report the difference between one entry of each side with the same name
+// (either side may be missing), recursing into directories
+static int diff_entry_pair(DiffWalk *w, size_t prefix_len, const TreeIter *old_it,
+                           const TreeIter *new_it) {
+    const TreeIter *it = old_it ? old_it : new_it;
+    int old_dir = old_it && S_ISDIR(old_it->mode);
+    int new_dir = new_it && S_ISDIR(new_it->mode);
+    int len = diff_path_push(w, prefix_len, it->name, it->name_len, old_dir || new_dir);
+    if (len < 0) {
+        return -1;
+    }
+
+    ObjectId old_oid, new_oid;
+    if (old_it) {
+        tree_iter_oid(old_it, &old_oid);
+    }
+    if (new_it) {
+        tree_iter_oid(new_it, &new_oid);
+    }
+
+    if (old_dir || new_dir) {
+        return diff_tree_pair(w, old_it ? &old_oid : NULL, new_it ? &new_oid : NULL,
+                              (size_t)len);
+    }
+    if (!old_it) {
+        return diff_report(w, DIFF_ADDED, w->path, NULL, 0, &new_oid, new_it->mode);
+    }
+    if (!new_it) {
+        return diff_report(w, DIFF_DELETED, w->path, &old_oid, old_it->mode, NULL, 0);
+    }
+    if (!oid_equal(&old_oid, &new_oid) || old_it->mode != new_it->mode) {
+        return diff_report(w, DIFF_MODIFIED, w->path, &old_oid, old_it->mode,
+                           &new_oid, new_it->mode);
+    }
+    return 0;
+}
+
+// Compare two trees (either may be missing) below the directory in
+// w->path, walking both sorted entry lists in lockstep. Subtrees with
+// equal IDs are identical and are not read.
+static int diff_tree_pair(DiffWalk *w, const ObjectId *old_tree, const ObjectId *new_tree,
+                          size_t prefix_len) {
+    if (old_tree && new_tree && oid_equal(old_tree, new_tree)) {
+        return 0;
+    }
+
+    size_t old_size = 0, new_size = 0;
+    unsigned char *old_data = old_tree ? diff_read_tree(old_tree, &old_size) : NULL;
+    unsigned char *new_data = new_tree ? diff_read_tree(new_tree, &new_size) : NULL;
+    if ((old_tree && !old_data) || (new_tree && !new_data)) {
+        free(old_data);
+        free(new_data);
+        return -1;
+    }
+
+    TreeIter old_it, new_it;
+    tree_iter_init(&old_it, old_data, old_size);
+    tree_iter_init(&new_it, new_data, new_size);
+    int old_more = old_data ? tree_iter_next(&old_it) : 0;
+    int new_more = new_data ? tree_iter_next(&new_it) : 0;
+    int ret = 0;
+    while (ret == 0 && (old_more > 0 || new_more > 0)) {
+        int cmp;
+        if (old_more <= 0) {
+            cmp = 1;
+        } else if (new_more <= 0) {
+            cmp = -1;
+        } else {
+            cmp = diff_name_cmp(old_it.name, old_it.name_len, S_ISDIR(old_it.mode),
+                                new_it.name, new_it.name_len, S_ISDIR(new_it.mode));
+        }
+
+        ret = diff_entry_pair(w, prefix_len, cmp <= 0 ? &old_it : NULL,
+                              cmp >= 0 ? &new_it : NULL);
+        if (cmp <= 0) {
+            old_more = tree_iter_next(&old_it);
+        }
+        if (cmp >= 0) {
+            new_more = tree_iter_next(&new_it);
+        }
+    }
+    if (ret == 0 && (old_more < 0 || new_more < 0)) {
+        fprintf(stderr, "Error: Malformed tree below '%.*s'\n", (int)prefix_len, w->path);
+        ret = -1;
+    }
+
+    w->path[prefix_len] = '\0';
+    free(old_data);
+    free(new_data);
+    return ret;
+}
+
+// Compare two trees; a null ID stands for the empty tree. Changed files
+// are passed to fn in path order; a positive return from fn stops the
+// diff and a negative one fails it.
+int diff_trees(const ObjectId *old_tree, const ObjectId *new_tree, DiffCallback fn, void *data) {
+    DiffWalk w;
+    memset(&w, 0, sizeof(w));
+    w.fn = fn;
+    w.data = data;
+    int ret = diff_tree_pair(&w, old_tree, new_tree, 0);
+    return w.stopped ? 0 : ret;
+}
+
+// End of the index entries [i, end) below the directory dir (dir_len bytes,
+// including the trailing '/'). A valid cache-tree count is trusted if the
+// range it gives starts and stops at the directory's boundaries.
+static size_t diff_dir_end(Index *idx, size_t i, size_t end, const char *dir, size_t dir_len,
+                           size_t cached) {
+    if (cached > 0 && cached <= end - i) {
+        size_t last = i + cached - 1;
+        const IndexEntry *e = &idx->entries[last];
+        if (e->path_len > dir_len && memcmp(index_path(idx, e), dir, dir_len) == 0 &&
+            (last + 1 == end || idx->entries[last + 1].path_len <= dir_len ||
+             memcmp(index_path(idx, &idx->entries[last + 1]), dir, dir_len) != 0)) {
+            return i + cached;
+        }
+    }
+    size_t j = i;
+    while (j < end && idx->entries[j].path_len > dir_len &&
+           memcmp(index_path(idx, &idx->entries[j]), dir, dir_len) == 0) {
+        j++;
+    }
+    return j;
+}
+
+// Compare a tree (or nothing) with index entries [start, end), all below
+// the directory in w->path. Where the cache-tree has a valid tree ID for
+// a subdirectory equal to the tree's, its entries are skipped unread.
+static int diff_tree_entries(DiffWalk *w, const ObjectId *tree, size_t start, size_t end,
+                             size_t prefix_len) {
+    Index *idx = w->idx;
+    size_t size = 0;
+    unsigned char *data = tree ? diff_read_tree(tree, &size) : NULL;
+    if (tree && !data) {
+        return -1;
+    }
+
+    TreeIter it;
+    tree_iter_init(&it, data, size);
+    int more = data ? tree_iter_next(&it) : 0;
+    size_t i = start;
+    int ret = 0;
+    while (ret == 0 && (more > 0 || i < end)) {
+        const char *path = NULL;
+        const char *name = NULL;
+        size_t name_len = 0;
+        int is_dir = 0;
+        if (i < end) {
+            path = index_path(idx, &idx->entries[i]);
+            name = path + prefix_len;
+            const char *slash = strchr(name, '/');
+            is_dir = slash != NULL;
+            name_len = slash ? (size_t)(slash - name) : strlen(name);
+        }
+
+        int cmp;
+        if (more <= 0) {
+            cmp = 1;
+        } else if (i >= end) {
+            cmp = -1;
+        } else {
+            cmp = diff_name_cmp(it.name, it.name_len, S_ISDIR(it.mode), name, name_len, is_dir);
+        }
+
+        if (cmp < 0) {
+            // Only in the tree
+            ret = diff_entry_pair(w, prefix_len, &it, NULL);
+            w->path[prefix_len] = '\0';
+            more = tree_iter_next(&it);
+            continue;
+        }
+
+        if (!is_dir) {
+            const IndexEntry *entry = &idx->entries[i++];
+            if (cmp > 0) {
+                ret = diff_report(w, DIFF_ADDED, path, NULL, 0, &entry->oid,
+                                  diff_index_mode(entry));
+            } else {
+                ObjectId oid;
+                tree_iter_oid(&it, &oid);
+                if (!oid_equal(&oid, &entry->oid) || it.mode != diff_index_mode(entry)) {
+                    ret = diff_report(w, DIFF_MODIFIED, path, &oid, it.mode, &entry->oid,
+                                      diff_index_mode(entry));
+                }
+                more = tree_iter_next(&it);
+            }
+            continue;
+        }
+
+        int len = diff_path_push(w, prefix_len, name, name_len, 1);
+        if (len < 0) {
+            ret = -1;
+            break;
+        }
+        ObjectId sub_oid;
+        size_t sub_count = 0;
+        int sub_cached = cache_tree_lookup(idx, w->path, (size_t)len - 1, &sub_oid,
+                                           &sub_count) > 0;
+        size_t j = diff_dir_end(idx, i, end, w->path, (size_t)len, sub_cached ? sub_count : 0);
+        if (cmp > 0) {
+            // Only in the index: every entry below is new
+            for (; i < j && ret == 0; i++) {
+                const IndexEntry *entry = &idx->entries[i];
+                ret = diff_report(w, DIFF_ADDED, index_path(idx, entry), NULL, 0,
+                                  &entry->oid, diff_index_mode(entry));
+            }
+        } else {
+            ObjectId oid;
+            tree_iter_oid(&it, &oid);
+            if (!sub_cached || sub_count != j - i || !oid_equal(&sub_oid, &oid)) {
+                ret = diff_tree_entries(w, &oid, i, j, (size_t)len);
+            }
+            more = tree_iter_next(&it);
+        }
+        w->path[prefix_len] = '\0';
+        i = j;
+    }
+    if (ret == 0 && more < 0) {
+        fprintf(stderr, "Error: Malformed tree below '%.*s'\n", (int)prefix_len, w->path);
+        ret = -1;
+    }
+
+    free(data);
+    return ret;
+}
+
+// Compare a tree (null ID: the empty tree) with the index, as the changes
+// staged on top of it. With a valid cache-tree this only reads the trees
+// of directories something was staged under.
+int diff_tree_index(const ObjectId *tree, Index *idx, DiffCallback fn, void *data) {
+    DiffWalk w;
+    memset(&w, 0, sizeof(w));
+    w.idx = idx;
+    w.fn = fn;
+    w.data = data;
+    if (tree && oid_is_null(tree)) {
+        tree = NULL;
+    }
+
+    ObjectId cached_oid;
+    size_t cached_count;
+    if (tree && cache_tree_lookup(idx, "", 0, &cached_oid, &cached_count) > 0 &&
+        cached_count == idx->count && oid_equal(&cached_oid, tree)) {
+        return 0;
+    }
+    int ret = diff_tree_entries(&w, tree, 0, idx->count, 0);
+    return w.stopped ? 0 : ret;
+}
+
+// Compare the index with the working tree. Files whose stat data matches
+// their entry are not read; while a filesystem monitor runs, only files it
+// reported are looked at.
+int diff_index_worktree(Index *idx, DiffCallback fn, void *data) {
+    DiffWalk w;
+    memset(&w, 0, sizeof(w));
+    w.fn = fn;
+    w.data = data;
+
+    int updated = 0;
+    int monitored = fsmonitor_refresh(idx, &updated) > 0;
+    for (size_t i = 0; i < idx->count; i++) {
+        const IndexEntry *entry = &idx->entries[i];
+        if ((monitored && (entry->flags & INDEX_ENTRY_FSMONITOR_VALID)) ||
+            (entry->flags & INDEX_ENTRY_SKIP_WORKTREE)) {
+            continue;
+        }
+
+        const char *path = index_path(idx, entry);
+        struct stat st;
+        int ret = 0;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ret = diff_report(&w, DIFF_DELETED, path, &entry->oid, diff_index_mode(entry),
+                              NULL, 0);
+        } else if (!index_entry_uptodate(idx, entry, &st)) {
+            ObjectId oid;
+            uint32_t mode = (st.st_mode & 0111) ? 0100755 : 0100644;
+            if (hash_object_file(path, OBJ_BLOB, &oid) != 0) {
+                fprintf(stderr, "Error: Failed to read '%s'\n", path);
+                return -1;
+            }
+            // An entry staged without a mode compares on content alone
+            uint32_t old_mode = entry->mode ? diff_index_mode(entry) : mode;
+            if (!oid_equal(&oid, &entry->oid) || mode != old_mode) {
+                ret = diff_report(&w, DIFF_MODIFIED, path, &entry->oid, old_mode, &oid, mode);
+            }
+        }
+        if (ret != 0) {
+            return w.stopped ? 0 : -1;
+        }
+    }
+    return 0;
+}
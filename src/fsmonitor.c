@@ -0,0 +1,734 @@
+#include "vcs.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+// Filesystem monitor. `nit fsmonitor` watches every directory of the working
+// tree with inotify and numbers the changes it sees. Commands ask it over a
+// Unix socket for the paths changed since the token they saved in the index
+// (the FSMN extension) and only examine those; entries found clean are
+// flagged INDEX_ENTRY_FSMONITOR_VALID until the monitor reports them again.
+//
+// Protocol: one request line per connection.
+//   "query <token>\n"  reply: new token, NUL, then changed paths each followed
+//                      by NUL; a single "/" path means anything may have changed
+//   "status\n"         reply: one line describing the daemon
+//   "stop\n"           reply: "ok\n", then the daemon exits
+// Tokens are "nit:<session>:<sequence>"; one from another daemon session, or
+// older than the last time the change log was reset, gets the "/" answer.
+
+#define FSMONITOR_TOKEN_MAX 64
+#define FSMONITOR_REQUEST_MAX 256
+#define FSMONITOR_PATHS_MAX (1 << 20)
+#define FSMONITOR_TIMEOUT_SEC 5
+
+static int fsmonitor_connect(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", FSMONITOR_SOCKET);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct timeval timeout = {FSMONITOR_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send a request and read the whole reply; NULL if no daemon answers
+static char *fsmonitor_request(const char *request, size_t *len_out) {
+    int fd = fsmonitor_connect();
+    if (fd < 0) {
+        return NULL;
+    }
+    if (write_all(fd, request, strlen(request)) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t len = 0;
+    size_t capacity = 4096;
+    char *reply = malloc(capacity + 1);
+    while (reply) {
+        if (len == capacity) {
+            char *grown = realloc(reply, capacity * 2 + 1);
+            if (!grown) {
+                free(reply);
+                reply = NULL;
+                break;
+            }
+            reply = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, reply + len, capacity - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            free(reply);
+            reply = NULL;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+
+    if (reply) {
+        reply[len] = '\0';
+        *len_out = len;
+    }
+    return reply;
+}
+
+// Clear the valid flag on the entry for path and on every entry below it
+static int fsmonitor_invalidate(Index *idx, const char *path) {
+    int changed = 0;
+    int found;
+    size_t pos = index_position(idx, path, &found);
+    if (found && (idx->entries[pos].flags & INDEX_ENTRY_FSMONITOR_VALID)) {
+        index_set_flags(idx, pos, 0, INDEX_ENTRY_FSMONITOR_VALID);
+        changed = 1;
+    }
+
+    char prefix[MAX_PATH];
+    size_t len = (size_t)snprintf(prefix, sizeof(prefix), "%s/", path);
+    if (len >= sizeof(prefix)) {
+        return changed;
+    }
+    for (pos = index_position(idx, prefix, &found); pos < idx->count; pos++) {
+        const IndexEntry *entry = &idx->entries[pos];
+        if (entry->path_len < len || memcmp(index_path(idx, entry), prefix, len) != 0) {
+            break;
+        }
+        if (entry->flags & INDEX_ENTRY_FSMONITOR_VALID) {
+            index_set_flags(idx, pos, 0, INDEX_ENTRY_FSMONITOR_VALID);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+static int fsmonitor_invalidate_all(Index *idx) {
+    int changed = 0;
+    for (size_t i = 0; i < idx->count; i++) {
+        if (idx->entries[i].flags & INDEX_ENTRY_FSMONITOR_VALID) {
+            index_set_flags(idx, i, 0, INDEX_ENTRY_FSMONITOR_VALID);
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+// Bring the valid flags up to date with the monitor. Entries changed since
+// the token saved in the index lose their flag and the new token is saved.
+// Returns 1 if the monitor answered, so entries still flagged valid need not
+// be examined, and 0 if there is no monitor, in which case every flag is
+// cleared. *updated is set if the index was changed.
+int fsmonitor_refresh(Index *idx, int *updated) {
+    char token[FSMONITOR_TOKEN_MAX] = "";
+    size_t size;
+    const char *saved = index_extension(idx, INDEX_EXT_FSMONITOR, &size);
+    if (saved && size < sizeof(token)) {
+        memcpy(token, saved, size);
+        token[size] = '\0';
+    }
+
+    char *reply = NULL;
+    size_t len = 0;
+    if (config_get_bool("core.fsmonitor", 1)) {
+        char request[FSMONITOR_REQUEST_MAX];
+        snprintf(request, sizeof(request), "query %s\n", token);
+        reply = fsmonitor_request(request, &len);
+    }
+
+    *updated = 0;
+    size_t token_len = reply ? strnlen(reply, len) : 0;
+    if (!reply || token_len == 0 || token_len >= FSMONITOR_TOKEN_MAX || token_len == len) {
+        // Nothing vouches for the flags any more
+        free(reply);
+        if (saved) {
+            index_drop_extension(idx, INDEX_EXT_FSMONITOR);
+            *updated = 1;
+        }
+        if (fsmonitor_invalidate_all(idx)) {
+            *updated = 1;
+        }
+        return 0;
+    }
+
+    const char *path = reply + token_len + 1;
+    const char *end = reply + len;
+    if (!*token || (path < end && strcmp(path, "/") == 0)) {
+        if (fsmonitor_invalidate_all(idx)) {
+            *updated = 1;
+        }
+    } else {
+        for (; path < end; path += strlen(path) + 1) {
+            if (fsmonitor_invalidate(idx, path)) {
+                *updated = 1;
+            }
+        }
+    }
+
+    if (strcmp(token, reply) != 0) {
+        index_set_extension(idx, INDEX_EXT_FSMONITOR, reply, token_len);
+        *updated = 1;
+    }
+    free(reply);
+    return 1;
+}
+
+// Ask a running daemon to exit
+int fsmonitor_stop(void) {
+    size_t len;
+    char *reply = fsmonitor_request("stop\n", &len);
+    if (!reply) {
+        fprintf(stderr, "Error: fsmonitor is not running\n");
+        return -1;
+    }
+    free(reply);
+    printf("fsmonitor stopped\n");
+    return 0;
+}
+
+// Describe the running daemon
+int fsmonitor_status(void) {
+    size_t len;
+    char *reply = fsmonitor_request("status\n", &len);
+    if (!reply) {
+        printf("fsmonitor is not running\n");
+        return -1;
+    }
+    printf("%s", reply);
+    free(reply);
+    return 0;
+}
+
+#ifdef __linux__
+
+#define FSMONITOR_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | \
+                        IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | \
+                        IN_DONT_FOLLOW)
+
+// Changed path and the sequence number of its latest change
+typedef struct {
+    char *path;
+    uint64_t seq;
+} FsmonitorPath;
+
+typedef struct {
+    int inotify_fd;
+    int listen_fd;
+    int root_wd;
+    char session[32];
+    uint64_t seq;               // last change seen
+    uint64_t floor;             // tokens before this get the "/" answer
+    char **watches;             // directory of each watch descriptor; "" for the root
+    size_t watch_capacity;
+    size_t watch_count;
+    FsmonitorPath *paths;       // open-addressed hash table
+    size_t path_count;
+    size_t path_capacity;
+} Fsmonitor;
+
+static volatile sig_atomic_t fsmonitor_stopping;
+
+static void fsmonitor_signal(int sig) {
+    (void)sig;
+    fsmonitor_stopping = 1;
+}
+
+static size_t fsmonitor_hash(const char *path) {
+    size_t hash = 2166136261u;
+    for (; *path; path++) {
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    }
+    return hash;
+}
+
+static void fsmonitor_forget(Fsmonitor *mon) {
+    for (size_t i = 0; i < mon->path_capacity; i++) {
+        free(mon->paths[i].path);
+    }
+    memset(mon->paths, 0, mon->path_capacity * sizeof(FsmonitorPath));
+    mon->path_count = 0;
+}
+
+static int fsmonitor_grow(Fsmonitor *mon) {
+    size_t capacity = mon->path_capacity ? mon->path_capacity * 2 : 1024;
+    FsmonitorPath *paths = calloc(capacity, sizeof(FsmonitorPath));
+    if (!paths) {
+        return -1;
+    }
+    for (size_t i = 0; i < mon->path_capacity; i++) {
+        if (mon->paths[i].path) {
+            size_t slot = fsmonitor_hash(mon->paths[i].path) & (capacity - 1);
+            while (paths[slot].path) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            paths[slot] = mon->paths[i];
+        }
+    }
+    free(mon->paths);
+    mon->paths = paths;
+    mon->path_capacity = capacity;
+    return 0;
+}
+
+// Everything before now is unknown: tokens older than this get "/"
+static void fsmonitor_reset(Fsmonitor *mon) {
+    fsmonitor_forget(mon);
+    mon->floor = ++mon->seq;
+}
+
+static void fsmonitor_record(Fsmonitor *mon, const char *path) {
+    if (mon->path_count >= FSMONITOR_PATHS_MAX ||
+        ((mon->path_count + 1) * 2 > mon->path_capacity && fsmonitor_grow(mon) != 0)) {
+        fsmonitor_reset(mon);
+        return;
+    }
+
+    mon->seq++;
+    size_t slot = fsmonitor_hash(path) & (mon->path_capacity - 1);
+    while (mon->paths[slot].path) {
+        if (strcmp(mon->paths[slot].path, path) == 0) {
+            mon->paths[slot].seq = mon->seq;
+            return;
+        }
+        slot = (slot + 1) & (mon->path_capacity - 1);
+    }
+    if ((mon->paths[slot].path = strdup(path)) == NULL) {
+        fsmonitor_reset(mon);
+        return;
+    }
+    mon->paths[slot].seq = mon->seq;
+    mon->path_count++;
+}
+
+static int fsmonitor_add_watch(Fsmonitor *mon, const char *path) {
+    int wd = inotify_add_watch(mon->inotify_fd, *path ? path : ".", FSMONITOR_MASK);
+    if (wd < 0) {
+        // Gone already, or not a directory after all
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return 0;
+        }
+        fprintf(stderr, "Error: Cannot watch '%s': %s\n", *path ? path : ".",
+                errno == ENOSPC ? "inotify watch limit reached "
+                                  "(see /proc/sys/fs/inotify/max_user_watches)"
+                                : strerror(errno));
+        return -1;
+    }
+
+    if ((size_t)wd >= mon->watch_capacity) {
+        size_t capacity = mon->watch_capacity ? mon->watch_capacity : 1024;
+        while (capacity <= (size_t)wd) {
+            capacity *= 2;
+        }
+        char **watches = realloc(mon->watches, capacity * sizeof(char *));
+        if (!watches) {
+            return -1;
+        }
+        memset(watches + mon->watch_capacity, 0,
+               (capacity - mon->watch_capacity) * sizeof(char *));
+        mon->watches = watches;
+        mon->watch_capacity = capacity;
+    }
+    if (!mon->watches[wd]) {
+        mon->watch_count++;
+    }
+    free(mon->watches[wd]);
+    mon->watches[wd] = strdup(path);
+    return mon->watches[wd] ? 0 : -1;
+}
+
+// Watch a directory and everything below it, except the repository itself
+static int fsmonitor_watch_tree(Fsmonitor *mon, const char *path) {
+    if (fsmonitor_add_watch(mon, path) != 0) {
+        return -1;
+    }
+
+    DIR *d = opendir(*path ? path : ".");
+    if (!d) {
+        return 0;
+    }
+    int ret = 0;
+    struct dirent *entry;
+    while (ret == 0 && (entry = readdir(d)) != NULL) {
+        const char *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+            (!*path && strcmp(name, VCS_DIR) == 0)) {
+            continue;
+        }
+        char child[MAX_PATH];
+        if ((size_t)snprintf(child, sizeof(child), "%s%s%s", path, *path ? "/" : "", name) >=
+            sizeof(child)) {
+            continue;
+        }
+
+        struct stat st;
+        if (entry->d_type == DT_DIR ||
+            (entry->d_type == DT_UNKNOWN && lstat(child, &st) == 0 && S_ISDIR(st.st_mode))) {
+            ret = fsmonitor_watch_tree(mon, child);
+        }
+    }
+    closedir(d);
+    return ret;
+}
+
+// Stop watching a directory that moved away, and everything below it
+static void fsmonitor_unwatch_tree(Fsmonitor *mon, const char *path) {
+    size_t len = strlen(path);
+    for (size_t wd = 0; wd < mon->watch_capacity; wd++) {
+        const char *dir = mon->watches[wd];
+        if (dir && strncmp(dir, path, len) == 0 && (dir[len] == '\0' || dir[len] == '/')) {
+            inotify_rm_watch(mon->inotify_fd, (int)wd);
+            free(mon->watches[wd]);
+            mon->watches[wd] = NULL;
+            mon->watch_count--;
+        }
+    }
+}
+
+static int fsmonitor_handle_event(Fsmonitor *mon, const struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        fsmonitor_reset(mon);
+        return 0;
+    }
+    if (event->wd < 0 || (size_t)event->wd >= mon->watch_capacity || !mon->watches[event->wd]) {
+        return 0;
+    }
+    if (event->wd == mon->root_wd && (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+        fprintf(stderr, "Error: Working tree was moved or deleted\n");
+        return -1;
+    }
+    if (event->mask & IN_IGNORED) {
+        free(mon->watches[event->wd]);
+        mon->watches[event->wd] = NULL;
+        mon->watch_count--;
+        return 0;
+    }
+    if (event->len == 0 || !event->name[0]) {
+        return 0;
+    }
+
+    const char *dir = mon->watches[event->wd];
+    if (!*dir && strcmp(event->name, VCS_DIR) == 0) {
+        return 0;
+    }
+    char path[MAX_PATH];
+    if ((size_t)snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "", event->name) >=
+        sizeof(path)) {
+        return 0;
+    }
+
+    fsmonitor_record(mon, path);
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & IN_MOVED_FROM) {
+            fsmonitor_unwatch_tree(mon, path);
+        } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            // Anything created inside before the watch existed is covered by
+            // the directory's own entry, which clients treat as a prefix
+            return fsmonitor_watch_tree(mon, path);
+        }
+    }
+    return 0;
+}
+
+// Process every queued event, so a reply covers all changes made before the
+// request arrived
+static int fsmonitor_drain(Fsmonitor *mon) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(mon->inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return n < 0 && errno != EAGAIN ? -1 : 0;
+        }
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (fsmonitor_handle_event(mon, event) != 0) {
+                return -1;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static void fsmonitor_reply_query(Fsmonitor *mon, int fd, const char *token) {
+    char current[FSMONITOR_TOKEN_MAX];
+    int len = snprintf(current, sizeof(current), "nit:%s:%llu", mon->session,
+                       (unsigned long long)mon->seq);
+    if (write_all(fd, current, len + 1) != 0) {
+        return;
+    }
+
+    // Only tokens from this session and after the last reset can be answered
+    char prefix[FSMONITOR_TOKEN_MAX];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "nit:%s:", mon->session);
+    char *end = NULL;
+    unsigned long long since = 0;
+    if (strncmp(token, prefix, prefix_len) == 0) {
+        errno = 0;
+        since = strtoull(token + prefix_len, &end, 10);
+    }
+    if (!end || *end || errno || since < mon->floor || since > mon->seq) {
+        write_all(fd, "/", 2);
+        return;
+    }
+
+    for (size_t i = 0; i < mon->path_capacity; i++) {
+        if (mon->paths[i].path && mon->paths[i].seq > since &&
+            write_all(fd, mon->paths[i].path, strlen(mon->paths[i].path) + 1) != 0) {
+            return;
+        }
+    }
+}
+
+// Serve one client; returns 1 if the daemon should stop, because the client
+// asked or because events can no longer be followed
+static int fsmonitor_serve(Fsmonitor *mon, int fd) {
+    struct timeval timeout = {FSMONITOR_TIMEOUT_SEC, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[FSMONITOR_REQUEST_MAX];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        ssize_t n = read(fd, request + len, sizeof(request) - 1 - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        if (memchr(request, '\n', len)) {
+            break;
+        }
+    }
+    request[len] = '\0';
+    char *newline = strchr(request, '\n');
+    if (!newline) {
+        return 0;
+    }
+    *newline = '\0';
+
+    int stop = 0;
+    if (strncmp(request, "query ", 6) == 0) {
+        // Without a reply the client falls back to a full scan
+        if (fsmonitor_drain(mon) != 0) {
+            return 1;
+        }
+        fsmonitor_reply_query(mon, fd, request + 6);
+    } else if (strcmp(request, "status") == 0) {
+        char line[256];
+        int n = snprintf(line, sizeof(line),
+                         "fsmonitor running (pid %ld), watching %zu directories, "
+                         "%zu changed paths\n",
+                         (long)getpid(), mon->watch_count, mon->path_count);
+        write_all(fd, line, n);
+    } else if (strcmp(request, "stop") == 0) {
+        write_all(fd, "ok\n", 3);
+        stop = 1;
+    }
+    return stop;
+}
+
+static int fsmonitor_listen(Fsmonitor *mon) {
+    // A socket left by a daemon that died can be replaced
+    int existing = fsmonitor_connect();
+    if (existing >= 0) {
+        close(existing);
+        fprintf(stderr, "Error: fsmonitor is already running\n");
+        return -1;
+    }
+    unlink(FSMONITOR_SOCKET);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", FSMONITOR_SOCKET);
+
+    mon->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (mon->listen_fd < 0 ||
+        bind(mon->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(mon->listen_fd, 16) != 0) {
+        perror("fsmonitor socket");
+        return -1;
+    }
+    return 0;
+}
+
+static void fsmonitor_free(Fsmonitor *mon) {
+    for (size_t i = 0; i < mon->watch_capacity; i++) {
+        free(mon->watches[i]);
+    }
+    free(mon->watches);
+    fsmonitor_forget(mon);
+    free(mon->paths);
+    if (mon->inotify_fd >= 0) {
+        close(mon->inotify_fd);
+    }
+    if (mon->listen_fd >= 0) {
+        close(mon->listen_fd);
+        unlink(FSMONITOR_SOCKET);
+    }
+}
+
+// Run the daemon in this process. With daemonize, detach into the background
+// once the socket is listening and the whole tree is watched.
+int fsmonitor_run(int daemonize) {
+    Fsmonitor mon;
+    memset(&mon, 0, sizeof(mon));
+    mon.inotify_fd = -1;
+    mon.listen_fd = -1;
+    snprintf(mon.session, sizeof(mon.session), "%lx.%lx", (long)getpid(), (long)time(NULL));
+
+    int ready[2] = {-1, -1};
+    if (daemonize) {
+        if (pipe(ready) != 0) {
+            perror("pipe");
+            return -1;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return -1;
+        }
+        if (pid > 0) {
+            // Wait for the daemon to report that it is serving
+            close(ready[1]);
+            char ok = 0;
+            ssize_t n;
+            while ((n = read(ready[0], &ok, 1)) < 0 && errno == EINTR) {
+            }
+            close(ready[0]);
+            if (n != 1 || ok != 1) {
+                waitpid(pid, NULL, 0);
+                return -1;
+            }
+            printf("fsmonitor started (pid %ld)\n", (long)pid);
+            return 0;
+        }
+        close(ready[0]);
+        setsid();
+        snprintf(mon.session, sizeof(mon.session), "%lx.%lx", (long)getpid(), (long)time(NULL));
+    }
+
+    mon.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int ret = -1;
+    if (mon.inotify_fd < 0) {
+        perror("inotify_init1");
+    } else if (fsmonitor_listen(&mon) == 0 && fsmonitor_watch_tree(&mon, "") == 0) {
+        mon.root_wd = 0;
+        for (size_t wd = 0; wd < mon.watch_capacity; wd++) {
+            if (mon.watches[wd] && !*mon.watches[wd]) {
+                mon.root_wd = (int)wd;
+                break;
+            }
+        }
+        ret = 0;
+    }
+
+    if (daemonize) {
+        char ok = ret == 0;
+        write_all(ready[1], &ok, 1);
+        close(ready[1]);
+        if (ret != 0) {
+            fsmonitor_free(&mon);
+            exit(1);
+        }
+        int null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+    } else if (ret == 0) {
+        printf("fsmonitor watching %zu directories\n", mon.watch_count);
+        fflush(stdout);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = fsmonitor_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (ret == 0 && !fsmonitor_stopping) {
+        struct pollfd fds[2] = {{mon.inotify_fd, POLLIN, 0}, {mon.listen_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                ret = -1;
+            }
+            continue;
+        }
+        if ((fds[0].revents & POLLIN) && fsmonitor_drain(&mon) != 0) {
+            ret = -1;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            int client = accept(mon.listen_fd, NULL, NULL);
+            if (client >= 0) {
+                int stop = fsmonitor_serve(&mon, client);
+                close(client);
+                if (stop) {
+                    break;
+                }
+            }
+        }
+    }
+
+    fsmonitor_free(&mon);
+    if (daemonize) {
+        exit(ret == 0 ? 0 : 1);
+    }
+    return ret;
+}
+
+#else
+
+int fsmonitor_run(int daemonize) {
+    (void)daemonize;
+    fprintf(stderr, "Error: fsmonitor needs inotify, which this platform does not have\n");
+    return -1;
+}
+
+#endif
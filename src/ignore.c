@@ -0,0 +1,493 @@
+#include "vcs.h"
+#include <fcntl.h>
+
+// Ignore patterns from a .nitignore file (or .vcs/info/exclude), compiled
+// once. Patterns without wildcards, and "*literal" suffix patterns, go into
+// a hash table so most names are decided by a few lookups; only the rest
+// are matched as globs. Within a file the last matching pattern wins; a
+// file deeper in the tree takes precedence over its parents.
+
+typedef enum {
+    PATTERN_NAME,       // literal basename, e.g. "build"
+    PATTERN_PATH,       // literal path relative to the file, e.g. "/out" or "doc/tmp"
+    PATTERN_SUFFIX,     // "*" followed by a literal, e.g. "*.o"
+    PATTERN_GLOB        // anything else
+} PatternKind;
+
+typedef struct {
+    char *text;         // without '!', leading '/' and trailing '/'
+    size_t len;
+    size_t literal_len; // literal prefix before the first wildcard
+    PatternKind kind;
+    int negated;
+    int dir_only;
+    int anchored;       // matched against the relative path, not the basename
+} IgnorePattern;
+
+// Hash slot for literal and suffix patterns: the last pattern with this key
+// that matches anything, and the last that matches directories only
+typedef struct {
+    const char *key;
+    size_t key_len;
+    PatternKind kind;
+    long last_any;
+    long last_dir;
+} IgnoreSlot;
+
+struct IgnoreList {
+    const IgnoreList *parent;
+    char *base;         // directory holding the file; "" for the root
+    size_t base_len;
+    IgnorePattern *patterns;
+    size_t count;
+    IgnoreSlot *slots;
+    size_t slot_mask;
+    size_t *suffix_lens; // distinct suffix lengths
+    size_t suffix_len_count;
+    size_t *globs;      // indexes of glob patterns, ascending
+    size_t glob_count;
+};
+
+static int is_wildcard(char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+static size_t ignore_hash(PatternKind kind, const char *key, size_t len) {
+    uint64_t hash = 1469598103934665603ULL ^ (uint64_t)kind;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+static IgnoreSlot *ignore_slot(const IgnoreList *list, PatternKind kind,
+                               const char *key, size_t len) {
+    size_t i = ignore_hash(kind, key, len) & list->slot_mask;
+    while (list->slots[i].key) {
+        IgnoreSlot *slot = &list->slots[i];
+        if (slot->kind == kind && slot->key_len == len && memcmp(slot->key, key, len) == 0) {
+            return slot;
+        }
+        i = (i + 1) & list->slot_mask;
+    }
+    return &list->slots[i];
+}
+
+// Glob match: '*' and '?' stop at '/', "**" crosses directories, "[...]"
+// is a character class and '\' escapes the next character
+static int glob_match(const char *p, const char *s) {
+    for (; *p; p++, s++) {
+        switch (*p) {
+            case '?':
+                if (!*s || *s == '/') {
+                    return 0;
+                }
+                break;
+
+            case '*':
+                if (p[1] == '*') {
+                    p += 2;
+                    if (*p == '/') {
+                        // "**/" matches zero or more leading directories
+                        for (const char *t = s;;) {
+                            if (glob_match(p + 1, t)) {
+                                return 1;
+                            }
+                            if (!(t = strchr(t, '/'))) {
+                                return 0;
+                            }
+                            t++;
+                        }
+                    }
+                    for (;; s++) {
+                        if (glob_match(p, s)) {
+                            return 1;
+                        }
+                        if (!*s) {
+                            return 0;
+                        }
+                    }
+                }
+                for (p++;; s++) {
+                    if (glob_match(p, s)) {
+                        return 1;
+                    }
+                    if (!*s || *s == '/') {
+                        return 0;
+                    }
+                }
+
+            case '[': {
+                if (!*s || *s == '/') {
+                    return 0;
+                }
+                const char *q = p + 1;
+                int negate = *q == '!' || *q == '^';
+                if (negate) {
+                    q++;
+                }
+                int matched = 0;
+                for (int first = 1; *q && (*q != ']' || first); q++, first = 0) {
+                    unsigned char lo = *q;
+                    if (lo == '\\' && q[1]) {
+                        lo = *++q;
+                    }
+                    unsigned char hi = lo;
+                    if (q[1] == '-' && q[2] && q[2] != ']') {
+                        q += 2;
+                        if (*q == '\\' && q[1]) {
+                            q++;
+                        }
+                        hi = *q;
+                    }
+                    if ((unsigned char)*s >= lo && (unsigned char)*s <= hi) {
+                        matched = 1;
+                    }
+                }
+                if (!*q) {
+                    // Unterminated class: a literal '['
+                    if (*s != '[') {
+                        return 0;
+                    }
+                    break;
+                }
+                if (matched == negate) {
+                    return 0;
+                }
+                p = q;
+                break;
+            }
+
+            case '\\':
+                if (p[1]) {
+                    p++;
+                }
+                // fall through
+            default:
+                if (*p != *s) {
+                    return 0;
+                }
+                break;
+        }
+    }
+    return *s == '\0';
+}
+
+// Parse one line into a pattern; returns 0 for blank lines and comments
+static int ignore_parse_line(char *line, IgnorePattern *pattern) {
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\r' ||
+                       (line[len - 1] == ' ' && (len < 2 || line[len - 2] != '\\')))) {
+        line[--len] = '\0';
+    }
+    if (len == 0 || line[0] == '#') {
+        return 0;
+    }
+
+    memset(pattern, 0, sizeof(IgnorePattern));
+    if (line[0] == '!') {
+        pattern->negated = 1;
+        line++;
+        len--;
+    } else if (line[0] == '\\' && (line[1] == '!' || line[1] == '#')) {
+        line++;
+        len--;
+    }
+    if (len > 0 && line[len - 1] == '/') {
+        pattern->dir_only = 1;
+        line[--len] = '\0';
+    }
+    if (strchr(line, '/')) {
+        pattern->anchored = 1;
+        if (line[0] == '/') {
+            line++;
+            len--;
+        }
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    pattern->text = strdup(line);
+    if (!pattern->text) {
+        return 0;
+    }
+    pattern->len = len;
+    while (pattern->literal_len < len && !is_wildcard(line[pattern->literal_len])) {
+        pattern->literal_len++;
+    }
+
+    if (pattern->literal_len == len) {
+        pattern->kind = pattern->anchored ? PATTERN_PATH : PATTERN_NAME;
+    } else if (!pattern->anchored && line[0] == '*' && line[1] != '*') {
+        int literal = 1;
+        for (size_t i = 1; i < len; i++) {
+            literal &= !is_wildcard(line[i]);
+        }
+        pattern->kind = literal ? PATTERN_SUFFIX : PATTERN_GLOB;
+    } else {
+        pattern->kind = PATTERN_GLOB;
+    }
+    return 1;
+}
+
+// Build the hash table, suffix lengths and glob list
+static int ignore_compile(IgnoreList *list) {
+    size_t slots = 16;
+    while (slots < list->count * 2) {
+        slots *= 2;
+    }
+    list->slots = calloc(slots, sizeof(IgnoreSlot));
+    list->suffix_lens = malloc(sizeof(size_t) * (list->count + 1));
+    list->globs = malloc(sizeof(size_t) * (list->count + 1));
+    if (!list->slots || !list->suffix_lens || !list->globs) {
+        return -1;
+    }
+    list->slot_mask = slots - 1;
+
+    for (size_t i = 0; i < list->count; i++) {
+        IgnorePattern *pattern = &list->patterns[i];
+        if (pattern->kind == PATTERN_GLOB) {
+            list->globs[list->glob_count++] = i;
+            continue;
+        }
+
+        const char *key = pattern->text;
+        size_t key_len = pattern->len;
+        if (pattern->kind == PATTERN_SUFFIX) {
+            key++;
+            key_len--;
+            size_t j = 0;
+            while (j < list->suffix_len_count && list->suffix_lens[j] != key_len) {
+                j++;
+            }
+            if (j == list->suffix_len_count) {
+                list->suffix_lens[list->suffix_len_count++] = key_len;
+            }
+        }
+
+        IgnoreSlot *slot = ignore_slot(list, pattern->kind, key, key_len);
+        if (!slot->key) {
+            slot->key = key;
+            slot->key_len = key_len;
+            slot->kind = pattern->kind;
+            slot->last_any = -1;
+            slot->last_dir = -1;
+        }
+        if (pattern->dir_only) {
+            slot->last_dir = i;
+        } else {
+            slot->last_any = i;
+        }
+    }
+    return 0;
+}
+
+// Compile patterns from a buffer; base is the directory they apply to
+static IgnoreList *ignore_list_parse(const IgnoreList *parent, const char *base,
+                                     char *data, size_t size) {
+    IgnoreList *list = calloc(1, sizeof(IgnoreList));
+    if (!list || !(list->base = strdup(base))) {
+        free(list);
+        return NULL;
+    }
+    list->parent = parent;
+    list->base_len = strlen(base);
+
+    size_t capacity = 0;
+    char *end = data + size;
+    while (data < end) {
+        char *newline = memchr(data, '\n', end - data);
+        if (newline) {
+            *newline = '\0';
+        } else {
+            *end = '\0';
+        }
+
+        IgnorePattern pattern;
+        if (ignore_parse_line(data, &pattern)) {
+            if (list->count == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                IgnorePattern *patterns = realloc(list->patterns, sizeof(IgnorePattern) * capacity);
+                if (!patterns) {
+                    free(pattern.text);
+                    break;
+                }
+                list->patterns = patterns;
+            }
+            list->patterns[list->count++] = pattern;
+        }
+        data = newline ? newline + 1 : end;
+    }
+
+    if (list->count == 0 || ignore_compile(list) != 0) {
+        ignore_list_free(list);
+        return NULL;
+    }
+    return list;
+}
+
+// Read and compile an ignore file relative to dir_fd. Returns NULL if the
+// file does not exist or has no patterns, in which case the parent applies.
+IgnoreList *ignore_list_read(const IgnoreList *parent, int dir_fd, const char *file,
+                             const char *base) {
+    int fd = openat(dir_fd, file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    char *data = NULL;
+    size_t total = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (data = malloc(st.st_size + 1))) {
+        while (total < (size_t)st.st_size) {
+            ssize_t n = read(fd, data + total, st.st_size - total);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            total += n;
+        }
+    }
+    close(fd);
+
+    IgnoreList *list = data ? ignore_list_parse(parent, base, data, total) : NULL;
+    free(data);
+    return list;
+}
+
+void ignore_list_free(IgnoreList *list) {
+    if (!list) {
+        return;
+    }
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->patterns[i].text);
+    }
+    free(list->patterns);
+    free(list->slots);
+    free(list->suffix_lens);
+    free(list->globs);
+    free(list->base);
+    free(list);
+}
+
+// Index of the last pattern in one file matching the path, or -1
+static long ignore_list_match(const IgnoreList *list, const char *rel, size_t rel_len,
+                              const char *name, size_t name_len, int is_dir) {
+    long best = -1;
+
+    const IgnoreSlot *slot = ignore_slot(list, PATTERN_NAME, name, name_len);
+    if (slot->key) {
+        best = slot->last_any;
+        if (is_dir && slot->last_dir > best) {
+            best = slot->last_dir;
+        }
+    }
+    slot = ignore_slot(list, PATTERN_PATH, rel, rel_len);
+    if (slot->key) {
+        best = slot->last_any > best ? slot->last_any : best;
+        if (is_dir && slot->last_dir > best) {
+            best = slot->last_dir;
+        }
+    }
+    for (size_t i = 0; i < list->suffix_len_count; i++) {
+        size_t len = list->suffix_lens[i];
+        if (len > name_len) {
+            continue;
+        }
+        slot = ignore_slot(list, PATTERN_SUFFIX, name + name_len - len, len);
+        if (slot->key) {
+            best = slot->last_any > best ? slot->last_any : best;
+            if (is_dir && slot->last_dir > best) {
+                best = slot->last_dir;
+            }
+        }
+    }
+
+    // Globs only matter if they come after the best literal match
+    for (size_t i = list->glob_count; i > 0 && (long)list->globs[i - 1] > best; i--) {
+        const IgnorePattern *pattern = &list->patterns[list->globs[i - 1]];
+        const char *subject = pattern->anchored ? rel : name;
+        if ((pattern->dir_only && !is_dir) ||
+            strncmp(subject, pattern->text, pattern->literal_len) != 0) {
+            continue;
+        }
+        if (glob_match(pattern->text, subject)) {
+            best = list->globs[i - 1];
+            break;
+        }
+    }
+    return best;
+}
+
+// Whether a path relative to the repository root is ignored. The deepest
+// file with a matching pattern decides; '!' patterns re-include.
+int ignore_match(const IgnoreList *list, const char *path, int is_dir) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    size_t name_len = strlen(name);
+    size_t path_len = strlen(path);
+
+    for (; list; list = list->parent) {
+        const char *rel = path;
+        if (list->base_len) {
+            if (strncmp(path, list->base, list->base_len) != 0 || path[list->base_len] != '/') {
+                continue;
+            }
+            rel = path + list->base_len + 1;
+        }
+
+        long best = ignore_list_match(list, rel, path_len - (rel - path), name, name_len, is_dir);
+        if (best >= 0) {
+            return !list->patterns[best].negated;
+        }
+    }
+    return 0;
+}
+
+// Whether the walker would leave a file out: a hidden component, an ignored
+// directory on the way, or the file itself ignored. Reads every ignore file
+// along the path, so it is meant for a handful of paths.
+int ignore_path_excluded(int root_fd, const char *path) {
+    IgnoreList *lists[MAX_PATH / 2 + 2];
+    size_t count = 0;
+    const IgnoreList *list = lists[count] = ignore_list_read(NULL, root_fd, EXCLUDE_FILE, "");
+    if (lists[count]) {
+        count++;
+    }
+
+    char dir[MAX_PATH];
+    size_t len = strlen(path);
+    int excluded = len >= MAX_PATH;
+    for (size_t start = 0; !excluded && start < len;) {
+        const char *slash = memchr(path + start, '/', len - start);
+        size_t end = slash ? (size_t)(slash - path) : len;
+        if (path[start] == '.') {
+            excluded = 1;
+            break;
+        }
+
+        // Rules of the directory holding this component
+        memcpy(dir, path, start ? start - 1 : 0);
+        dir[start ? start - 1 : 0] = '\0';
+        char file[MAX_PATH + sizeof(IGNORE_FILE) + 1];
+        snprintf(file, sizeof(file), "%s%s%s", dir, *dir ? "/" : "", IGNORE_FILE);
+        IgnoreList *own = ignore_list_read(list, root_fd, file, dir);
+        if (own) {
+            lists[count++] = own;
+            list = own;
+        }
+
+        memcpy(dir, path, end);
+        dir[end] = '\0';
+        excluded = list && ignore_match(list, dir, slash != NULL);
+        start = end + 1;
+    }
+
+    while (count > 0) {
+        ignore_list_free(lists[--count]);
+    }
+    return excluded;
+}
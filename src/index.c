@@ -1,142 +1,885 @@
 #include "vcs.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// Binary index layout, all fields in host byte order:
+//   header      IndexHeader
+//   records     count x IndexEntry, used in place from the mapping
+//   paths       NUL-terminated paths referenced by offset from the records
+//   extensions  4-byte signature, u32 size, data; carried over unchanged
+//   checksum    repository hash of everything above
+#define INDEX_SIGNATURE "NIDX"
+#define INDEX_VERSION 2
+#define INDEX_BYTE_ORDER 0x01020304u
+#define INDEX_WRITE_CHUNK 1024
+
+// Prefault the mapping; the records are all touched by validation anyway
+#ifdef MAP_POPULATE
+#define INDEX_MAP_FLAGS (MAP_PRIVATE | MAP_POPULATE)
+#else
+#define INDEX_MAP_FLAGS MAP_PRIVATE
+#endif
+
+typedef struct {
+    char signature[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t count;
+    uint32_t hash_algo;
+    uint32_t reserved;
+    uint64_t paths_size;
+} IndexHeader;
+
+// Version 1 record, without ctime/inode/device/mode; upgraded on load
+typedef struct {
+    int64_t mtime;
+    uint64_t size;
+    uint32_t path_offset;
+    uint32_t path_len;
+    uint32_t flags;
+    uint32_t reserved;
+    ObjectId oid;
+} IndexEntryV1;
 
 // Create new index
 Index *index_new(void) {
-    Index *idx = malloc(sizeof(Index));
-    if (!idx) {
-        return NULL;
+    return calloc(1, sizeof(Index));
+}
+
+// Drop entries and release owned copies and the mapping; a held lock is kept
+static void index_clear(Index *idx) {
+    FILE *lock = idx->lock;
+    for (size_t i = 0; i < idx->extension_count; i++) {
+        if (idx->extensions[i].owned) {
+            free(idx->extensions[i].data);
+        }
     }
-    idx->entries = malloc(sizeof(IndexEntry) * 16);
-    if (!idx->entries) {
-        free(idx);
-        return NULL;
+    free(idx->extensions);
+    if (idx->capacity) {
+        free(idx->entries);
     }
-    idx->count = 0;
-    idx->capacity = 16;
-    return idx;
+    if (idx->paths_capacity) {
+        free(idx->paths);
+    }
+    if (idx->map) {
+        munmap(idx->map, idx->map_size);
+    }
+    memset(idx, 0, sizeof(Index));
+    idx->lock = lock;
 }
 
-// Free index
+// Free index, abandoning any open transaction
 void index_free(Index *idx) {
     if (idx) {
-        free(idx->entries);
+        index_rollback(idx);
+        index_clear(idx);
         free(idx);
     }
 }
 
-// Load index from disk
-int index_load(Index *idx) {
-    FILE *fp = fopen(INDEX_FILE, "r");
-    if (!fp) {
-        idx->count = 0;
-        return 0; // Empty index is OK
+// Path of an entry, from the path table
+const char *index_path(const Index *idx, const IndexEntry *entry) {
+    return idx->paths + entry->path_offset;
+}
+
+// Copy mapped records and paths into owned memory before the first change
+static int index_make_writable(Index *idx) {
+    if (!idx->capacity) {
+        size_t capacity = idx->count > 16 ? idx->count : 16;
+        IndexEntry *entries = malloc(sizeof(IndexEntry) * capacity);
+        if (!entries) {
+            return -1;
+        }
+        if (idx->count) {
+            memcpy(entries, idx->entries, sizeof(IndexEntry) * idx->count);
+        }
+        idx->entries = entries;
+        idx->capacity = capacity;
     }
 
-    char line[MAX_LINE];
-    idx->count = 0;
-
-    while (fgets(line, sizeof(line), fp)) {
-        IndexEntry entry;
-        
-        if (sscanf(line, "%40s %ld %zu %[^\n]", 
-                   entry.sha1, &entry.mtime, &entry.size, entry.path) == 4) {
-            
-            if (idx->count >= idx->capacity) {
-                idx->capacity *= 2;
-                IndexEntry *new_entries = realloc(idx->entries, 
-                                                   sizeof(IndexEntry) * idx->capacity);
-                if (!new_entries) {
-                    fclose(fp);
+    if (!idx->paths_capacity) {
+        size_t capacity = idx->paths_len > 256 ? idx->paths_len : 256;
+        char *paths = malloc(capacity);
+        if (!paths) {
+            return -1;
+        }
+        if (idx->paths_len) {
+            memcpy(paths, idx->paths, idx->paths_len);
+        }
+        idx->paths = paths;
+        idx->paths_capacity = capacity;
+    }
+    return 0;
+}
+
+// Append a NUL-terminated path to the owned path table
+static int index_append_path(Index *idx, const char *path, size_t len, uint32_t *offset) {
+    if (idx->paths_len + len + 1 > UINT32_MAX) {
+        return -1;
+    }
+    if (idx->paths_len + len + 1 > idx->paths_capacity) {
+        size_t capacity = idx->paths_capacity * 2;
+        while (capacity < idx->paths_len + len + 1) {
+            capacity *= 2;
+        }
+        char *paths = realloc(idx->paths, capacity);
+        if (!paths) {
+            return -1;
+        }
+        idx->paths = paths;
+        idx->paths_capacity = capacity;
+    }
+
+    *offset = (uint32_t)idx->paths_len;
+    memcpy(idx->paths + idx->paths_len, path, len + 1);
+    idx->paths_len += len + 1;
+    return 0;
+}
+
+// Read the original "<hex> <mtime> <size> <path>" text index; it is
+// rewritten in the binary format on the next save
+static int index_load_text(Index *idx, const char *data, size_t size) {
+    const char *end = data + size;
+
+    while (data < end) {
+        const char *newline = memchr(data, '\n', end - data);
+        size_t len = newline ? (size_t)(newline - data) : (size_t)(end - data);
+        char line[MAX_LINE];
+        if (len < sizeof(line)) {
+            memcpy(line, data, len);
+            line[len] = '\0';
+
+            // Only mtime and size are known, so st_mode stays 0 and the
+            // file is re-read the next time it is checked
+            char hex[MAX_HASH_HEX_SIZE + 1];
+            char path[MAX_PATH];
+            long mtime;
+            size_t file_size;
+            ObjectId oid;
+            struct stat st;
+            memset(&st, 0, sizeof(st));
+            if (sscanf(line, "%64s %ld %zu %[^\n]", hex, &mtime, &file_size, path) == 4 &&
+                hex_to_oid(hex, &oid) == 0) {
+                st.st_mtime = mtime;
+                st.st_size = file_size;
+                if (index_add_entry(idx, path, &oid, &st) != 0) {
                     return -1;
                 }
-                idx->entries = new_entries;
             }
-            
-            idx->entries[idx->count++] = entry;
         }
+        data += len + 1;
     }
+    return 0;
+}
 
-    fclose(fp);
+// Copy version 1 records into owned version 2 entries with no stat data
+static int index_upgrade_v1(Index *idx, const IndexEntryV1 *records, uint32_t count) {
+    size_t capacity = count > 16 ? count : 16;
+    IndexEntry *entries = calloc(capacity, sizeof(IndexEntry));
+    if (!entries) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        entries[i].mtime = records[i].mtime;
+        entries[i].size = records[i].size;
+        entries[i].path_offset = records[i].path_offset;
+        entries[i].path_len = records[i].path_len;
+        entries[i].oid = records[i].oid;
+    }
+    idx->entries = entries;
+    idx->capacity = capacity;
     return 0;
 }
 
-// Save index to disk
-int index_save(Index *idx) {
-    FILE *fp = fopen(INDEX_FILE, "w");
-    if (!fp) {
-        perror("fopen INDEX");
+// Check the header, bounds and (with index.verifyChecksum) the checksum
+static int index_validate(Index *idx, const unsigned char *map, size_t size) {
+    size_t hash_len = hash_size();
+    const IndexHeader *header = (const IndexHeader *)map;
+
+    if (size < sizeof(IndexHeader) + hash_len ||
+        (header->version != INDEX_VERSION && header->version != 1)) {
+        fprintf(stderr, "Error: Unsupported or truncated index file\n");
+        return -1;
+    }
+    if (header->byte_order != INDEX_BYTE_ORDER) {
+        fprintf(stderr, "Error: Index was written with a different byte order; "
+                        "remove %s and re-add files\n", INDEX_FILE);
+        return -1;
+    }
+    if (header->hash_algo != (uint32_t)hash_algo()) {
+        fprintf(stderr, "Error: Index hash algorithm does not match the repository\n");
         return -1;
     }
 
-    for (size_t i = 0; i < idx->count; i++) {
-        fprintf(fp, "%s %ld %zu %s\n",
-                idx->entries[i].sha1,
-                idx->entries[i].mtime,
-                idx->entries[i].size,
-                idx->entries[i].path);
+    size_t body = size - hash_len;
+    size_t record_size = header->version == 1 ? sizeof(IndexEntryV1) : sizeof(IndexEntry);
+    size_t records_end = sizeof(IndexHeader) + (size_t)header->count * record_size;
+    if (records_end > body || header->paths_size > body - records_end) {
+        fprintf(stderr, "Error: Corrupt index file\n");
+        return -1;
     }
 
-    fclose(fp);
+    // Extensions must exactly fill the space before the checksum; their data
+    // is used in place from the mapping
+    size_t pos = records_end + header->paths_size;
+    while (pos < body) {
+        uint32_t ext_size;
+        if (body - pos < 8) {
+            break;
+        }
+        memcpy(&ext_size, map + pos + 4, 4);
+        if (ext_size > body - pos - 8) {
+            break;
+        }
+        IndexExtension *extensions = realloc(idx->extensions,
+                                             (idx->extension_count + 1) * sizeof(IndexExtension));
+        if (!extensions) {
+            return -1;
+        }
+        idx->extensions = extensions;
+        IndexExtension *ext = &extensions[idx->extension_count++];
+        memcpy(ext->signature, map + pos, 4);
+        ext->data = (void *)(map + pos + 8);
+        ext->size = ext_size;
+        ext->owned = 0;
+        pos += 8 + ext_size;
+    }
+    if (pos != body) {
+        fprintf(stderr, "Error: Corrupt index extension\n");
+        return -1;
+    }
+
+    if (config_get_bool("index.verifyChecksum", 0)) {
+        unsigned char checksum[MAX_HASH_SIZE];
+        compute_hash(map, body, checksum);
+        if (memcmp(checksum, map + body, hash_len) != 0) {
+            fprintf(stderr, "Error: Index checksum mismatch\n");
+            return -1;
+        }
+    }
+
+    const unsigned char *records = map + sizeof(IndexHeader);
+    if (header->version == 1) {
+        if (index_upgrade_v1(idx, (const IndexEntryV1 *)records, header->count) != 0) {
+            return -1;
+        }
+    } else {
+        idx->entries = (IndexEntry *)records;
+    }
+
+    // Records are used in place, so every path reference has to be sane
+    const char *paths = (const char *)(map + records_end);
+    for (uint32_t i = 0; i < header->count; i++) {
+        uint64_t end = (uint64_t)idx->entries[i].path_offset + idx->entries[i].path_len;
+        if (end >= header->paths_size || paths[end] != '\0') {
+            fprintf(stderr, "Error: Corrupt index entry %u\n", i);
+            return -1;
+        }
+    }
+
+    idx->count = header->count;
+    idx->paths = (char *)paths;
+    idx->paths_len = header->paths_size;
     return 0;
 }
 
-// Add entry to index
-int index_add_entry(Index *idx, const char *path, const char *sha1, 
-                    time_t mtime, size_t size) {
-    // Check if entry already exists
+// Load index from disk by mapping it; records are not parsed or copied
+int index_load(Index *idx) {
+    index_clear(idx);
+
+    int fd = open(INDEX_FILE, O_RDONLY);
+    if (fd < 0) {
+        return 0; // Empty index is OK
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, INDEX_MAP_FLAGS, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap index");
+        return -1;
+    }
+    idx->map = map;
+    idx->map_size = st.st_size;
+    idx->timestamp = st.st_mtime;
+
+    int ret;
+    if ((size_t)st.st_size >= 4 && memcmp(map, INDEX_SIGNATURE, 4) == 0) {
+        ret = index_validate(idx, map, st.st_size);
+    } else {
+        ret = index_load_text(idx, map, st.st_size);
+    }
+    if (ret != 0) {
+        index_clear(idx);
+    }
+    return ret;
+}
+
+// Buffered output that also feeds the trailing checksum
+typedef struct {
+    FILE *fp;
+    HashCtx *hash;
+    int error;
+} IndexWriter;
+
+static void index_write(IndexWriter *w, const void *data, size_t len) {
+    if (w->error || len == 0) {
+        return;
+    }
+    hash_update(w->hash, data, len);
+    if (fwrite(data, 1, len, w->fp) != len) {
+        w->error = 1;
+    }
+}
+
+// An entry whose file was modified no earlier than the index was written may
+// have changed again within the same second without its stat data changing
+static int index_entry_racy(const Index *idx, const IndexEntry *entry) {
+    return idx->timestamp && entry->mtime >= (int64_t)idx->timestamp;
+}
+
+// Write the whole index to fp. Paths are compacted in entry order. Racy
+// entries carried over from the old file lose their timestamps, since the
+// new file's later mtime would otherwise make them look clean; the mode
+// stays, as trees take the executable bit from it.
+static int index_write_file(Index *idx, FILE *fp) {
+    IndexWriter w = {fp, hash_ctx_new(), 0};
+    if (!w.hash) {
+        return -1;
+    }
+
+    uint64_t paths_size = 0;
     for (size_t i = 0; i < idx->count; i++) {
-        if (strcmp(idx->entries[i].path, path) == 0) {
-            // Update existing entry
-            strncpy(idx->entries[i].sha1, sha1, SHA1_HEX_SIZE);
-            idx->entries[i].sha1[SHA1_HEX_SIZE] = '\0';
-            idx->entries[i].mtime = mtime;
-            idx->entries[i].size = size;
-            return 0;
-        }
-    }
-
-    // Add new entry
-    if (idx->count >= idx->capacity) {
-        idx->capacity *= 2;
-        IndexEntry *new_entries = realloc(idx->entries, 
-                                          sizeof(IndexEntry) * idx->capacity);
-        if (!new_entries) {
+        paths_size += idx->entries[i].path_len + 1;
+    }
+
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.signature, INDEX_SIGNATURE, 4);
+    header.version = INDEX_VERSION;
+    header.byte_order = INDEX_BYTE_ORDER;
+    header.count = (uint32_t)idx->count;
+    header.hash_algo = (uint32_t)hash_algo();
+    header.paths_size = paths_size;
+    index_write(&w, &header, sizeof(header));
+
+    // Records with their offsets into the compacted path table
+    IndexEntry chunk[INDEX_WRITE_CHUNK];
+    uint32_t offset = 0;
+    for (size_t i = 0; i < idx->count; i += INDEX_WRITE_CHUNK) {
+        size_t n = idx->count - i < INDEX_WRITE_CHUNK ? idx->count - i : INDEX_WRITE_CHUNK;
+        memcpy(chunk, idx->entries + i, n * sizeof(IndexEntry));
+        for (size_t j = 0; j < n; j++) {
+            if (!(chunk[j].flags & INDEX_ENTRY_FRESH) && index_entry_racy(idx, &chunk[j])) {
+                chunk[j].mtime = 0;
+                chunk[j].ctime = 0;
+            }
+            chunk[j].flags &= ~INDEX_ENTRY_FRESH;
+            chunk[j].path_offset = offset;
+            offset += chunk[j].path_len + 1;
+        }
+        index_write(&w, chunk, n * sizeof(IndexEntry));
+    }
+
+    for (size_t i = 0; i < idx->count; i++) {
+        index_write(&w, index_path(idx, &idx->entries[i]), idx->entries[i].path_len + 1);
+    }
+
+    for (size_t i = 0; i < idx->extension_count; i++) {
+        uint32_t ext_size = (uint32_t)idx->extensions[i].size;
+        index_write(&w, idx->extensions[i].signature, 4);
+        index_write(&w, &ext_size, 4);
+        index_write(&w, idx->extensions[i].data, ext_size);
+    }
+
+    unsigned char checksum[MAX_HASH_SIZE];
+    hash_final(w.hash, checksum);
+    if (!w.error && fwrite(checksum, 1, hash_size(), fp) != hash_size()) {
+        w.error = 1;
+    }
+    return w.error ? -1 : 0;
+}
+
+// Create .vcs/index.lock; only one process may hold it
+static int index_acquire_lock(Index *idx, int quiet) {
+    if (idx->lock) {
+        return 0;
+    }
+
+    int fd = open(INDEX_LOCK_FILE, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        if (quiet) {
             return -1;
         }
-        idx->entries = new_entries;
+        if (errno == EEXIST) {
+            fprintf(stderr, "Error: Unable to create '%s': File exists.\n"
+                            "Another nit process seems to be running in this repository.\n"
+                            "If not, remove the file and try again.\n", INDEX_LOCK_FILE);
+        } else {
+            perror("open " INDEX_LOCK_FILE);
+        }
+        return -1;
+    }
+
+    idx->lock = fdopen(fd, "wb");
+    if (!idx->lock) {
+        close(fd);
+        unlink(INDEX_LOCK_FILE);
+        return -1;
+    }
+    return 0;
+}
+
+// Start an index transaction: take the lock, then load the current index
+int index_lock(Index *idx) {
+    if (index_acquire_lock(idx, 0) != 0) {
+        return -1;
+    }
+    if (index_load(idx) != 0) {
+        index_rollback(idx);
+        return -1;
+    }
+    return 0;
+}
+
+// Like index_lock(), but fails quietly if the lock cannot be taken, for
+// readers that only write the index back opportunistically
+int index_try_lock(Index *idx) {
+    if (index_acquire_lock(idx, 1) != 0) {
+        return -1;
+    }
+    if (index_load(idx) != 0) {
+        index_rollback(idx);
+        return -1;
+    }
+    return 0;
+}
+
+// Finish a transaction: write the index into the lock file and rename it
+// into place, so readers see either the old index or the new one
+int index_commit(Index *idx) {
+    if (!idx->lock) {
+        fprintf(stderr, "Error: Index is not locked\n");
+        return -1;
+    }
+
+    FILE *fp = idx->lock;
+    idx->lock = NULL;
+    int ret = index_write_file(idx, fp);
+    if (fclose(fp) != 0 || ret != 0 || rename(INDEX_LOCK_FILE, INDEX_FILE) != 0) {
+        fprintf(stderr, "Error: Failed to write index\n");
+        unlink(INDEX_LOCK_FILE);
+        return -1;
+    }
+    return 0;
+}
+
+// Abandon a transaction, leaving the index on disk untouched
+void index_rollback(Index *idx) {
+    if (idx->lock) {
+        fclose(idx->lock);
+        idx->lock = NULL;
+        unlink(INDEX_LOCK_FILE);
+    }
+}
+
+// Save index to disk outside an explicit transaction
+int index_save(Index *idx) {
+    if (index_acquire_lock(idx, 0) != 0) {
+        return -1;
+    }
+    return index_commit(idx);
+}
+
+// Compare an entry's path with path[0..len) in byte order
+static int index_entry_cmp(const Index *idx, const IndexEntry *entry,
+                           const char *path, size_t len) {
+    size_t entry_len = entry->path_len;
+    int cmp = memcmp(index_path(idx, entry), path, entry_len < len ? entry_len : len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return entry_len < len ? -1 : entry_len > len ? 1 : 0;
+}
+
+// Binary search; returns the entry's position, or where it would be inserted
+static size_t index_search(const Index *idx, const char *path, size_t len, int *found) {
+    size_t lo = 0;
+    size_t hi = idx->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = index_entry_cmp(idx, &idx->entries[mid], path, len);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = 0;
+    return lo;
+}
+
+static int index_grow(Index *idx, size_t needed) {
+    if (needed <= idx->capacity) {
+        return 0;
+    }
+    size_t capacity = idx->capacity;
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    IndexEntry *entries = realloc(idx->entries, sizeof(IndexEntry) * capacity);
+    if (!entries) {
+        return -1;
+    }
+    idx->entries = entries;
+    idx->capacity = capacity;
+    return 0;
+}
+
+// Invalidate the cached trees above a path whose entry is new, or whose
+// blob or executable bit changed
+static void index_invalidate_tree(Index *idx, const IndexEntry *entry, const char *path,
+                                  const ObjectId *oid, const struct stat *st) {
+    if (!entry || !oid_equal(&entry->oid, oid) ||
+        (entry->mode & 0111) != ((uint32_t)st->st_mode & 0111)) {
+        cache_tree_invalidate(idx, path);
+    }
+}
+
+// Record a file's object ID and the stat data it was read with
+static void index_set_entry(IndexEntry *entry, const ObjectId *oid, const struct stat *st) {
+    entry->oid = *oid;
+    entry->mtime = st->st_mtime;
+    entry->ctime = st->st_ctime;
+    entry->size = st->st_size;
+    entry->ino = st->st_ino;
+    entry->dev = st->st_dev;
+    entry->mode = st->st_mode;
+    // Staging a file brings the path back into the working tree
+    entry->flags = (entry->flags | INDEX_ENTRY_FRESH) & ~INDEX_ENTRY_SKIP_WORKTREE;
+}
+
+// Fill a new entry, appending its path to the path table
+static int index_fill_entry(Index *idx, IndexEntry *entry, const char *path, size_t len,
+                            const ObjectId *oid, const struct stat *st) {
+    memset(entry, 0, sizeof(IndexEntry));
+    if (index_append_path(idx, path, len, &entry->path_offset) != 0) {
+        return -1;
     }
+    entry->path_len = (uint32_t)len;
+    index_set_entry(entry, oid, st);
+    return 0;
+}
 
-    IndexEntry *entry = &idx->entries[idx->count++];
-    strncpy(entry->sha1, sha1, SHA1_HEX_SIZE);
-    entry->sha1[SHA1_HEX_SIZE] = '\0';
-    strncpy(entry->path, path, MAX_PATH - 1);
-    entry->path[MAX_PATH - 1] = '\0';
-    entry->mtime = mtime;
-    entry->size = size;
+// Add or update one entry, keeping the index sorted by path
+int index_add_entry(Index *idx, const char *path, const ObjectId *oid,
+                    const struct stat *st) {
+    size_t len = strlen(path);
+    if (len >= MAX_PATH || index_make_writable(idx) != 0) {
+        return -1;
+    }
 
+    int found;
+    size_t pos = index_search(idx, path, len, &found);
+    index_invalidate_tree(idx, found ? &idx->entries[pos] : NULL, path, oid, st);
+    if (found) {
+        index_set_entry(&idx->entries[pos], oid, st);
+        return 0;
+    }
+
+    if (index_grow(idx, idx->count + 1) != 0) {
+        return -1;
+    }
+    IndexEntry entry;
+    if (index_fill_entry(idx, &entry, path, len, oid, st) != 0) {
+        return -1;
+    }
+    memmove(&idx->entries[pos + 1], &idx->entries[pos],
+            sizeof(IndexEntry) * (idx->count - pos));
+    idx->entries[pos] = entry;
+    idx->count++;
+    index_drop_extension(idx, INDEX_EXT_UNTRACKED);
+    return 0;
+}
+
+// Order updates by path, then by position in the batch
+static int index_update_cmp(const void *a, const void *b) {
+    const IndexUpdate *ua = *(const IndexUpdate *const *)a;
+    const IndexUpdate *ub = *(const IndexUpdate *const *)b;
+    int cmp = strcmp(ua->path, ub->path);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return ua < ub ? -1 : ua > ub;
+}
+
+// Merge a batch of new or updated entries in a single pass over the index.
+// The batch may be in any order; if a path appears more than once the last
+// update wins.
+int index_merge(Index *idx, const IndexUpdate *updates, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (index_make_writable(idx) != 0) {
+        return -1;
+    }
+
+    const IndexUpdate **sorted = malloc(sizeof(IndexUpdate *) * count);
+    size_t capacity = idx->count + count;
+    IndexEntry *merged = malloc(sizeof(IndexEntry) * capacity);
+    if (!sorted || !merged) {
+        free(sorted);
+        free(merged);
+        return -1;
+    }
+
+    int in_order = 1;
+    for (size_t u = 0; u < count; u++) {
+        sorted[u] = &updates[u];
+        if (u > 0 && strcmp(updates[u - 1].path, updates[u].path) >= 0) {
+            in_order = 0;
+        }
+    }
+    if (!in_order) {
+        qsort(sorted, count, sizeof(IndexUpdate *), index_update_cmp);
+    }
+
+    size_t n = 0;
+    size_t i = 0;
+    for (size_t u = 0; u < count; u++) {
+        // Only the last of several updates to one path applies
+        if (u + 1 < count && strcmp(sorted[u]->path, sorted[u + 1]->path) == 0) {
+            continue;
+        }
+
+        const IndexUpdate *update = sorted[u];
+        size_t len = strlen(update->path);
+        if (len >= MAX_PATH) {
+            free(sorted);
+            free(merged);
+            return -1;
+        }
+
+        int cmp = 1;
+        while (i < idx->count &&
+               (cmp = index_entry_cmp(idx, &idx->entries[i], update->path, len)) < 0) {
+            merged[n++] = idx->entries[i++];
+        }
+
+        index_invalidate_tree(idx, i < idx->count && cmp == 0 ? &idx->entries[i] : NULL,
+                              update->path, &update->oid, &update->st);
+        if (i < idx->count && cmp == 0) {
+            merged[n] = idx->entries[i++];
+            index_set_entry(&merged[n], &update->oid, &update->st);
+        } else if (index_fill_entry(idx, &merged[n], update->path, len, &update->oid,
+                                    &update->st) != 0) {
+            free(sorted);
+            free(merged);
+            return -1;
+        }
+        n++;
+    }
+    while (i < idx->count) {
+        merged[n++] = idx->entries[i++];
+    }
+    if (n > idx->count) {
+        index_drop_extension(idx, INDEX_EXT_UNTRACKED);
+    }
+
+    free(sorted);
+    free(idx->entries);
+    idx->entries = merged;
+    idx->count = n;
+    idx->capacity = capacity;
     return 0;
 }
 
 // Remove entry from index
 int index_remove_entry(Index *idx, const char *path) {
-    for (size_t i = 0; i < idx->count; i++) {
-        if (strcmp(idx->entries[i].path, path) == 0) {
-            // Shift remaining entries
-            memmove(&idx->entries[i], &idx->entries[i + 1],
-                    sizeof(IndexEntry) * (idx->count - i - 1));
-            idx->count--;
-            return 0;
+    int found;
+    size_t pos = index_search(idx, path, strlen(path), &found);
+    if (!found || index_make_writable(idx) != 0) {
+        return -1;
+    }
+
+    cache_tree_invalidate(idx, path);
+
+    // Shift remaining entries; the path stays in the table until the next save
+    memmove(&idx->entries[pos], &idx->entries[pos + 1],
+            sizeof(IndexEntry) * (idx->count - pos - 1));
+    idx->count--;
+    index_drop_extension(idx, INDEX_EXT_UNTRACKED);
+    return 0;
+}
+
+static int size_cmp(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Remove a batch of entries in a single pass over the index. The batch may
+// be in any order; paths that are not in the index are ignored.
+int index_remove_entries(Index *idx, const char *const *paths, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (index_make_writable(idx) != 0) {
+        return -1;
+    }
+
+    size_t *positions = malloc(sizeof(size_t) * count);
+    if (!positions) {
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        int found;
+        size_t pos = index_search(idx, paths[i], strlen(paths[i]), &found);
+        if (found) {
+            cache_tree_invalidate(idx, paths[i]);
+            positions[n++] = pos;
+        }
+    }
+    if (n == 0) {
+        free(positions);
+        return 0;
+    }
+    qsort(positions, n, sizeof(size_t), size_cmp);
+
+    // Paths stay in the table until the next save
+    size_t kept = positions[0], next = 0;
+    for (size_t i = positions[0]; i < idx->count; i++) {
+        if (next < n && positions[next] == i) {
+            while (next < n && positions[next] == i) {
+                next++;
+            }
+            continue;
         }
+        idx->entries[kept++] = idx->entries[i];
     }
-    return -1;
+    idx->count = kept;
+    index_drop_extension(idx, INDEX_EXT_UNTRACKED);
+    free(positions);
+    return 0;
 }
 
-// Find entry in index
+// Position of a path among the sorted entries, or where it would be inserted
+size_t index_position(const Index *idx, const char *path, int *found) {
+    return index_search(idx, path, strlen(path), found);
+}
+
+// Set and clear flag bits on the entry at pos
+int index_set_flags(Index *idx, size_t pos, uint32_t set, uint32_t clear) {
+    if (pos >= idx->count || index_make_writable(idx) != 0) {
+        return -1;
+    }
+    idx->entries[pos].flags = (idx->entries[pos].flags | set) & ~clear;
+    return 0;
+}
+
+// Find entry in index by binary search over the sorted entries
 IndexEntry *index_find_entry(Index *idx, const char *path) {
-    for (size_t i = 0; i < idx->count; i++) {
-        if (strcmp(idx->entries[i].path, path) == 0) {
-            return &idx->entries[i];
+    int found;
+    size_t pos = index_search(idx, path, strlen(path), &found);
+    return found ? &idx->entries[pos] : NULL;
+}
+
+// Whether a file can be assumed to match its entry from stat data alone.
+// Racily clean entries, and entries without stat data, must be re-read.
+int index_entry_uptodate(const Index *idx, const IndexEntry *entry, const struct stat *st) {
+    return entry->mode != 0 &&
+           entry->mode == (uint32_t)st->st_mode &&
+           entry->mtime == (int64_t)st->st_mtime &&
+           entry->ctime == (int64_t)st->st_ctime &&
+           entry->size == (uint64_t)st->st_size &&
+           entry->ino == (uint64_t)st->st_ino &&
+           entry->dev == (uint64_t)st->st_dev &&
+           !index_entry_racy(idx, entry);
+}
+
+// Data of an extension, or NULL if the index has none with this signature
+const void *index_extension(const Index *idx, const char *signature, size_t *size) {
+    for (size_t i = 0; i < idx->extension_count; i++) {
+        if (memcmp(idx->extensions[i].signature, signature, 4) == 0) {
+            *size = idx->extensions[i].size;
+            return idx->extensions[i].data;
         }
     }
     return NULL;
 }
+
+// Add or replace an extension with a copy of data; written on the next save
+int index_set_extension(Index *idx, const char *signature, const void *data, size_t size) {
+    if (size > UINT32_MAX) {
+        return -1;
+    }
+    void *copy = malloc(size ? size : 1);
+    if (!copy) {
+        return -1;
+    }
+    memcpy(copy, data, size);
+
+    index_drop_extension(idx, signature);
+    IndexExtension *extensions = realloc(idx->extensions,
+                                         (idx->extension_count + 1) * sizeof(IndexExtension));
+    if (!extensions) {
+        free(copy);
+        return -1;
+    }
+    idx->extensions = extensions;
+    IndexExtension *ext = &extensions[idx->extension_count++];
+    memcpy(ext->signature, signature, 4);
+    ext->data = copy;
+    ext->size = size;
+    ext->owned = 1;
+    return 0;
+}
+
+// Extension data that may be changed in place, copied out of the mapping
+// on first use; NULL if the index has no such extension
+void *index_edit_extension(Index *idx, const char *signature, size_t *size) {
+    for (size_t i = 0; i < idx->extension_count; i++) {
+        IndexExtension *ext = &idx->extensions[i];
+        if (memcmp(ext->signature, signature, 4) != 0) {
+            continue;
+        }
+        if (!ext->owned) {
+            void *copy = malloc(ext->size ? ext->size : 1);
+            if (!copy) {
+                return NULL;
+            }
+            memcpy(copy, ext->data, ext->size);
+            ext->data = copy;
+            ext->owned = 1;
+        }
+        *size = ext->size;
+        return ext->data;
+    }
+    return NULL;
+}
+
+// Remove an extension whose data no longer describes the index
+void index_drop_extension(Index *idx, const char *signature) {
+    for (size_t i = 0; i < idx->extension_count; i++) {
+        if (memcmp(idx->extensions[i].signature, signature, 4) == 0) {
+            if (idx->extensions[i].owned) {
+                free(idx->extensions[i].data);
+            }
+            idx->extensions[i] = idx->extensions[--idx->extension_count];
+            return;
+        }
+    }
+}
@@ -0,0 +1,532 @@
+#include "vcs.h"
+#include <limits.h>
+
+// Lines whose text occurs more often than this on the old side are not
+// used to anchor a histogram split; with no anchor left, Myers takes over
+#define HISTOGRAM_MAX_CHAIN 64
+
+// Interned line: every distinct line text gets one ID shared by both sides
+typedef struct {
+    uint64_t hash;
+    const char *text;
+    size_t len;
+    uint32_t id;
+} LineClass;
+
+// Working state of one line diff
+typedef struct {
+    const uint32_t *a;      // old line IDs
+    const uint32_t *b;      // new line IDs
+    unsigned char *a_changed;
+    unsigned char *b_changed;
+    // Histogram: per-ID occurrence count and chain of old positions
+    uint32_t *count;
+    size_t *head;
+    size_t *next;
+    // Myers: furthest reaching paths on each diagonal, forward and backward
+    long *kvdf;
+    long *kvdb;
+    long max_cost;
+} LineDiffCtx;
+
+#define NO_LINE ((size_t)-1)
+
+// Split a buffer into lines, each including its newline. memchr does the
+// newline scan a word or vector at a time.
+static int split_lines(DiffLines *side, const void *data, size_t size) {
+    side->data = data;
+    side->size = size;
+    side->count = 0;
+
+    size_t capacity = size / 32 + 16;
+    side->lines = malloc(capacity * sizeof(size_t));
+    if (!side->lines) {
+        return -1;
+    }
+
+    const char *p = data;
+    const char *end = p + size;
+    while (p < end) {
+        if (side->count + 1 >= capacity) {
+            capacity *= 2;
+            size_t *lines = realloc(side->lines, capacity * sizeof(size_t));
+            if (!lines) {
+                return -1;
+            }
+            side->lines = lines;
+        }
+        side->lines[side->count++] = p - (const char *)data;
+        const char *nl = memchr(p, '\n', end - p);
+        p = nl ? nl + 1 : end;
+    }
+    side->lines[side->count] = size;
+
+    side->ids = malloc((side->count + 1) * sizeof(uint32_t));
+    side->changed = calloc(side->count + 1, 1);
+    return side->ids && side->changed ? 0 : -1;
+}
+
+static uint64_t line_hash(const char *text, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Give every line of both sides the ID of its text; returns the number of
+// distinct texts, or -1 on allocation failure
+static long intern_lines(DiffLines *old_side, DiffLines *new_side) {
+    size_t total = old_side->count + new_side->count;
+    size_t capacity = 16;
+    while (capacity < total * 2) {
+        capacity *= 2;
+    }
+    LineClass *table = calloc(capacity, sizeof(LineClass));
+    if (!table) {
+        return -1;
+    }
+
+    uint32_t classes = 0;
+    DiffLines *sides[2] = {old_side, new_side};
+    for (int s = 0; s < 2; s++) {
+        DiffLines *side = sides[s];
+        for (size_t i = 0; i < side->count; i++) {
+            const char *text = side->data + side->lines[i];
+            size_t len = side->lines[i + 1] - side->lines[i];
+            uint64_t hash = line_hash(text, len);
+            size_t slot = hash & (capacity - 1);
+            while (table[slot].text &&
+                   (table[slot].hash != hash || table[slot].len != len ||
+                    memcmp(table[slot].text, text, len) != 0)) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            if (!table[slot].text) {
+                table[slot].hash = hash;
+                table[slot].text = text;
+                table[slot].len = len;
+                table[slot].id = classes++;
+            }
+            side->ids[i] = table[slot].id;
+        }
+    }
+    free(table);
+    return classes;
+}
+
+// Find a point on a shortest edit path through old lines [off1, lim1) and
+// new lines [off2, lim2) by searching forward and backward at once. Past
+// max_cost edits the search stops at the furthest point either direction
+// reached, which keeps very different inputs from going quadratic.
+static void myers_split(LineDiffCtx *c, long off1, long lim1, long off2, long lim2,
+                        long *mid1, long *mid2) {
+    const uint32_t *a = c->a;
+    const uint32_t *b = c->b;
+    long *kvdf = c->kvdf;
+    long *kvdb = c->kvdb;
+    long dmin = off1 - lim2, dmax = lim1 - off2;
+    long fmid = off1 - off2, bmid = lim1 - lim2;
+    int odd = (fmid - bmid) & 1;
+    long fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+
+    kvdf[fmid] = off1;
+    kvdb[bmid] = lim1;
+    for (long cost = 1;; cost++) {
+        if (fmin > dmin) {
+            kvdf[--fmin - 1] = -1;
+        } else {
+            ++fmin;
+        }
+        if (fmax < dmax) {
+            kvdf[++fmax + 1] = -1;
+        } else {
+            --fmax;
+        }
+        for (long d = fmax; d >= fmin; d -= 2) {
+            long i1 = kvdf[d - 1] >= kvdf[d + 1] ? kvdf[d - 1] + 1 : kvdf[d + 1];
+            long i2 = i1 - d;
+            while (i1 < lim1 && i2 < lim2 && a[i1] == b[i2]) {
+                i1++;
+                i2++;
+            }
+            kvdf[d] = i1;
+            if (odd && bmin <= d && d <= bmax && kvdb[d] <= i1) {
+                *mid1 = i1;
+                *mid2 = i2;
+                return;
+            }
+        }
+
+        if (bmin > dmin) {
+            kvdb[--bmin - 1] = LONG_MAX;
+        } else {
+            ++bmin;
+        }
+        if (bmax < dmax) {
+            kvdb[++bmax + 1] = LONG_MAX;
+        } else {
+            --bmax;
+        }
+        for (long d = bmax; d >= bmin; d -= 2) {
+            long i1 = kvdb[d - 1] < kvdb[d + 1] ? kvdb[d - 1] : kvdb[d + 1] - 1;
+            long i2 = i1 - d;
+            while (i1 > off1 && i2 > off2 && a[i1 - 1] == b[i2 - 1]) {
+                i1--;
+                i2--;
+            }
+            kvdb[d] = i1;
+            if (!odd && fmin <= d && d <= fmax && i1 <= kvdf[d]) {
+                *mid1 = i1;
+                *mid2 = i2;
+                return;
+            }
+        }
+
+        if (cost >= c->max_cost) {
+            long fbest = -1, fbest1 = -1;
+            for (long d = fmax; d >= fmin; d -= 2) {
+                long i1 = kvdf[d] < lim1 ? kvdf[d] : lim1;
+                long i2 = i1 - d;
+                if (i2 > lim2) {
+                    i1 = lim2 + d;
+                    i2 = lim2;
+                }
+                if (i1 + i2 > fbest) {
+                    fbest = i1 + i2;
+                    fbest1 = i1;
+                }
+            }
+            long bbest = LONG_MAX, bbest1 = LONG_MAX;
+            for (long d = bmax; d >= bmin; d -= 2) {
+                long i1 = kvdb[d] > off1 ? kvdb[d] : off1;
+                long i2 = i1 - d;
+                if (i2 < off2) {
+                    i1 = off2 + d;
+                    i2 = off2;
+                }
+                if (i1 + i2 < bbest) {
+                    bbest = i1 + i2;
+                    bbest1 = i1;
+                }
+            }
+            if ((lim1 + lim2) - bbest < fbest - (off1 + off2)) {
+                *mid1 = fbest1;
+                *mid2 = fbest - fbest1;
+            } else {
+                *mid1 = bbest1;
+                *mid2 = bbest - bbest1;
+            }
+            return;
+        }
+    }
+}
+
+// Mark what changed between old lines [off1, lim1) and new lines
+// [off2, lim2) with Myers' algorithm, splitting at the middle of the path
+static void myers_diff(LineDiffCtx *c, long off1, long lim1, long off2, long lim2) {
+    while (off1 < lim1 && off2 < lim2 && c->a[off1] == c->b[off2]) {
+        off1++;
+        off2++;
+    }
+    while (off1 < lim1 && off2 < lim2 && c->a[lim1 - 1] == c->b[lim2 - 1]) {
+        lim1--;
+        lim2--;
+    }
+
+    if (off1 == lim1) {
+        memset(c->b_changed + off2, 1, lim2 - off2);
+    } else if (off2 == lim2) {
+        memset(c->a_changed + off1, 1, lim1 - off1);
+    } else {
+        long mid1, mid2;
+        myers_split(c, off1, lim1, off2, lim2, &mid1, &mid2);
+        myers_diff(c, off1, mid1, off2, mid2);
+        myers_diff(c, mid1, lim1, mid2, lim2);
+    }
+}
+
+// Common region chosen to split a histogram diff
+typedef struct {
+    size_t a_begin, a_end;
+    size_t b_begin, b_end;
+} LineRegion;
+
+// Find the longest run of lines common to both ranges that contains the
+// rarest possible line of the old range. Returns 0 if every shared line
+// occurs more than HISTOGRAM_MAX_CHAIN times (or none is shared).
+static int histogram_find(LineDiffCtx *c, size_t a0, size_t a1, size_t b0, size_t b1,
+                          LineRegion *best) {
+    const uint32_t *a = c->a;
+    const uint32_t *b = c->b;
+
+    // Chain the old positions of each line ID, in order
+    for (size_t i = a1; i-- > a0;) {
+        uint32_t id = a[i];
+        c->next[i] = c->count[id] ? c->head[id] : NO_LINE;
+        c->head[id] = i;
+        c->count[id]++;
+    }
+
+    uint32_t best_count = HISTOGRAM_MAX_CHAIN + 1;
+    size_t best_len = 0;
+    size_t b_next;
+    for (size_t j = b0; j < b1; j = b_next) {
+        b_next = j + 1;
+        uint32_t id = b[j];
+        if (c->count[id] == 0 || c->count[id] > best_count) {
+            continue;
+        }
+        for (size_t i = c->head[id]; i != NO_LINE; i = c->next[i]) {
+            size_t as = i, bs = j, ae = i + 1, be = j + 1;
+            uint32_t rarest = c->count[id];
+            while (as > a0 && bs > b0 && a[as - 1] == b[bs - 1]) {
+                as--;
+                bs--;
+                if (c->count[a[as]] < rarest) {
+                    rarest = c->count[a[as]];
+                }
+            }
+            while (ae < a1 && be < b1 && a[ae] == b[be]) {
+                if (c->count[a[ae]] < rarest) {
+                    rarest = c->count[a[ae]];
+                }
+                ae++;
+                be++;
+            }
+            if (b_next < be) {
+                b_next = be;
+            }
+            if (ae - as > best_len || rarest < best_count) {
+                best_len = ae - as;
+                best_count = rarest;
+                best->a_begin = as;
+                best->a_end = ae;
+                best->b_begin = bs;
+                best->b_end = be;
+            }
+        }
+    }
+
+    for (size_t i = a0; i < a1; i++) {
+        c->count[a[i]] = 0;
+    }
+    return best_len > 0;
+}
+
+// Mark what changed between old lines [a0, a1) and new lines [b0, b1)
+// with histogram diff: split around a run of common lines anchored on a
+// rare line, recurse into the smaller side and loop on the larger
+static void histogram_diff(LineDiffCtx *c, size_t a0, size_t a1, size_t b0, size_t b1) {
+    for (;;) {
+        while (a0 < a1 && b0 < b1 && c->a[a0] == c->b[b0]) {
+            a0++;
+            b0++;
+        }
+        while (a0 < a1 && b0 < b1 && c->a[a1 - 1] == c->b[b1 - 1]) {
+            a1--;
+            b1--;
+        }
+        if (a0 == a1) {
+            memset(c->b_changed + b0, 1, b1 - b0);
+            return;
+        }
+        if (b0 == b1) {
+            memset(c->a_changed + a0, 1, a1 - a0);
+            return;
+        }
+
+        LineRegion r = {0, 0, 0, 0};
+        if (!histogram_find(c, a0, a1, b0, b1, &r)) {
+            myers_diff(c, (long)a0, (long)a1, (long)b0, (long)b1);
+            return;
+        }
+        if ((r.a_begin - a0) + (r.b_begin - b0) < (a1 - r.a_end) + (b1 - r.b_end)) {
+            histogram_diff(c, a0, r.a_begin, b0, r.b_begin);
+            a0 = r.a_end;
+            b0 = r.b_end;
+        } else {
+            histogram_diff(c, r.a_end, a1, r.b_end, b1);
+            a1 = r.a_begin;
+            b1 = r.b_begin;
+        }
+    }
+}
+
+// Diff two buffers line by line, marking the old lines deleted and the new
+// lines added. algorithm is DIFF_HISTOGRAM or DIFF_MYERS.
+int line_diff(const void *old_data, size_t old_size, const void *new_data, size_t new_size,
+              DiffAlgorithm algorithm, LineDiff *diff) {
+    memset(diff, 0, sizeof(*diff));
+    if (split_lines(&diff->old, old_data, old_size) != 0 ||
+        split_lines(&diff->new, new_data, new_size) != 0) {
+        line_diff_free(diff);
+        return -1;
+    }
+    long classes = intern_lines(&diff->old, &diff->new);
+    if (classes < 0) {
+        line_diff_free(diff);
+        return -1;
+    }
+
+    size_t n1 = diff->old.count, n2 = diff->new.count;
+    size_t diagonals = n1 + n2 + 3;
+    LineDiffCtx c;
+    memset(&c, 0, sizeof(c));
+    c.a = diff->old.ids;
+    c.b = diff->new.ids;
+    c.a_changed = diff->old.changed;
+    c.b_changed = diff->new.changed;
+    long *kv = malloc(2 * diagonals * sizeof(long));
+    if (algorithm == DIFF_HISTOGRAM) {
+        c.count = calloc((size_t)classes + 1, sizeof(uint32_t));
+        c.head = malloc(((size_t)classes + 1) * sizeof(size_t));
+        c.next = malloc((n1 + 1) * sizeof(size_t));
+    }
+    if (!kv || (algorithm == DIFF_HISTOGRAM && (!c.count || !c.head || !c.next))) {
+        free(kv);
+        free(c.count);
+        free(c.head);
+        free(c.next);
+        line_diff_free(diff);
+        return -1;
+    }
+    c.kvdf = kv + n2 + 1;
+    c.kvdb = kv + diagonals + n2 + 1;
+    c.max_cost = 1;
+    while (c.max_cost * c.max_cost < (long)diagonals) {
+        c.max_cost++;
+    }
+    if (c.max_cost < 256) {
+        c.max_cost = 256;
+    }
+
+    if (algorithm == DIFF_HISTOGRAM) {
+        histogram_diff(&c, 0, n1, 0, n2);
+    } else {
+        myers_diff(&c, 0, (long)n1, 0, (long)n2);
+    }
+
+    free(kv);
+    free(c.count);
+    free(c.head);
+    free(c.next);
+    return 0;
+}
+
+void line_diff_free(LineDiff *diff) {
+    DiffLines *sides[2] = {&diff->old, &diff->new};
+    for (int s = 0; s < 2; s++) {
+        free(sides[s]->lines);
+        free(sides[s]->ids);
+        free(sides[s]->changed);
+        sides[s]->lines = NULL;
+        sides[s]->ids = NULL;
+        sides[s]->changed = NULL;
+    }
+}
+
+// Number of lines added and deleted, without formatting anything
+void line_diff_count(const LineDiff *diff, size_t *added, size_t *deleted) {
+    *added = 0;
+    *deleted = 0;
+    for (size_t i = 0; i < diff->old.count; i++) {
+        *deleted += diff->old.changed[i];
+    }
+    for (size_t i = 0; i < diff->new.count; i++) {
+        *added += diff->new.changed[i];
+    }
+}
+
+// Whether data looks binary: a NUL byte within the first 8000 bytes
+int diff_is_binary(const void *data, size_t size) {
+    return memchr(data, '\0', size < 8000 ? size : 8000) != NULL;
+}
+
+static void print_line(FILE *out, char prefix, const DiffLines *side, size_t i) {
+    const char *text = side->data + side->lines[i];
+    size_t len = side->lines[i + 1] - side->lines[i];
+    fputc(prefix, out);
+    fwrite(text, 1, len, out);
+    if (len == 0 || text[len - 1] != '\n') {
+        fputs("\n\\ No newline at end of file\n", out);
+    }
+}
+
+// Hunk range "start,count" in unified format; an empty range starts at the
+// line before it, and a count of 1 is left out
+static void print_range(FILE *out, char sign, size_t start, size_t count) {
+    if (count == 1) {
+        fprintf(out, "%c%zu", sign, start + 1);
+    } else {
+        fprintf(out, "%c%zu,%zu", sign, count ? start + 1 : start, count);
+    }
+}
+
+// Print the changes as unified diff hunks with context lines around them.
+// Changes closer than twice the context share a hunk.
+void line_diff_print(const LineDiff *diff, int context, FILE *out) {
+    const DiffLines *a = &diff->old;
+    const DiffLines *b = &diff->new;
+    size_t ctx = context > 0 ? (size_t)context : 0;
+    size_t i = 0, j = 0;
+
+    while (i < a->count || j < b->count) {
+        // Skip to the next change; unchanged lines pair up in order
+        while (i < a->count && j < b->count && !a->changed[i] && !b->changed[j]) {
+            i++;
+            j++;
+        }
+        if ((i >= a->count || !a->changed[i]) && (j >= b->count || !b->changed[j])) {
+            break;
+        }
+
+        // Extend the hunk over every change within 2 * context lines
+        size_t start_i = i > ctx ? i - ctx : 0;
+        size_t start_j = j - (i - start_i);
+        size_t end_i = i, end_j = j;
+        for (;;) {
+            while (end_i < a->count && a->changed[end_i]) {
+                end_i++;
+            }
+            while (end_j < b->count && b->changed[end_j]) {
+                end_j++;
+            }
+            size_t gap = 0;
+            while (end_i + gap < a->count && end_j + gap < b->count &&
+                   !a->changed[end_i + gap] && !b->changed[end_j + gap] && gap <= 2 * ctx) {
+                gap++;
+            }
+            int more = (end_i + gap < a->count && a->changed[end_i + gap]) ||
+                       (end_j + gap < b->count && b->changed[end_j + gap]);
+            if (more && gap <= 2 * ctx) {
+                end_i += gap;
+                end_j += gap;
+                continue;
+            }
+            size_t tail = gap < ctx ? gap : ctx;
+            end_i += tail;
+            end_j += tail;
+            break;
+        }
+
+        fputs("@@ ", out);
+        print_range(out, '-', start_i, end_i - start_i);
+        fputc(' ', out);
+        print_range(out, '+', start_j, end_j - start_j);
+        fputs(" @@\n", out);
+
+        size_t x = start_i, y = start_j;
+        while (x < end_i || y < end_j) {
+            if (x < end_i && a->changed[x]) {
+                print_line(out, '-', a, x++);
+            } else if (y < end_j && b->changed[y]) {
+                print_line(out, '+', b, y++);
+            } else {
+                print_line(out, ' ', a, x++);
+                y++;
+            }
+        }
+        i = end_i;
+        j = end_j;
+    }
+}
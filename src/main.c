@@ -10,10 +10,19 @@ static int cmd_branch(int argc, char *argv[]);
 static int cmd_checkout(int argc, char *argv[]);
 static int cmd_merge(int argc, char *argv[]);
 static int cmd_diff(int argc, char *argv[]);
+static int cmd_repack(int argc, char *argv[]);
+static int cmd_cat_file(int argc, char *argv[]);
+static int cmd_fsmonitor(int argc, char *argv[]);
+static int cmd_sparse_checkout(int argc, char *argv[]);
 static int cmd_version(int argc, char *argv[]);
 static void print_usage(void);
+static void print_cache_stats(void);
 
 int main(int argc, char *argv[]) {
+    if (getenv("NIT_CACHE_STATS")) {
+        atexit(print_cache_stats);
+    }
+
     if (argc < 2) {
         print_usage();
         return 1;
@@ -39,6 +48,14 @@ int main(int argc, char *argv[]) {
         return cmd_merge(argc - 1, argv + 1);
     } else if (strcmp(command, "diff") == 0) {
         return cmd_diff(argc - 1, argv + 1);
+    } else if (strcmp(command, "repack") == 0) {
+        return cmd_repack(argc - 1, argv + 1);
+    } else if (strcmp(command, "cat-file") == 0) {
+        return cmd_cat_file(argc - 1, argv + 1);
+    } else if (strcmp(command, "fsmonitor") == 0) {
+        return cmd_fsmonitor(argc - 1, argv + 1);
+    } else if (strcmp(command, "sparse-checkout") == 0) {
+        return cmd_sparse_checkout(argc - 1, argv + 1);
     } else if (strcmp(command, "version") == 0 || strcmp(command, "--version") == 0 || strcmp(command, "-v") == 0) {
         return cmd_version(argc - 1, argv + 1);
     } else {
@@ -49,9 +66,18 @@ int main(int argc, char *argv[]) {
 }
 
 static int cmd_init(int argc, char *argv[]) {
-    (void)argc;
-    (void)argv;
-    return vcs_init();
+    HashAlgo algo = HASH_SHA1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--object-format=", 16) == 0 &&
+            hash_algo_by_name(argv[i] + 16, &algo) == 0) {
+            continue;
+        }
+        fprintf(stderr, "Usage: vcs init [--object-format=sha1|sha256]\n");
+        return 1;
+    }
+
+    return vcs_init(algo) == 0 ? 0 : 1;
 }
 
 static int cmd_add(int argc, char *argv[]) {
@@ -66,15 +92,9 @@ static int cmd_add(int argc, char *argv[]) {
     }
 
     if (strcmp(argv[1], ".") == 0) {
-        return add_all();
-    } else {
-        for (int i = 1; i < argc; i++) {
-            if (add_file(argv[i]) != 0) {
-                return 1;
-            }
-        }
-        return 0;
+        return add_all() == 0 ? 0 : 1;
     }
+    return add_files((const char *const *)argv + 1, argc - 1) == 0 ? 0 : 1;
 }
 
 static int cmd_commit(int argc, char *argv[]) {
@@ -97,7 +117,8 @@ static int cmd_commit(int argc, char *argv[]) {
         return 1;
     }
 
-    if (index_load(idx) != 0) {
+    // Lock the index if it is free, to keep the trees written here cached
+    if (index_try_lock(idx) != 0 && index_load(idx) != 0) {
         index_free(idx);
         return 1;
     }
@@ -108,27 +129,16 @@ static int cmd_commit(int argc, char *argv[]) {
         return 1;
     }
 
-    // Create tree from index
-    Tree *tree = tree_new();
-    if (!tree) {
+    // Write the trees of directories changed since the last commit
+    ObjectId tree_oid;
+    int cache_changed = write_index_tree(idx, &tree_oid);
+    if (cache_changed < 0) {
         index_free(idx);
         return 1;
     }
-
-    if (tree_from_index(idx, tree) != 0) {
-        tree_free(tree);
-        index_free(idx);
-        return 1;
-    }
-
-    char tree_sha1[SHA1_HEX_SIZE + 1];
-    if (write_tree(tree, tree_sha1) != 0) {
-        tree_free(tree);
-        index_free(idx);
-        return 1;
+    if (cache_changed > 0 && idx->lock) {
+        index_commit(idx);
     }
-
-    tree_free(tree);
     index_free(idx);
 
     // Create commit object
@@ -137,13 +147,10 @@ static int cmd_commit(int argc, char *argv[]) {
         return 1;
     }
 
-    strcpy(commit->tree_sha1, tree_sha1);
-    
-    char *head_commit = get_head_commit();
-    if (head_commit) {
-        strcpy(commit->parent_sha1, head_commit);
-    } else {
-        commit->parent_sha1[0] = '\0';
+    commit->tree = tree_oid;
+
+    if (get_head_commit(&commit->parent) != 0) {
+        oid_clear(&commit->parent);
     }
 
     char *user = get_user_info();
@@ -155,8 +162,8 @@ static int cmd_commit(int argc, char *argv[]) {
     strncpy(commit->message, message, sizeof(commit->message) - 1);
     commit->message[sizeof(commit->message) - 1] = '\0';
 
-    char commit_sha1[SHA1_HEX_SIZE + 1];
-    if (write_commit(commit, commit_sha1) != 0) {
+    ObjectId commit_oid;
+    if (write_commit(commit, &commit_oid) != 0) {
         commit_free(commit);
         return 1;
     }
@@ -166,15 +173,15 @@ static int cmd_commit(int argc, char *argv[]) {
     // Update branch reference or HEAD
     char *current_branch = get_current_branch();
     if (current_branch) {
-        if (write_ref(current_branch, commit_sha1) != 0) {
+        if (write_ref(current_branch, &commit_oid) != 0) {
             return 1;
         }
-        printf("[%s %.*s] %s\n", current_branch, 7, commit_sha1, message);
+        printf("[%s %.*s] %s\n", current_branch, 7, oid_hex(&commit_oid), message);
     } else {
-        if (update_head(commit_sha1) != 0) {
+        if (detach_head(&commit_oid) != 0) {
             return 1;
         }
-        printf("[detached HEAD %.*s] %s\n", 7, commit_sha1, message);
+        printf("[detached HEAD %.*s] %s\n", 7, oid_hex(&commit_oid), message);
     }
 
     return 0;
@@ -207,13 +214,13 @@ static int cmd_branch(int argc, char *argv[]) {
         return list_branches();
     } else if (argc == 2) {
         // Create branch
-        char *head_commit = get_head_commit();
-        if (!head_commit) {
+        ObjectId head_commit;
+        if (get_head_commit(&head_commit) != 0) {
             fprintf(stderr, "Error: No commits yet\n");
             return 1;
         }
-        
-        if (create_branch(argv[1], head_commit) == 0) {
+
+        if (create_branch(argv[1], &head_commit) == 0) {
             printf("Created branch '%s'\n", argv[1]);
             return 0;
         }
@@ -249,12 +256,11 @@ static int cmd_checkout(int argc, char *argv[]) {
         return checkout_branch(target);
     }
 
-    // Check if it's a commit SHA-1
-    if (strlen(target) >= 7 && strlen(target) <= SHA1_HEX_SIZE) {
-        // Try to find matching commit (simplified)
-        if (object_exists(target)) {
-            return checkout_commit(target);
-        }
+    // Check if it's a full commit ID
+    ObjectId oid;
+    if (strlen(target) == hash_hex_size() && hex_to_oid(target, &oid) == 0 &&
+        object_exists(&oid)) {
+        return checkout_commit(&oid);
     }
 
     fprintf(stderr, "Error: Branch or commit '%s' not found\n", target);
@@ -275,18 +281,227 @@ static int cmd_merge(int argc, char *argv[]) {
     return merge_branch(argv[1]);
 }
 
+// Similarity for -M<n>: digits are a fraction (-M5 and -M50 are 50%)
+// unless followed by % (-M5% is 5%); returns -1 if malformed
+static int parse_rename_threshold(const char *value) {
+    long num = 0, scale = 1;
+    const char *p = value;
+    while (*p >= '0' && *p <= '9') {
+        if (scale < 100000) {
+            num = num * 10 + (*p - '0');
+            scale *= 10;
+        }
+        p++;
+    }
+    if (*p == '%' && p > value) {
+        scale = 100;
+        p++;
+    }
+    if (p == value || *p != '\0') {
+        return -1;
+    }
+    return num >= scale ? 100 : (int)(num * 100 / scale);
+}
+
 static int cmd_diff(int argc, char *argv[]) {
     if (!is_vcs_repo()) {
         fprintf(stderr, "Error: Not a VCS repository\n");
         return 1;
     }
 
-    const char *commit = NULL;
-    if (argc >= 2) {
-        commit = argv[1];
+    DiffOptions opts = {DIFF_FORMAT_PATCH, -1, -1, 0, -1};
+    const char *commits[2] = {NULL, NULL};
+    int commit_count = 0;
+    int cached = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        char *end;
+        if (strcmp(arg, "--cached") == 0 || strcmp(arg, "--staged") == 0) {
+            cached = 1;
+        } else if (strcmp(arg, "--stat") == 0) {
+            opts.format = DIFF_FORMAT_STAT;
+        } else if (strcmp(arg, "--numstat") == 0) {
+            opts.format = DIFF_FORMAT_NUMSTAT;
+        } else if (strcmp(arg, "--name-status") == 0) {
+            opts.format = DIFF_FORMAT_NAME_STATUS;
+        } else if (strncmp(arg, "-U", 2) == 0 || strncmp(arg, "--unified=", 10) == 0) {
+            const char *value = arg[1] == 'U' ? arg + 2 : arg + 10;
+            long context = strtol(value, &end, 10);
+            if (*value == '\0' || *end != '\0' || context < 0 || context > 1000000) {
+                fprintf(stderr, "Error: Invalid context '%s'\n", arg);
+                return 1;
+            }
+            opts.context = (int)context;
+        } else if (strncmp(arg, "-M", 2) == 0 || strncmp(arg, "--find-renames", 14) == 0) {
+            const char *value = arg[1] == 'M' ? arg + 2 : arg + 14;
+            if (arg[1] != 'M' && *value == '=') {
+                value++;
+            } else if (arg[1] != 'M' && *value != '\0') {
+                commit_count = 3;
+                break;
+            }
+            opts.renames = 1;
+            if (*value != '\0' && (opts.threshold = parse_rename_threshold(value)) < 0) {
+                fprintf(stderr, "Error: Invalid rename threshold '%s'\n", arg);
+                return 1;
+            }
+        } else if (strcmp(arg, "-C") == 0 || strcmp(arg, "--find-copies") == 0) {
+            opts.copies = 1;
+        } else if (strcmp(arg, "--no-renames") == 0) {
+            opts.renames = 0;
+            opts.copies = 0;
+        } else if (arg[0] != '-' && commit_count < 2) {
+            commits[commit_count++] = arg;
+        } else {
+            commit_count = 3;
+            break;
+        }
+    }
+    if (commit_count > 2 || (cached && commit_count > 1)) {
+        fprintf(stderr, "Usage: vcs diff [--stat | --numstat | --name-status] [-U<n>] "
+                        "[-M[<n>] | -C | --no-renames] [--cached] [<commit> [<commit>]]\n");
+        return 1;
+    }
+
+    return vcs_diff(commits[0], commits[1], cached, &opts) == 0 ? 0 : 1;
+}
+
+static int cmd_repack(int argc, char *argv[]) {
+    if (!is_vcs_repo()) {
+        fprintf(stderr, "Error: Not a VCS repository\n");
+        return 1;
+    }
+
+    int all = 0;
+    if (argc == 2 && strcmp(argv[1], "-a") == 0) {
+        all = 1;
+    } else if (argc != 1) {
+        fprintf(stderr, "Usage: vcs repack [-a]\n");
+        return 1;
     }
 
-    return vcs_diff(commit);
+    return repack_objects(all) == 0 ? 0 : 1;
+}
+
+static int cmd_fsmonitor(int argc, char *argv[]) {
+    if (!is_vcs_repo()) {
+        fprintf(stderr, "Error: Not a VCS repository\n");
+        return 1;
+    }
+
+    const char *action = argc == 2 ? argv[1] : "";
+    int ret;
+    if (strcmp(action, "start") == 0) {
+        ret = fsmonitor_run(1);
+    } else if (strcmp(action, "run") == 0) {
+        ret = fsmonitor_run(0);
+    } else if (strcmp(action, "stop") == 0) {
+        ret = fsmonitor_stop();
+    } else if (strcmp(action, "status") == 0) {
+        ret = fsmonitor_status();
+    } else {
+        fprintf(stderr, "Usage: vcs fsmonitor start|run|stop|status\n");
+        return 1;
+    }
+    return ret == 0 ? 0 : 1;
+}
+
+static int cmd_sparse_checkout(int argc, char *argv[]) {
+    if (!is_vcs_repo()) {
+        fprintf(stderr, "Error: Not a VCS repository\n");
+        return 1;
+    }
+
+    const char *action = argc >= 2 ? argv[1] : "";
+    int ret;
+    if ((strcmp(action, "set") == 0 || strcmp(action, "add") == 0) && argc >= 3) {
+        ret = sparse_checkout_set((const char *const *)argv + 2, argc - 2,
+                                  strcmp(action, "add") == 0);
+    } else if (strcmp(action, "list") == 0 && argc == 2) {
+        ret = sparse_checkout_list();
+    } else if (strcmp(action, "disable") == 0 && argc == 2) {
+        ret = sparse_checkout_disable();
+    } else {
+        fprintf(stderr, "Usage: vcs sparse-checkout set|add <dir>... | list | disable\n");
+        return 1;
+    }
+    return ret == 0 ? 0 : 1;
+}
+
+static int cmd_cat_file(int argc, char *argv[]) {
+    if (!is_vcs_repo()) {
+        fprintf(stderr, "Error: Not a VCS repository\n");
+        return 1;
+    }
+
+    if (argc != 3 || (strcmp(argv[1], "-t") != 0 && strcmp(argv[1], "-s") != 0 &&
+                      strcmp(argv[1], "-p") != 0)) {
+        fprintf(stderr, "Usage: vcs cat-file (-t | -s | -p) <object>\n");
+        return 1;
+    }
+
+    const char *option = argv[1];
+    const char *name = argv[2];
+    ObjectId oid;
+    ObjectType type;
+    size_t size;
+
+    if (strlen(name) != hash_hex_size() || hex_to_oid(name, &oid) != 0) {
+        fprintf(stderr, "Error: Not a valid object name '%s'\n", name);
+        return 1;
+    }
+
+    // Type and size only need the object header
+    if (strcmp(option, "-p") != 0) {
+        if (read_object_header(&oid, &type, &size) != 0) {
+            fprintf(stderr, "Error: Object '%s' not found\n", name);
+            return 1;
+        }
+        if (strcmp(option, "-s") == 0) {
+            printf("%zu\n", size);
+        } else {
+            printf("%s\n", type == OBJ_BLOB ? "blob" : type == OBJ_TREE ? "tree" : "commit");
+        }
+        return 0;
+    }
+
+    ObjectStream *stream = object_stream_open(&oid, &type, &size);
+    if (!stream) {
+        fprintf(stderr, "Error: Object '%s' not found\n", name);
+        return 1;
+    }
+
+    if (type == OBJ_TREE) {
+        object_stream_close(stream);
+        unsigned char *data = read_object(&oid, &size, &type);
+        if (!data) {
+            return 1;
+        }
+        TreeIter it;
+        int ret;
+        tree_iter_init(&it, data, size);
+        while ((ret = tree_iter_next(&it)) > 0) {
+            ObjectId entry_oid;
+            tree_iter_oid(&it, &entry_oid);
+            printf("%o %s %s\t%s\n", (unsigned)it.mode, S_ISDIR(it.mode) ? "tree" : "blob",
+                   oid_hex(&entry_oid), it.name);
+        }
+        free(data);
+        if (ret < 0) {
+            fprintf(stderr, "Error: Malformed tree '%s'\n", name);
+            return 1;
+        }
+        return 0;
+    }
+
+    // Blobs and commits are copied through in chunks
+    char buf[65536];
+    ssize_t n;
+    while ((n = object_stream_read(stream, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+    object_stream_close(stream);
+    return n < 0 ? 1 : 0;
 }
 
 static int cmd_version(int argc, char *argv[]) {
@@ -297,11 +512,19 @@ static int cmd_version(int argc, char *argv[]) {
     return 0;
 }
 
+// Report object cache effectiveness on stderr when NIT_CACHE_STATS is set
+static void print_cache_stats(void) {
+    ObjectCacheStats stats;
+    object_cache_get_stats(&stats);
+    fprintf(stderr, "object cache: %lu hits, %lu misses, %zu entries, %zu/%ld bytes\n",
+            stats.hits, stats.misses, stats.entries, stats.bytes, stats.limit);
+}
+
 static void print_usage(void) {
     printf("nit - Version Control System v%s\n\n", NIT_VERSION);
     printf("Usage: nit <command> [<args>]\n\n");
     printf("Commands:\n");
-    printf("  init                Initialize a new repository\n");
+    printf("  init [--object-format=sha256]  Initialize a new repository\n");
     printf("  add <file>          Add file to staging area\n");
     printf("  add .               Add all files to staging area\n");
     printf("  commit -m <msg>     Create a new commit\n");
@@ -311,6 +534,13 @@ static void print_usage(void) {
     printf("  branch -d <name>    Delete a branch\n");
     printf("  checkout <branch>   Switch to a branch or commit\n");
     printf("  merge <branch>      Merge a branch into current branch\n");
-    printf("  diff [<commit>]     Show differences\n");
+    printf("  diff [--cached] [<commit>]  Show changes (staged with --cached)\n");
+    printf("  diff <commit> <commit>      Show changes between two commits\n");
+    printf("       [--stat | --numstat | --name-status] [-U<n>] [-M[<n>] | -C | --no-renames]\n");
+    printf("  repack [-a]         Pack loose objects (-a: all objects)\n");
+    printf("  cat-file -t|-s|-p <object>  Show object type, size or content\n");
+    printf("  fsmonitor start|run|stop|status  Watch the working tree for changes\n");
+    printf("  sparse-checkout set|add <dir>... | list | disable\n");
+    printf("                      Check out only some directories\n");
     printf("  version             Show version information\n");
 }
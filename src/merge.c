@@ -1,31 +1,27 @@
 #include "vcs.h"
 
 // Find common ancestor (merge base) - simplified version
-char *find_merge_base(const char *commit1_sha1, const char *commit2_sha1) {
-    static char base_sha1[SHA1_HEX_SIZE + 1];
-    
+int find_merge_base(const ObjectId *commit1, const ObjectId *commit2, ObjectId *base) {
     // For simplicity, we'll trace back commit1's history and check if commit2 is an ancestor
-    char current[SHA1_HEX_SIZE + 1];
-    strcpy(current, commit1_sha1);
+    ObjectId current = *commit1;
 
-    while (strlen(current) > 0) {
-        if (strcmp(current, commit2_sha1) == 0) {
-            strcpy(base_sha1, current);
-            return base_sha1;
+    while (!oid_is_null(&current)) {
+        if (oid_equal(&current, commit2)) {
+            *base = current;
+            return 0;
         }
 
-        Commit *commit = read_commit(current);
-        if (!commit || strlen(commit->parent_sha1) == 0) {
-            commit_free(commit);
+        Commit *commit = read_commit(&current);
+        if (!commit) {
             break;
         }
 
-        strcpy(current, commit->parent_sha1);
+        current = commit->parent;
         commit_free(commit);
     }
 
     // No common ancestor found (in this simplified version)
-    return NULL;
+    return -1;
 }
 
 // Merge branch into current branch
@@ -52,32 +48,33 @@ int merge_branch(const char *branch_name) {
     }
 
     // Get current commit
-    char *current_commit = get_head_commit();
-    if (!current_commit) {
+    ObjectId current_commit;
+    if (get_head_commit(&current_commit) != 0) {
         fprintf(stderr, "Error: No commits on current branch\n");
         return -1;
     }
 
     // Get merge commit
-    char *merge_commit_sha1 = read_ref(branch_name);
-    if (!merge_commit_sha1) {
+    ObjectId merge_commit;
+    if (read_ref(branch_name, &merge_commit) != 0) {
         fprintf(stderr, "Error: Failed to read branch reference\n");
         return -1;
     }
 
     // Check if already up to date
-    if (strcmp(current_commit, merge_commit_sha1) == 0) {
+    if (oid_equal(&current_commit, &merge_commit)) {
         printf("Already up to date.\n");
         return 0;
     }
 
     // Find merge base
-    char *base_sha1 = find_merge_base(current_commit, merge_commit_sha1);
-    
+    ObjectId base;
+    int have_base = find_merge_base(&current_commit, &merge_commit, &base) == 0;
+
     // Fast-forward merge if possible
-    if (base_sha1 && strcmp(base_sha1, current_commit) == 0) {
+    if (have_base && oid_equal(&base, &current_commit)) {
         printf("Fast-forward merge\n");
-        if (write_ref(current_branch, merge_commit_sha1) != 0) {
+        if (write_ref(current_branch, &merge_commit) != 0) {
             return -1;
         }
         printf("Merged branch '%s' into '%s'\n", branch_name, current_branch);
@@ -92,29 +89,20 @@ int merge_branch(const char *branch_name) {
     if (!idx) {
         return -1;
     }
-    index_load(idx);
-
-    // Create tree from index
-    Tree *tree = tree_new();
-    if (!tree) {
-        index_free(idx);
-        return -1;
+    if (index_try_lock(idx) != 0) {
+        index_load(idx);
     }
 
-    if (tree_from_index(idx, tree) != 0) {
-        tree_free(tree);
+    // Write the trees of directories changed since the last commit
+    ObjectId tree_oid;
+    int cache_changed = write_index_tree(idx, &tree_oid);
+    if (cache_changed < 0) {
         index_free(idx);
         return -1;
     }
-
-    char tree_sha1[SHA1_HEX_SIZE + 1];
-    if (write_tree(tree, tree_sha1) != 0) {
-        tree_free(tree);
-        index_free(idx);
-        return -1;
+    if (cache_changed > 0 && idx->lock) {
+        index_commit(idx);
     }
-
-    tree_free(tree);
     index_free(idx);
 
     // Create merge commit
@@ -123,9 +111,9 @@ int merge_branch(const char *branch_name) {
         return -1;
     }
 
-    strcpy(commit->tree_sha1, tree_sha1);
-    strcpy(commit->parent_sha1, current_commit);
-    
+    commit->tree = tree_oid;
+    commit->parent = current_commit;
+
     char *user = get_user_info();
     strncpy(commit->author, user, sizeof(commit->author) - 1);
     strncpy(commit->committer, user, sizeof(commit->committer) - 1);
@@ -134,8 +122,8 @@ int merge_branch(const char *branch_name) {
     snprintf(commit->message, sizeof(commit->message),
              "Merge branch '%s' into %s", branch_name, current_branch);
 
-    char commit_sha1[SHA1_HEX_SIZE + 1];
-    if (write_commit(commit, commit_sha1) != 0) {
+    ObjectId commit_oid;
+    if (write_commit(commit, &commit_oid) != 0) {
         commit_free(commit);
         return -1;
     }
@@ -143,11 +131,11 @@ int merge_branch(const char *branch_name) {
     commit_free(commit);
 
     // Update current branch reference
-    if (write_ref(current_branch, commit_sha1) != 0) {
+    if (write_ref(current_branch, &commit_oid) != 0) {
         return -1;
     }
 
     printf("Merged branch '%s' into '%s'\n", branch_name, current_branch);
-    printf("Merge commit: %s\n", commit_sha1);
+    printf("Merge commit: %s\n", oid_hex(&commit_oid));
     return 0;
 }
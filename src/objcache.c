@@ -0,0 +1,174 @@
+#include "vcs.h"
+#include <pthread.h>
+#include <stdint.h>
+
+// Bounded LRU cache of decoded objects keyed by object ID.
+// Shared by all threads; a single mutex guards the table and the LRU list.
+#define OBJECT_CACHE_BUCKETS 4096
+#define DEFAULT_OBJECT_CACHE_LIMIT (32L * 1024 * 1024)
+
+typedef struct CacheNode {
+    ObjectId oid;
+    ObjectType type;
+    size_t size;
+    void *data;
+    struct CacheNode *hash_next;
+    struct CacheNode *lru_prev;
+    struct CacheNode *lru_next;
+} CacheNode;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static CacheNode *buckets[OBJECT_CACHE_BUCKETS];
+static CacheNode *lru_head = NULL;   // most recently used
+static CacheNode *lru_tail = NULL;   // next to evict
+static long cache_limit = -1;
+static ObjectCacheStats stats;
+
+static size_t bucket_of(const ObjectId *oid) {
+    // Hash bytes are already uniformly distributed
+    return (((size_t)oid->hash[0] << 8) | oid->hash[1]) % OBJECT_CACHE_BUCKETS;
+}
+
+static void lru_unlink(CacheNode *node) {
+    if (node->lru_prev) {
+        node->lru_prev->lru_next = node->lru_next;
+    } else {
+        lru_head = node->lru_next;
+    }
+    if (node->lru_next) {
+        node->lru_next->lru_prev = node->lru_prev;
+    } else {
+        lru_tail = node->lru_prev;
+    }
+    node->lru_prev = node->lru_next = NULL;
+}
+
+static void lru_push_front(CacheNode *node) {
+    node->lru_prev = NULL;
+    node->lru_next = lru_head;
+    if (lru_head) {
+        lru_head->lru_prev = node;
+    }
+    lru_head = node;
+    if (!lru_tail) {
+        lru_tail = node;
+    }
+}
+
+static CacheNode *cache_lookup(const ObjectId *oid) {
+    for (CacheNode *node = buckets[bucket_of(oid)]; node; node = node->hash_next) {
+        if (oid_equal(&node->oid, oid)) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static void cache_remove(CacheNode *node) {
+    CacheNode **link = &buckets[bucket_of(&node->oid)];
+    while (*link != node) {
+        link = &(*link)->hash_next;
+    }
+    *link = node->hash_next;
+    lru_unlink(node);
+
+    stats.entries--;
+    stats.bytes -= node->size;
+    free(node->data);
+    free(node);
+}
+
+static long cache_get_limit(void) {
+    if (cache_limit < 0) {
+        cache_limit = config_get_int("core.objectCacheLimit", DEFAULT_OBJECT_CACHE_LIMIT);
+        if (cache_limit < 0) {
+            cache_limit = 0;
+        }
+        stats.limit = cache_limit;
+    }
+    return cache_limit;
+}
+
+// Copy a cached object out; returns NULL on a miss
+void *object_cache_get(const ObjectId *oid, size_t *size, ObjectType *type) {
+    pthread_mutex_lock(&cache_lock);
+    if (cache_get_limit() == 0) {
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+
+    CacheNode *node = cache_lookup(oid);
+    if (!node) {
+        stats.misses++;
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+
+    void *copy = malloc(node->size + 1);
+    if (copy) {
+        memcpy(copy, node->data, node->size + 1);
+        *size = node->size;
+        *type = node->type;
+        lru_unlink(node);
+        lru_push_front(node);
+        stats.hits++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return copy;
+}
+
+// Store a copy of a decoded (NUL-terminated) object, evicting the least
+// recently used entries to stay within core.objectCacheLimit
+void object_cache_put(const ObjectId *oid, const void *data, size_t size, ObjectType type) {
+    pthread_mutex_lock(&cache_lock);
+    long limit = cache_get_limit();
+
+    // A single huge blob should not flush everything else
+    if (limit == 0 || size > (size_t)limit / 4 || cache_lookup(oid)) {
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+
+    CacheNode *node = malloc(sizeof(CacheNode));
+    void *copy = malloc(size + 1);
+    if (!node || !copy) {
+        free(node);
+        free(copy);
+        pthread_mutex_unlock(&cache_lock);
+        return;
+    }
+    memcpy(copy, data, size);
+    ((char *)copy)[size] = '\0';
+
+    while (lru_tail && stats.bytes + size > (size_t)limit) {
+        cache_remove(lru_tail);
+    }
+
+    node->oid = *oid;
+    node->type = type;
+    node->size = size;
+    node->data = copy;
+    size_t bucket = bucket_of(oid);
+    node->hash_next = buckets[bucket];
+    buckets[bucket] = node;
+    lru_push_front(node);
+
+    stats.entries++;
+    stats.bytes += size;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void object_cache_get_stats(ObjectCacheStats *out) {
+    pthread_mutex_lock(&cache_lock);
+    cache_get_limit();
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void object_cache_clear(void) {
+    pthread_mutex_lock(&cache_lock);
+    while (lru_tail) {
+        cache_remove(lru_tail);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -1,9 +1,22 @@
 #include "vcs.h"
-#include <zlib.h>
+#include <fcntl.h>
+#include <stdint.h>
 
-// Write object to disk with compression
-int write_object(const void *data, size_t size, ObjectType type, char *sha1_out) {
-    // Create header
+// Chunk size for streaming reads, hashing and compressed output
+#define STREAM_CHUNK (64 * 1024)
+
+struct ObjectWriter {
+    FILE *fp;
+    char tmp_path[MAX_PATH];
+    Compressor *compressor;
+    HashCtx *hash;                   // NULL when the ID is already known
+    size_t expected;
+    size_t written;
+    unsigned char out[STREAM_CHUNK];
+};
+
+// Format the "type size\0" header; returns its length including the NUL
+static int format_object_header(ObjectType type, size_t size, char *header, size_t header_size) {
     const char *type_str;
     switch (type) {
         case OBJ_BLOB: type_str = "blob"; break;
@@ -11,176 +24,619 @@ int write_object(const void *data, size_t size, ObjectType type, char *sha1_out)
         case OBJ_COMMIT: type_str = "commit"; break;
         default: return -1;
     }
+    return snprintf(header, header_size, "%s %zu", type_str, size) + 1;
+}
 
-    // Format: "type size\0data"
+// Feed input through the compressor and append its output to the temp file
+static int writer_compress(ObjectWriter *writer, const void *data, size_t len, int finish) {
+    const unsigned char *in = data;
+    int ret;
+
+    do {
+        unsigned char *out = writer->out;
+        size_t out_len = STREAM_CHUNK;
+        ret = compressor_run(writer->compressor, &in, &len, &out, &out_len, finish);
+        if (ret < 0) {
+            return -1;
+        }
+        size_t have = STREAM_CHUNK - out_len;
+        if (have > 0 && fwrite(writer->out, 1, have, writer->fp) != have) {
+            return -1;
+        }
+    } while (len > 0 || (finish && ret != 1));
+
+    return 0;
+}
+
+static ObjectWriter *writer_open(ObjectType type, size_t size,
+                                const void *sample, size_t sample_len, int hash) {
     char header[64];
-    int header_len = snprintf(header, sizeof(header), "%s %zu", type_str, size);
-    header[header_len] = '\0';
-    header_len++;
+    int header_len = format_object_header(type, size, header, sizeof(header));
+    if (header_len < 0) {
+        return NULL;
+    }
 
-    // Combine header and data
-    size_t total_size = header_len + size;
-    unsigned char *full_data = malloc(total_size);
-    if (!full_data) {
-        return -1;
+    ObjectWriter *writer = malloc(sizeof(ObjectWriter));
+    if (!writer) {
+        return NULL;
     }
-    memcpy(full_data, header, header_len);
-    memcpy(full_data + header_len, data, size);
+    writer->expected = size;
+    writer->written = 0;
 
-    // Compute SHA-1
-    unsigned char sha1[SHA1_SIZE];
-    compute_sha1(full_data, total_size, sha1);
-    sha1_to_hex(sha1, sha1_out);
+    snprintf(writer->tmp_path, sizeof(writer->tmp_path), "%s/tmp_obj_XXXXXX", OBJECTS_DIR);
+    int fd = mkstemp(writer->tmp_path);
+    if (fd < 0) {
+        perror("mkstemp");
+        free(writer);
+        return NULL;
+    }
+    fchmod(fd, 0644);
 
-    // Check if object already exists
-    char obj_path[MAX_PATH];
-    snprintf(obj_path, sizeof(obj_path), "%s/%c%c", OBJECTS_DIR, 
-             sha1_out[0], sha1_out[1]);
-    create_dir_recursive(obj_path);
-    snprintf(obj_path, sizeof(obj_path), "%s/%c%c/%s", OBJECTS_DIR,
-             sha1_out[0], sha1_out[1], sha1_out + 2);
+    CompressionCodec codec;
+    int level;
+    compression_choose(type, sample, sample_len, &codec, &level);
 
-    if (file_exists(obj_path)) {
-        free(full_data);
-        return 0; // Object already exists
+    writer->fp = fdopen(fd, "wb");
+    writer->hash = hash ? hash_ctx_new() : NULL;
+    writer->compressor = compressor_new(codec, level);
+    if (!writer->fp || (hash && !writer->hash) || !writer->compressor) {
+        if (writer->fp) {
+            fclose(writer->fp);
+        } else {
+            close(fd);
+        }
+        hash_ctx_free(writer->hash);
+        compressor_free(writer->compressor);
+        unlink(writer->tmp_path);
+        free(writer);
+        return NULL;
     }
 
-    // Compress data
-    void *compressed;
-    size_t compressed_size;
-    if (compress_data(full_data, total_size, &compressed, &compressed_size) != 0) {
-        free(full_data);
+    if (writer->hash) {
+        hash_update(writer->hash, header, header_len);
+    }
+    if (writer_compress(writer, header, header_len, 0) != 0) {
+        object_writer_abort(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+// Start a loose object of known size; content is hashed and compressed as it
+// arrives and lands in a temp file until the object ID is known. The sample
+// (typically the first chunk of content, may be NULL) lets incompressible
+// blobs be stored as-is.
+ObjectWriter *object_writer_open(ObjectType type, size_t size,
+                                 const void *sample, size_t sample_len) {
+    return writer_open(type, size, sample, sample_len, 1);
+}
+
+int object_writer_write(ObjectWriter *writer, const void *data, size_t len) {
+    if (writer->written + len > writer->expected) {
+        return -1;
+    }
+    if (writer->hash) {
+        hash_update(writer->hash, data, len);
+    }
+    writer->written += len;
+    return writer_compress(writer, data, len, 0);
+}
+
+// Discard a partially written object
+void object_writer_abort(ObjectWriter *writer) {
+    compressor_free(writer->compressor);
+    hash_ctx_free(writer->hash);
+    fclose(writer->fp);
+    unlink(writer->tmp_path);
+    free(writer);
+}
+
+// Finish the stream and move the temp file to its content address. Writers
+// opened without hashing install under the ID already in oid_out.
+int object_writer_close(ObjectWriter *writer, ObjectId *oid_out) {
+    if (writer->written != writer->expected ||
+        writer_compress(writer, NULL, 0, 1) != 0) {
+        object_writer_abort(writer);
         return -1;
     }
+    compressor_free(writer->compressor);
+
+    if (writer->hash) {
+        hash_final(writer->hash, oid_out->hash);
+    }
+
+    int ret = fclose(writer->fp) == 0 ? 0 : -1;
+    if (ret == 0 && !object_exists(oid_out)) {
+        char *obj_path = get_object_path(oid_out);
+        char *slash = strrchr(obj_path, '/');
+        *slash = '\0';
+        create_dir_recursive(obj_path);
+        *slash = '/';
+        if (rename(writer->tmp_path, obj_path) != 0) {
+            perror("rename");
+            ret = -1;
+        }
+    }
 
-    // Write to file
-    int ret = write_file(obj_path, compressed, compressed_size);
-    
-    free(full_data);
-    free(compressed);
+    unlink(writer->tmp_path);
+    free(writer);
     return ret;
 }
 
-// Read object from disk with decompression
-void *read_object(const char *sha1, size_t *size, ObjectType *type) {
-    char obj_path[MAX_PATH];
-    snprintf(obj_path, sizeof(obj_path), "%s/%c%c/%s", OBJECTS_DIR,
-             sha1[0], sha1[1], sha1 + 2);
+// Object IDs of several in-memory objects of one type. All buffers go through
+// a single digest context, so small blobs pay no per-object setup cost.
+int hash_object_batch(ObjectType type, const void *const *data, const size_t *sizes,
+                      size_t count, ObjectId *oids) {
+    HashCtx *ctx = hash_ctx_new();
+    if (!ctx) {
+        return -1;
+    }
 
-    if (!file_exists(obj_path)) {
-        return NULL;
+    for (size_t i = 0; i < count; i++) {
+        char header[64];
+        int header_len = format_object_header(type, sizes[i], header, sizeof(header));
+        if (header_len < 0) {
+            hash_ctx_free(ctx);
+            return -1;
+        }
+        if (i > 0) {
+            hash_reset(ctx);
+        }
+        hash_update(ctx, header, header_len);
+        hash_update(ctx, data[i], sizes[i]);
+        hash_digest(ctx, oids[i].hash);
     }
 
-    // Read compressed data
-    size_t compressed_size;
-    char *compressed = read_file(obj_path, &compressed_size);
-    if (!compressed) {
-        return NULL;
+    hash_ctx_free(ctx);
+    return 0;
+}
+
+// Store an object whose ID has already been computed
+static int store_object(const void *data, size_t size, ObjectType type, ObjectId *oid) {
+    ObjectWriter *writer = writer_open(type, size, data, size, 0);
+    if (!writer) {
+        return -1;
     }
+    if (object_writer_write(writer, data, size) != 0) {
+        object_writer_abort(writer);
+        return -1;
+    }
+    return object_writer_close(writer, oid);
+}
 
-    // Decompress
-    void *decompressed;
-    size_t decompressed_size;
-    if (decompress_data(compressed, compressed_size, &decompressed, &decompressed_size) != 0) {
-        free(compressed);
-        return NULL;
+// Hash a batch of objects, then write only those not already stored
+int write_object_batch(ObjectType type, const void *const *data, const size_t *sizes,
+                       size_t count, ObjectId *oids) {
+    if (hash_object_batch(type, data, sizes, count, oids) != 0) {
+        return -1;
     }
-    free(compressed);
 
-    // Parse header
-    char *data = (char *)decompressed;
-    char *space = strchr(data, ' ');
-    char *null = strchr(data, '\0');
-    
-    if (!space || !null) {
-        free(decompressed);
-        return NULL;
+    for (size_t i = 0; i < count; i++) {
+        if (!object_exists(&oids[i]) && store_object(data[i], sizes[i], type, &oids[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Write object to disk with compression
+int write_object(const void *data, size_t size, ObjectType type, ObjectId *oid_out) {
+    return write_object_batch(type, &data, &size, 1, oid_out);
+}
+
+static ssize_t read_retry(int fd, void *buf, size_t len) {
+    ssize_t n;
+    do {
+        n = read(fd, buf, len);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+// Stream a file into the object store in fixed-size chunks, so memory use
+// does not depend on the file size. st_out receives the file's stat data.
+int write_object_file(const char *path, ObjectType type, ObjectId *oid_out, struct stat *st_out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    unsigned char *buf = malloc(STREAM_CHUNK);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
+
+    // The first chunk doubles as the compressibility sample
+    size_t remaining = st.st_size;
+    ssize_t n = read_retry(fd, buf, remaining > STREAM_CHUNK ? STREAM_CHUNK : remaining);
+
+    ObjectWriter *writer = object_writer_open(type, st.st_size, buf, n > 0 ? n : 0);
+    if (!writer) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+
+    while (remaining > 0 && n > 0) {
+        if (object_writer_write(writer, buf, n) != 0) {
+            break;
+        }
+        remaining -= n;
+        if (remaining > 0) {
+            n = read_retry(fd, buf, remaining > STREAM_CHUNK ? STREAM_CHUNK : remaining);
+        }
+    }
+
+    // A file that grew or shrank while we read it would be stored inconsistently
+    int changed = remaining > 0 || read_retry(fd, buf, 1) > 0;
+    free(buf);
+    close(fd);
+
+    if (changed) {
+        fprintf(stderr, "Error: '%s' changed while reading\n", path);
+        object_writer_abort(writer);
+        return -1;
+    }
+
+    if (object_writer_close(writer, oid_out) != 0) {
+        return -1;
+    }
+    if (st_out) {
+        *st_out = st;
+    }
+    return 0;
+}
+
+// Object ID a file would get, computed in fixed-size chunks without
+// storing anything
+int hash_object_file(const char *path, ObjectType type, ObjectId *oid_out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
     }
 
-    *space = '\0';
-    const char *type_str = data;
-    *size = atoll(space + 1);
+    struct stat st;
+    char header[64];
+    int header_len;
+    unsigned char *buf = malloc(STREAM_CHUNK);
+    HashCtx *ctx = hash_ctx_new();
+    if (fstat(fd, &st) != 0 || !buf || !ctx ||
+        (header_len = format_object_header(type, st.st_size, header, sizeof(header))) < 0) {
+        hash_ctx_free(ctx);
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    hash_update(ctx, header, header_len);
+
+    size_t remaining = st.st_size;
+    ssize_t n = 1;
+    while (remaining > 0 && n > 0) {
+        n = read_retry(fd, buf, remaining > STREAM_CHUNK ? STREAM_CHUNK : remaining);
+        if (n > 0) {
+            hash_update(ctx, buf, n);
+            remaining -= n;
+        }
+    }
+    free(buf);
+    close(fd);
+
+    if (remaining > 0) {
+        hash_ctx_free(ctx);
+        return -1;
+    }
+    hash_final(ctx, oid_out->hash);
+    return 0;
+}
+
+// Read object through the object cache, then packs, then loose objects
+void *read_object(const ObjectId *oid, size_t *size, ObjectType *type) {
+    void *data = object_cache_get(oid, size, type);
+    if (data) {
+        return data;
+    }
 
-    if (strcmp(type_str, "blob") == 0) {
+    data = pack_read_object(oid, size, type);
+    if (!data) {
+        data = read_loose_object(oid, size, type);
+    }
+    if (data) {
+        object_cache_put(oid, data, *size, *type);
+    }
+    return data;
+}
+
+// Room for the longest "type size\0" header
+#define OBJECT_HEADER_MAX 32
+
+struct ObjectStream {
+    int fd;                          // loose object file, -1 otherwise
+    const unsigned char *mapped;     // undeltified pack entry
+    size_t mapped_avail;
+    unsigned char *buffer;           // fully materialised object (pack deltas)
+    size_t buffer_pos;
+    Decompressor *decompressor;      // created once the first input bytes are seen
+    const unsigned char *next_in;
+    size_t avail_in;
+    size_t remaining;                // payload bytes not yet returned
+    unsigned char in[STREAM_CHUNK];
+};
+
+// Parse "type size\0"; returns the header length or -1
+static int parse_object_header(const unsigned char *data, size_t len,
+                               ObjectType *type, size_t *size) {
+    const unsigned char *null = memchr(data, '\0', len);
+    const unsigned char *space = memchr(data, ' ', len);
+    if (!null || !space || space > null) {
+        return -1;
+    }
+
+    size_t type_len = space - data;
+    if (type_len == 4 && memcmp(data, "blob", 4) == 0) {
         *type = OBJ_BLOB;
-    } else if (strcmp(type_str, "tree") == 0) {
+    } else if (type_len == 4 && memcmp(data, "tree", 4) == 0) {
         *type = OBJ_TREE;
-    } else if (strcmp(type_str, "commit") == 0) {
+    } else if (type_len == 6 && memcmp(data, "commit", 6) == 0) {
         *type = OBJ_COMMIT;
     } else {
-        free(decompressed);
+        return -1;
+    }
+
+    char *end;
+    *size = strtoull((const char *)space + 1, &end, 10);
+    if ((const unsigned char *)end != null) {
+        return -1;
+    }
+    return (int)(null - data + 1);
+}
+
+// Refill input from the loose file (reading at most max bytes) or the pack mapping
+static int stream_fill(ObjectStream *stream, size_t max) {
+    if (stream->avail_in > 0) {
+        return 0;
+    }
+
+    if (stream->mapped) {
+        stream->next_in = stream->mapped;
+        stream->avail_in = stream->mapped_avail;
+        stream->mapped_avail = 0;
+    } else if (stream->fd >= 0) {
+        ssize_t n;
+        do {
+            n = read(stream->fd, stream->in, max);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            return -1;
+        }
+        stream->next_in = stream->in;
+        stream->avail_in = n;
+    }
+
+    if (!stream->decompressor && stream->avail_in > 0) {
+        stream->decompressor = decompressor_new(stream->next_in, stream->avail_in);
+        if (!stream->decompressor) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Decompress into out until it is full or the input runs dry
+static int stream_decode(ObjectStream *stream, unsigned char **out, size_t *out_len, size_t max_fill) {
+    while (*out_len > 0) {
+        if (stream_fill(stream, max_fill) != 0) {
+            return -1;
+        }
+        if (stream->avail_in == 0) {
+            return 0; // input exhausted
+        }
+        size_t before = *out_len;
+        int ret = decompressor_run(stream->decompressor, &stream->next_in, &stream->avail_in,
+                                   out, out_len);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 1 || (*out_len == before && stream->avail_in > 0)) {
+            return 0; // end of stream
+        }
+    }
+    return 0;
+}
+
+static ObjectStream *stream_alloc(void) {
+    ObjectStream *stream = malloc(sizeof(ObjectStream));
+    if (!stream) {
+        return NULL;
+    }
+    stream->fd = -1;
+    stream->mapped = NULL;
+    stream->mapped_avail = 0;
+    stream->buffer = NULL;
+    stream->buffer_pos = 0;
+    stream->decompressor = NULL;
+    stream->next_in = NULL;
+    stream->avail_in = 0;
+    stream->remaining = 0;
+    return stream;
+}
+
+// Open a loose object and decompress only as far as the end of its header
+static ObjectStream *open_loose_stream(const ObjectId *oid, ObjectType *type, size_t *size) {
+    int fd = open(get_object_path(oid), O_RDONLY);
+    if (fd < 0) {
         return NULL;
     }
 
-    // Extract data
-    size_t header_len = null - data + 1;
-    void *obj_data = malloc(*size + 1);
-    if (!obj_data) {
-        free(decompressed);
+    ObjectStream *stream = stream_alloc();
+    if (!stream) {
+        close(fd);
         return NULL;
     }
-    memcpy(obj_data, data + header_len, *size);
-    ((char *)obj_data)[*size] = '\0';
+    stream->fd = fd;
 
-    free(decompressed);
-    return obj_data;
+    // Decode a byte at a time so nothing past the header is inflated
+    unsigned char header[OBJECT_HEADER_MAX];
+    size_t have = 0;
+    int header_len = -1;
+    while (have < sizeof(header)) {
+        unsigned char *out = header + have;
+        size_t out_len = 1;
+        if (stream_decode(stream, &out, &out_len, 512) != 0 || out_len != 0) {
+            break;
+        }
+        if (header[have++] == '\0') {
+            header_len = parse_object_header(header, have, type, size);
+            break;
+        }
+    }
+
+    if (header_len < 0) {
+        object_stream_close(stream);
+        return NULL;
+    }
+    stream->remaining = *size;
+    return stream;
 }
 
-// Check if object exists
-int object_exists(const char *sha1) {
-    char obj_path[MAX_PATH];
-    snprintf(obj_path, sizeof(obj_path), "%s/%c%c/%s", OBJECTS_DIR,
-             sha1[0], sha1[1], sha1 + 2);
-    return file_exists(obj_path);
+// Open an object for incremental reading; type and size come from the header
+ObjectStream *object_stream_open(const ObjectId *oid, ObjectType *type, size_t *size) {
+    size_t avail;
+    const unsigned char *mapped = pack_object_stream(oid, type, size, &avail);
+    if (mapped) {
+        ObjectStream *stream = stream_alloc();
+        if (!stream) {
+            return NULL;
+        }
+        stream->mapped = mapped;
+        stream->mapped_avail = avail;
+        stream->remaining = *size;
+        return stream;
+    }
+
+    // Deltas have to be rebuilt in memory first
+    void *data = pack_read_object(oid, size, type);
+    if (data) {
+        ObjectStream *stream = stream_alloc();
+        if (!stream) {
+            free(data);
+            return NULL;
+        }
+        stream->buffer = data;
+        stream->remaining = *size;
+        return stream;
+    }
+
+    return open_loose_stream(oid, type, size);
 }
 
-// Get object path
-char *get_object_path(const char *sha1) {
-    static char obj_path[MAX_PATH];
-    snprintf(obj_path, sizeof(obj_path), "%s/%c%c/%s", OBJECTS_DIR,
-             sha1[0], sha1[1], sha1 + 2);
-    return obj_path;
+// Read up to len payload bytes; returns the count, 0 at end of object, -1 on error
+ssize_t object_stream_read(ObjectStream *stream, void *buf, size_t len) {
+    if (len > stream->remaining) {
+        len = stream->remaining;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    if (stream->buffer) {
+        memcpy(buf, stream->buffer + stream->buffer_pos, len);
+        stream->buffer_pos += len;
+        stream->remaining -= len;
+        return len;
+    }
+
+    // Decompress straight into the caller's buffer
+    unsigned char *out = buf;
+    size_t out_len = len;
+    if (stream_decode(stream, &out, &out_len, STREAM_CHUNK) != 0 || out_len != 0) {
+        return -1; // corrupt, or the stream ended before the size in the header
+    }
+    stream->remaining -= len;
+    return len;
 }
 
-// Compress data using zlib
-int compress_data(const void *src, size_t src_len, void **dst, size_t *dst_len) {
-    *dst_len = compressBound(src_len);
-    *dst = malloc(*dst_len);
-    if (!*dst) {
-        return -1;
+void object_stream_close(ObjectStream *stream) {
+    if (!stream) {
+        return;
+    }
+    decompressor_free(stream->decompressor);
+    if (stream->fd >= 0) {
+        close(stream->fd);
     }
+    free(stream->buffer);
+    free(stream);
+}
 
-    if (compress2(*dst, dst_len, src, src_len, Z_DEFAULT_COMPRESSION) != Z_OK) {
-        free(*dst);
-        return -1;
+// Object type and size, inflating only the header of loose objects
+int read_object_header(const ObjectId *oid, ObjectType *type, size_t *size) {
+    if (pack_object_info(oid, type, size) == 0) {
+        return 0;
     }
 
+    ObjectStream *stream = open_loose_stream(oid, type, size);
+    if (!stream) {
+        return -1;
+    }
+    object_stream_close(stream);
     return 0;
 }
 
-// Decompress data using zlib
-int decompress_data(const void *src, size_t src_len, void **dst, size_t *dst_len) {
-    *dst_len = src_len * 4; // Initial guess
-    *dst = malloc(*dst_len);
-    if (!*dst) {
-        return -1;
+// Read loose object from disk, inflating directly into a buffer sized from the header
+void *read_loose_object(const ObjectId *oid, size_t *size, ObjectType *type) {
+    ObjectStream *stream = open_loose_stream(oid, type, size);
+    if (!stream) {
+        return NULL;
     }
 
-    int ret;
-    while ((ret = uncompress(*dst, dst_len, src, src_len)) == Z_BUF_ERROR) {
-        *dst_len *= 2;
-        void *new_dst = realloc(*dst, *dst_len);
-        if (!new_dst) {
-            free(*dst);
-            return -1;
-        }
-        *dst = new_dst;
+    unsigned char *data = malloc(*size + 1);
+    if (!data) {
+        object_stream_close(stream);
+        return NULL;
     }
 
-    if (ret != Z_OK) {
-        free(*dst);
-        return -1;
+    size_t total = 0;
+    while (total < *size) {
+        ssize_t n = object_stream_read(stream, data + total, *size - total);
+        if (n <= 0) {
+            free(data);
+            object_stream_close(stream);
+            return NULL;
+        }
+        total += n;
     }
+    object_stream_close(stream);
 
-    return 0;
+    data[*size] = '\0';
+    return data;
+}
+
+// Check if object exists in a pack or as a loose object
+int object_exists(const ObjectId *oid) {
+    return pack_has_object(oid) || loose_object_exists(oid);
+}
+
+// Check if loose object exists
+int loose_object_exists(const ObjectId *oid) {
+    return file_exists(get_object_path(oid));
+}
+
+// Path of a loose object: objects/xx/yyyy...; per-thread static buffer
+char *get_object_path(const ObjectId *oid) {
+    static _Thread_local char obj_path[sizeof(OBJECTS_DIR) + MAX_HASH_HEX_SIZE + 2];
+    char hex[MAX_HASH_HEX_SIZE + 1];
+    oid_to_hex(oid, hex);
+
+    memcpy(obj_path, OBJECTS_DIR "/", sizeof(OBJECTS_DIR));
+    char *p = obj_path + sizeof(OBJECTS_DIR);
+    p[0] = hex[0];
+    p[1] = hex[1];
+    p[2] = '/';
+    memcpy(p + 3, hex + 2, hash_hex_size() - 1);
+    return obj_path;
 }
@@ -0,0 +1,93 @@
+#include "vcs.h"
+
+// Object IDs are kept binary everywhere; these helpers convert at the text
+// boundary (refs, commit headers, command line, output) without stdio.
+
+#define BAD 0x100
+
+// Hex digit value, or BAD for anything else
+static const unsigned short hex_value[256] = {
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+      0,   1,   2,   3,   4,   5,   6,   7,   8,   9, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD,  10,  11,  12,  13,  14,  15, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD,  10,  11,  12,  13,  14,  15, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+    BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD, BAD,
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Encode a raw digest as lowercase hex digits plus a NUL
+void hash_to_hex(const unsigned char *hash, char *hex) {
+    size_t size = hash_size();
+    for (size_t i = 0; i < size; i++) {
+        hex[i * 2] = hex_digits[hash[i] >> 4];
+        hex[i * 2 + 1] = hex_digits[hash[i] & 0x0f];
+    }
+    hex[size * 2] = '\0';
+}
+
+// Decode exactly hash_hex_size() digits. Fails on a non-hex character, or if
+// another hex digit follows (an ID from a repository with a longer hash).
+int hex_to_hash(const char *hex, unsigned char *hash) {
+    size_t size = hash_size();
+    for (size_t i = 0; i < size; i++) {
+        // Checking the high digit first stops at a NUL before reading past it
+        unsigned int high = hex_value[(unsigned char)hex[i * 2]];
+        if (high == BAD) {
+            return -1;
+        }
+        unsigned int low = hex_value[(unsigned char)hex[i * 2 + 1]];
+        if (low == BAD) {
+            return -1;
+        }
+        hash[i] = (unsigned char)(high << 4 | low);
+    }
+    return hex_value[(unsigned char)hex[size * 2]] == BAD ? 0 : -1;
+}
+
+void oid_to_hex(const ObjectId *oid, char *hex) {
+    hash_to_hex(oid->hash, hex);
+}
+
+// Hex form in one of a few rotating per-thread buffers, for messages
+const char *oid_hex(const ObjectId *oid) {
+    static _Thread_local char buffers[4][MAX_HASH_HEX_SIZE + 1];
+    static _Thread_local int next;
+    char *hex = buffers[next];
+    next = (next + 1) % 4;
+    oid_to_hex(oid, hex);
+    return hex;
+}
+
+// Parse a full hex object name followed by a non-hex character or NUL
+int hex_to_oid(const char *hex, ObjectId *oid) {
+    return hex_to_hash(hex, oid->hash);
+}
+
+int oid_cmp(const ObjectId *a, const ObjectId *b) {
+    return memcmp(a->hash, b->hash, hash_size());
+}
+
+int oid_equal(const ObjectId *a, const ObjectId *b) {
+    return memcmp(a->hash, b->hash, hash_size()) == 0;
+}
+
+int oid_is_null(const ObjectId *oid) {
+    static const ObjectId null_oid;
+    return oid_equal(oid, &null_oid);
+}
+
+void oid_clear(ObjectId *oid) {
+    memset(oid, 0, sizeof(*oid));
+}
@@ -0,0 +1,1251 @@
+#include "vcs.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Pack file layout:
+//   "PACK" | version (be32) | object count (be32)
+//   entries: varint header (type, size) followed by a zlib stream
+//   trailing SHA-1 of everything above
+//
+// Index file layout:
+//   "\377nIx" | version (be32) | fanout[256] (be32)
+//   sorted binary SHA-1s | pack offsets (be64)
+//   pack checksum | index checksum
+#define PACK_SIGNATURE "PACK"
+#define PACK_VERSION 2
+#define PACK_HEADER_SIZE 12
+#define IDX_SIGNATURE "\377nIx"
+#define IDX_VERSION 1
+#define IDX_HEADER_SIZE 8
+#define IDX_FANOUT_SIZE (256 * 4)
+
+// Pack entry type codes
+#define PACK_OBJ_COMMIT 1
+#define PACK_OBJ_TREE 2
+#define PACK_OBJ_BLOB 3
+#define PACK_OBJ_OFS_DELTA 6
+
+// Delta search defaults, overridable via pack.window / pack.depth
+#define DEFAULT_PACK_WINDOW 10
+#define DEFAULT_PACK_DEPTH 50
+#define DELTA_BASE_CACHE_SLOTS 256
+#define DEFAULT_DELTA_BASE_CACHE_LIMIT (96L * 1024 * 1024)
+
+// Loaded pack and its index, both memory-mapped
+typedef struct PackFile {
+    char name[MAX_PATH];
+    unsigned char *idx_map;
+    size_t idx_size;
+    unsigned char *pack_map;
+    size_t pack_size;
+    uint32_t count;
+    const unsigned char *fanout;
+    const unsigned char *oids;
+    const unsigned char *offsets;
+    struct PackFile *next;
+} PackFile;
+
+// Object collected for repacking
+typedef struct {
+    ObjectId oid;
+    uint64_t offset;
+    int loose;
+    ObjectType type;
+    size_t size;
+    uint32_t name_hash;
+    int visited;
+} PackTarget;
+
+typedef struct {
+    PackTarget *items;
+    size_t count;
+    size_t capacity;
+} PackTargetList;
+
+// Recently used delta bases, keyed by pack and offset
+typedef struct {
+    PackFile *pack;
+    uint64_t offset;
+    ObjectType type;
+    unsigned char *data;
+    size_t size;
+    unsigned long last_used;
+} DeltaBaseCacheEntry;
+
+// The pack list is built once under packs_lock and only read afterwards, so
+// object lookups are safe from worker threads
+static PackFile *packs = NULL;
+static int packs_loaded = 0;
+static pthread_mutex_t packs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Shared by worker threads: entries are only touched under base_cache_lock,
+// and readers take copies, since another thread may evict them
+static DeltaBaseCacheEntry base_cache[DELTA_BASE_CACHE_SLOTS];
+static pthread_mutex_t base_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t base_cache_used = 0;
+static unsigned long base_cache_clock = 0;
+static long base_cache_limit = -1;
+
+static void base_cache_clear(void);
+
+static uint32_t get_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p) {
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static void put_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void put_be64(unsigned char *p, uint64_t v) {
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+// Map a whole file read-only
+static unsigned char *map_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return map;
+}
+
+static void pack_close(PackFile *pack) {
+    if (pack->idx_map) {
+        munmap(pack->idx_map, pack->idx_size);
+    }
+    if (pack->pack_map) {
+        munmap(pack->pack_map, pack->pack_size);
+    }
+    free(pack);
+}
+
+// Open a pack given the path of its .idx file
+static PackFile *pack_open(const char *idx_path) {
+    PackFile *pack = calloc(1, sizeof(PackFile));
+    if (!pack) {
+        return NULL;
+    }
+
+    pack->idx_map = map_file(idx_path, &pack->idx_size);
+    if (!pack->idx_map || pack->idx_size < IDX_HEADER_SIZE + IDX_FANOUT_SIZE ||
+        memcmp(pack->idx_map, IDX_SIGNATURE, 4) != 0 ||
+        get_be32(pack->idx_map + 4) != IDX_VERSION) {
+        pack_close(pack);
+        return NULL;
+    }
+
+    // Object IDs and checksums are as wide as the repository's hash
+    size_t hash_len = hash_size();
+    pack->fanout = pack->idx_map + IDX_HEADER_SIZE;
+    pack->count = get_be32(pack->fanout + 255 * 4);
+    pack->oids = pack->fanout + IDX_FANOUT_SIZE;
+    pack->offsets = pack->oids + (size_t)pack->count * hash_len;
+
+    size_t expected = IDX_HEADER_SIZE + IDX_FANOUT_SIZE +
+                      (size_t)pack->count * (hash_len + 8) + 2 * hash_len;
+    if (pack->idx_size != expected) {
+        pack_close(pack);
+        return NULL;
+    }
+
+    // Pack path is the index path with .idx replaced by .pack
+    snprintf(pack->name, sizeof(pack->name), "%s", idx_path);
+    size_t len = strlen(pack->name);
+    if (len < 4 || len + 1 >= sizeof(pack->name)) {
+        pack_close(pack);
+        return NULL;
+    }
+    strcpy(pack->name + len - 4, ".pack");
+
+    pack->pack_map = map_file(pack->name, &pack->pack_size);
+    if (!pack->pack_map || pack->pack_size < PACK_HEADER_SIZE + hash_len ||
+        memcmp(pack->pack_map, PACK_SIGNATURE, 4) != 0 ||
+        get_be32(pack->pack_map + 4) != PACK_VERSION ||
+        get_be32(pack->pack_map + 8) != pack->count) {
+        pack_close(pack);
+        return NULL;
+    }
+
+    return pack;
+}
+
+static void pack_load_all(void) {
+    pthread_mutex_lock(&packs_lock);
+    if (packs_loaded) {
+        pthread_mutex_unlock(&packs_lock);
+        return;
+    }
+
+    DIR *dir = opendir(PACK_DIR);
+    if (!dir) {
+        packs_loaded = 1;
+        pthread_mutex_unlock(&packs_lock);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || strcmp(entry->d_name + len - 4, ".idx") != 0) {
+            continue;
+        }
+
+        char idx_path[MAX_PATH];
+        snprintf(idx_path, sizeof(idx_path), "%s/%s", PACK_DIR, entry->d_name);
+        PackFile *pack = pack_open(idx_path);
+        if (pack) {
+            pack->next = packs;
+            packs = pack;
+        }
+    }
+
+    closedir(dir);
+    packs_loaded = 1;
+    pthread_mutex_unlock(&packs_lock);
+}
+
+// Drop all mapped packs so the next lookup rescans the pack directory
+void pack_reload(void) {
+    base_cache_clear();
+    while (packs) {
+        PackFile *next = packs->next;
+        pack_close(packs);
+        packs = next;
+    }
+    packs_loaded = 0;
+}
+
+// Binary search within the fanout range for the object's pack offset
+static int pack_find_offset(PackFile *pack, const ObjectId *oid, uint64_t *offset) {
+    const unsigned char *hash = oid->hash;
+    size_t hash_len = hash_size();
+    uint32_t lo = hash[0] ? get_be32(pack->fanout + (hash[0] - 1) * 4) : 0;
+    uint32_t hi = get_be32(pack->fanout + hash[0] * 4);
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(pack->oids + (size_t)mid * hash_len, hash, hash_len);
+        if (cmp == 0) {
+            *offset = get_be64(pack->offsets + (size_t)mid * 8);
+            return 0;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+// Parse an entry header; returns the number of bytes consumed or 0 on error
+static size_t parse_entry_header(const unsigned char *p, size_t avail,
+                                 int *type, uint64_t *size) {
+    if (avail == 0) {
+        return 0;
+    }
+
+    size_t pos = 0;
+    unsigned char c = p[pos++];
+    *type = (c >> 4) & 7;
+    *size = c & 15;
+    int shift = 4;
+
+    while (c & 0x80) {
+        if (pos >= avail || shift > 57) {
+            return 0;
+        }
+        c = p[pos++];
+        *size |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    }
+    return pos;
+}
+
+static size_t encode_entry_header(unsigned char *out, int type, uint64_t size) {
+    size_t pos = 0;
+    unsigned char c = (unsigned char)((type << 4) | (size & 15));
+    size >>= 4;
+
+    while (size) {
+        out[pos++] = c | 0x80;
+        c = size & 0x7f;
+        size >>= 7;
+    }
+    out[pos++] = c;
+    return pos;
+}
+
+static int pack_type_to_object_type(int pack_type, ObjectType *type) {
+    switch (pack_type) {
+        case PACK_OBJ_COMMIT: *type = OBJ_COMMIT; return 0;
+        case PACK_OBJ_TREE: *type = OBJ_TREE; return 0;
+        case PACK_OBJ_BLOB: *type = OBJ_BLOB; return 0;
+        default: return -1;
+    }
+}
+
+static int object_type_to_pack_type(ObjectType type) {
+    switch (type) {
+        case OBJ_COMMIT: return PACK_OBJ_COMMIT;
+        case OBJ_TREE: return PACK_OBJ_TREE;
+        case OBJ_BLOB: return PACK_OBJ_BLOB;
+        default: return -1;
+    }
+}
+
+// Entry header fields and where its payload begins
+typedef struct {
+    int type;
+    uint64_t size;
+    uint64_t base_offset;
+    const unsigned char *data;
+    size_t avail;
+} PackEntry;
+
+static int pack_parse_entry(PackFile *pack, uint64_t offset, PackEntry *entry) {
+    size_t data_end = pack->pack_size - hash_size();
+    if (offset < PACK_HEADER_SIZE || offset >= data_end) {
+        return -1;
+    }
+
+    const unsigned char *p = pack->pack_map + offset;
+    size_t avail = data_end - offset;
+    size_t header_len = parse_entry_header(p, avail, &entry->type, &entry->size);
+    if (header_len == 0) {
+        return -1;
+    }
+    p += header_len;
+    avail -= header_len;
+
+    if (entry->type == PACK_OBJ_OFS_DELTA) {
+        // Negative offset to the base, big-endian with an implicit +1 per byte
+        if (avail == 0) {
+            return -1;
+        }
+        unsigned char c = *p++;
+        avail--;
+        uint64_t distance = c & 0x7f;
+        while (c & 0x80) {
+            if (avail == 0 || distance > (UINT64_MAX >> 7)) {
+                return -1;
+            }
+            c = *p++;
+            avail--;
+            distance = ((distance + 1) << 7) | (c & 0x7f);
+        }
+        if (distance == 0 || distance > offset) {
+            return -1;
+        }
+        entry->base_offset = offset - distance;
+    }
+
+    entry->data = p;
+    entry->avail = avail;
+    return 0;
+}
+
+static unsigned char *pack_inflate_entry(PackEntry *entry) {
+    unsigned char *data = malloc(entry->size + 1);
+    if (!data) {
+        return NULL;
+    }
+    if (decompress_exact(entry->data, entry->avail, data, entry->size) != 0) {
+        free(data);
+        return NULL;
+    }
+    data[entry->size] = '\0';
+    return data;
+}
+
+static void base_cache_evict(DeltaBaseCacheEntry *slot) {
+    if (slot->data) {
+        base_cache_used -= slot->size;
+        free(slot->data);
+        slot->data = NULL;
+        slot->pack = NULL;
+    }
+}
+
+static void base_cache_clear(void) {
+    pthread_mutex_lock(&base_cache_lock);
+    for (int i = 0; i < DELTA_BASE_CACHE_SLOTS; i++) {
+        base_cache_evict(&base_cache[i]);
+    }
+    pthread_mutex_unlock(&base_cache_lock);
+}
+
+static DeltaBaseCacheEntry *base_cache_slot(PackFile *pack, uint64_t offset) {
+    uintptr_t key = (uintptr_t)pack ^ (uintptr_t)(offset * 0x9e3779b97f4a7c15ULL);
+    return &base_cache[(key >> 7) % DELTA_BASE_CACHE_SLOTS];
+}
+
+// Call with base_cache_lock held
+static DeltaBaseCacheEntry *base_cache_find(PackFile *pack, uint64_t offset) {
+    DeltaBaseCacheEntry *slot = base_cache_slot(pack, offset);
+    if (slot->data && slot->pack == pack && slot->offset == offset) {
+        slot->last_used = ++base_cache_clock;
+        return slot;
+    }
+    return NULL;
+}
+
+// NUL-terminated copy of a cached base, or NULL if it is not cached
+static unsigned char *base_cache_get(PackFile *pack, uint64_t offset, size_t *size,
+                                     ObjectType *type) {
+    unsigned char *copy = NULL;
+    pthread_mutex_lock(&base_cache_lock);
+    DeltaBaseCacheEntry *cached = base_cache_find(pack, offset);
+    if (cached && (copy = malloc(cached->size + 1)) != NULL) {
+        memcpy(copy, cached->data, cached->size + 1);
+        *size = cached->size;
+        *type = cached->type;
+    }
+    pthread_mutex_unlock(&base_cache_lock);
+    return copy;
+}
+
+// Cache takes ownership of data; evicts least recently used bases over the limit
+static void base_cache_add(PackFile *pack, uint64_t offset, ObjectType type,
+                           unsigned char *data, size_t size) {
+    pthread_mutex_lock(&base_cache_lock);
+    if (base_cache_limit < 0) {
+        base_cache_limit = config_get_int("core.deltaBaseCacheLimit",
+                                          DEFAULT_DELTA_BASE_CACHE_LIMIT);
+    }
+    if ((long)size > base_cache_limit) {
+        pthread_mutex_unlock(&base_cache_lock);
+        free(data);
+        return;
+    }
+
+    DeltaBaseCacheEntry *slot = base_cache_slot(pack, offset);
+    base_cache_evict(slot);
+
+    while (base_cache_used + size > (size_t)base_cache_limit) {
+        DeltaBaseCacheEntry *oldest = NULL;
+        for (int i = 0; i < DELTA_BASE_CACHE_SLOTS; i++) {
+            if (base_cache[i].data && (!oldest || base_cache[i].last_used < oldest->last_used)) {
+                oldest = &base_cache[i];
+            }
+        }
+        if (!oldest) {
+            break;
+        }
+        base_cache_evict(oldest);
+    }
+
+    slot->pack = pack;
+    slot->offset = offset;
+    slot->type = type;
+    slot->data = data;
+    slot->size = size;
+    slot->last_used = ++base_cache_clock;
+    base_cache_used += size;
+    pthread_mutex_unlock(&base_cache_lock);
+}
+
+// Decode the entry at offset into a NUL-terminated buffer, resolving deltas.
+// Intermediate bases go to the delta base cache so walking a chain is linear.
+static void *pack_read_entry(PackFile *pack, uint64_t offset, size_t *size, ObjectType *type) {
+    uint64_t *chain = NULL;
+    size_t chain_len = 0;
+    size_t chain_capacity = 0;
+
+    unsigned char *base = NULL;
+    size_t base_size = 0;
+    int base_cached = 0;
+    uint64_t base_offset = offset;
+
+    // Walk towards the root until a cached base or a full object
+    for (;;) {
+        if ((base = base_cache_get(pack, base_offset, &base_size, type)) != NULL) {
+            base_cached = 1;
+            break;
+        }
+
+        PackEntry entry;
+        if (pack_parse_entry(pack, base_offset, &entry) != 0) {
+            free(chain);
+            return NULL;
+        }
+
+        if (entry.type != PACK_OBJ_OFS_DELTA) {
+            if (pack_type_to_object_type(entry.type, type) != 0 ||
+                !(base = pack_inflate_entry(&entry))) {
+                free(chain);
+                return NULL;
+            }
+            base_size = entry.size;
+            break;
+        }
+
+        if (chain_len >= chain_capacity) {
+            chain_capacity = chain_capacity ? chain_capacity * 2 : 16;
+            uint64_t *new_chain = realloc(chain, sizeof(uint64_t) * chain_capacity);
+            if (!new_chain) {
+                free(chain);
+                return NULL;
+            }
+            chain = new_chain;
+        }
+        chain[chain_len++] = base_offset;
+        base_offset = entry.base_offset;
+    }
+
+    // Apply deltas from the innermost outwards
+    while (chain_len > 0) {
+        uint64_t delta_offset = chain[--chain_len];
+        PackEntry entry;
+        unsigned char *delta = NULL;
+        void *result = NULL;
+        size_t result_size;
+
+        if (pack_parse_entry(pack, delta_offset, &entry) != 0 ||
+            !(delta = pack_inflate_entry(&entry)) ||
+            apply_delta(base, base_size, delta, entry.size, &result, &result_size) != 0) {
+            free(delta);
+            free(base);
+            free(chain);
+            return NULL;
+        }
+        free(delta);
+
+        // A base copied out of the cache is already there
+        if (base_cached) {
+            free(base);
+        } else {
+            base_cache_add(pack, base_offset, *type, base, base_size);
+        }
+        base = result;
+        base_size = result_size;
+        base_cached = 0;
+        base_offset = delta_offset;
+    }
+    free(chain);
+
+    *size = base_size;
+    return base;
+}
+
+// Find the pack and offset holding an object
+static PackFile *pack_locate(const ObjectId *oid, uint64_t *offset) {
+    pack_load_all();
+
+    for (PackFile *pack = packs; pack; pack = pack->next) {
+        if (pack_find_offset(pack, oid, offset) == 0) {
+            return pack;
+        }
+    }
+    return NULL;
+}
+
+// Decompress just enough of a delta to read its target size
+static int delta_target_size(PackEntry *entry, size_t *size) {
+    unsigned char head[20];
+    Decompressor *d = decompressor_new(entry->data, entry->avail);
+    if (!d) {
+        return -1;
+    }
+    const unsigned char *in = entry->data;
+    size_t in_len = entry->avail;
+    unsigned char *out = head;
+    size_t out_len = entry->size < sizeof(head) ? entry->size : sizeof(head);
+    size_t want = out_len;
+    int ret = 0;
+    while (ret == 0 && out_len > 0 && in_len > 0) {
+        size_t before = out_len;
+        ret = decompressor_run(d, &in, &in_len, &out, &out_len);
+        if (out_len == before) {
+            break;
+        }
+    }
+    decompressor_free(d);
+    if (ret < 0) {
+        return -1;
+    }
+    size_t have = want - out_len;
+
+    // Skip the source size, then decode the target size
+    size_t pos = 0;
+    while (pos < have && (head[pos] & 0x80)) {
+        pos++;
+    }
+    pos++;
+    size_t result = 0;
+    int shift = 0;
+    while (pos < have) {
+        unsigned char c = head[pos++];
+        result |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+        if (!(c & 0x80)) {
+            *size = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Type and size of a packed object without inflating its payload.
+// Returns -1 if no pack contains the object.
+int pack_object_info(const ObjectId *oid, ObjectType *type, size_t *size) {
+    uint64_t offset;
+    PackFile *pack = pack_locate(oid, &offset);
+    if (!pack) {
+        return -1;
+    }
+
+    PackEntry entry;
+    if (pack_parse_entry(pack, offset, &entry) != 0) {
+        return -1;
+    }
+    if (entry.type != PACK_OBJ_OFS_DELTA) {
+        *size = entry.size;
+        return pack_type_to_object_type(entry.type, type);
+    }
+
+    if (delta_target_size(&entry, size) != 0) {
+        return -1;
+    }
+
+    // The type lives at the root of the chain
+    for (;;) {
+        pthread_mutex_lock(&base_cache_lock);
+        DeltaBaseCacheEntry *cached = base_cache_find(pack, entry.base_offset);
+        if (cached) {
+            *type = cached->type;
+        }
+        pthread_mutex_unlock(&base_cache_lock);
+        if (cached) {
+            return 0;
+        }
+        if (pack_parse_entry(pack, entry.base_offset, &entry) != 0) {
+            return -1;
+        }
+        if (entry.type != PACK_OBJ_OFS_DELTA) {
+            return pack_type_to_object_type(entry.type, type);
+        }
+    }
+}
+
+// Locate the zlib stream of an undeltified packed object inside the mapping,
+// so it can be inflated incrementally. Returns NULL for deltas or missing objects.
+const unsigned char *pack_object_stream(const ObjectId *oid, ObjectType *type,
+                                        size_t *size, size_t *avail) {
+    uint64_t offset;
+    PackFile *pack = pack_locate(oid, &offset);
+    PackEntry entry;
+    if (!pack || pack_parse_entry(pack, offset, &entry) != 0 ||
+        pack_type_to_object_type(entry.type, type) != 0) {
+        return NULL;
+    }
+    *size = entry.size;
+    *avail = entry.avail;
+    return entry.data;
+}
+
+// Read object from any pack; NULL if no pack contains it
+void *pack_read_object(const ObjectId *oid, size_t *size, ObjectType *type) {
+    uint64_t offset;
+    PackFile *pack = pack_locate(oid, &offset);
+    if (!pack) {
+        return NULL;
+    }
+    return pack_read_entry(pack, offset, size, type);
+}
+
+// Check whether any pack contains the object
+int pack_has_object(const ObjectId *oid) {
+    uint64_t offset;
+    return pack_locate(oid, &offset) != NULL;
+}
+
+static int target_add(PackTargetList *list, const ObjectId *oid, int loose) {
+    if (list->count >= list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        PackTarget *items = realloc(list->items, sizeof(PackTarget) * capacity);
+        if (!items) {
+            return -1;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    PackTarget *target = &list->items[list->count++];
+    memset(target, 0, sizeof(PackTarget));
+    target->oid = *oid;
+    target->loose = loose;
+    return 0;
+}
+
+static int target_cmp(const void *a, const void *b) {
+    const PackTarget *ta = (const PackTarget *)a;
+    const PackTarget *tb = (const PackTarget *)b;
+    int cmp = oid_cmp(&ta->oid, &tb->oid);
+    if (cmp != 0) {
+        return cmp;
+    }
+    // Loose copies sort first so deduplication keeps them marked for removal
+    return tb->loose - ta->loose;
+}
+
+static int is_hex_string(const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return 0;
+        }
+    }
+    return s[len] == '\0';
+}
+
+// Collect every loose object under .vcs/objects/xx/
+static int collect_loose_objects(PackTargetList *list) {
+    DIR *dir = opendir(OBJECTS_DIR);
+    if (!dir) {
+        perror("opendir");
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!is_hex_string(entry->d_name, 2)) {
+            continue;
+        }
+
+        char subdir_path[MAX_PATH];
+        snprintf(subdir_path, sizeof(subdir_path), "%s/%s", OBJECTS_DIR, entry->d_name);
+        DIR *subdir = opendir(subdir_path);
+        if (!subdir) {
+            continue;
+        }
+
+        struct dirent *obj;
+        while ((obj = readdir(subdir)) != NULL) {
+            if (!is_hex_string(obj->d_name, hash_hex_size() - 2)) {
+                continue;
+            }
+
+            char hex[MAX_HASH_HEX_SIZE + 1];
+            memcpy(hex, entry->d_name, 2);
+            memcpy(hex + 2, obj->d_name, hash_hex_size() - 2);
+            hex[hash_hex_size()] = '\0';
+            ObjectId oid;
+            if (hex_to_oid(hex, &oid) != 0) {
+                continue;
+            }
+            if (target_add(list, &oid, 1) != 0) {
+                closedir(subdir);
+                closedir(dir);
+                return -1;
+            }
+        }
+        closedir(subdir);
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+static int target_oid_cmp(const void *a, const void *b) {
+    return oid_cmp(&((const PackTarget *)a)->oid, &((const PackTarget *)b)->oid);
+}
+
+// Delta search order: type, then path name, then largest first so bases precede
+// the smaller revisions that are usually derived from them
+static int target_delta_cmp(const void *a, const void *b) {
+    const PackTarget *ta = (const PackTarget *)a;
+    const PackTarget *tb = (const PackTarget *)b;
+    if (ta->type != tb->type) {
+        return ta->type < tb->type ? -1 : 1;
+    }
+    if (ta->name_hash != tb->name_hash) {
+        return ta->name_hash < tb->name_hash ? -1 : 1;
+    }
+    if (ta->size != tb->size) {
+        return ta->size > tb->size ? -1 : 1;
+    }
+    return oid_cmp(&ta->oid, &tb->oid);
+}
+
+// Hash that groups files with the same trailing name characters together
+static uint32_t pack_name_hash(const char *name) {
+    uint32_t hash = 0;
+    unsigned char c;
+    while ((c = (unsigned char)*name++) != 0) {
+        if (c == ' ' || c == '\t' || c == '\n') {
+            continue;
+        }
+        hash = (hash >> 2) + ((uint32_t)c << 24);
+    }
+    return hash;
+}
+
+static PackTarget *target_find(PackTargetList *list, const ObjectId *oid) {
+    PackTarget key;
+    key.oid = *oid;
+    return bsearch(&key, list->items, list->count, sizeof(PackTarget), target_oid_cmp);
+}
+
+static void name_tree_entries(PackTargetList *list, const ObjectId *tree_oid, const char *prefix) {
+    PackTarget *tree_target = target_find(list, tree_oid);
+    if (tree_target) {
+        if (tree_target->visited) {
+            return;
+        }
+        tree_target->visited = 1;
+    }
+
+    size_t size;
+    ObjectType type;
+    unsigned char *data = read_object(tree_oid, &size, &type);
+    if (!data || type != OBJ_TREE) {
+        free(data);
+        return;
+    }
+
+    TreeIter it;
+    tree_iter_init(&it, data, size);
+    while (tree_iter_next(&it) > 0) {
+        char path[MAX_PATH];
+        int len = snprintf(path, sizeof(path), "%s%s", prefix, it.name);
+        if (len < 0 || (size_t)len >= sizeof(path)) {
+            continue;
+        }
+
+        ObjectId oid;
+        tree_iter_oid(&it, &oid);
+        if (S_ISDIR(it.mode)) {
+            if ((size_t)len + 2 <= sizeof(path)) {
+                path[len] = '/';
+                path[len + 1] = '\0';
+                name_tree_entries(list, &oid, path);
+            }
+            continue;
+        }
+
+        PackTarget *target = target_find(list, &oid);
+        if (target && target->name_hash == 0) {
+            target->name_hash = pack_name_hash(path);
+        }
+    }
+    free(data);
+}
+
+static void name_history(PackTargetList *list, const ObjectId *commit_oid) {
+    ObjectId current = *commit_oid;
+
+    while (!oid_is_null(&current)) {
+        PackTarget *target = target_find(list, &current);
+        if (target) {
+            if (target->visited) {
+                return;
+            }
+            target->visited = 1;
+        }
+
+        Commit *commit = read_commit(&current);
+        if (!commit) {
+            return;
+        }
+        name_tree_entries(list, &commit->tree, "");
+        current = commit->parent;
+        commit_free(commit);
+    }
+}
+
+// Attach path-name hashes to blobs reachable from HEAD and every branch.
+// The list must be sorted by SHA-1.
+static void assign_name_hashes(PackTargetList *list) {
+    ObjectId oid;
+    if (get_head_commit(&oid) == 0) {
+        name_history(list, &oid);
+    }
+
+    DIR *dir = opendir(REFS_HEADS_DIR);
+    if (!dir) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        if (read_ref(entry->d_name, &oid) == 0) {
+            name_history(list, &oid);
+        }
+    }
+    closedir(dir);
+}
+
+// Candidate delta base kept in the sliding window
+typedef struct {
+    PackTarget *target;
+    unsigned char *data;
+    int depth;
+} WindowSlot;
+
+static int write_entry(FILE *fp, int pack_type, ObjectType type, const void *data, size_t size,
+                       uint64_t base_distance, size_t *written) {
+    void *compressed;
+    size_t compressed_size;
+    if (compress_data(data, size, type, &compressed, &compressed_size) != 0) {
+        return -1;
+    }
+
+    unsigned char header[32];
+    size_t header_len = encode_entry_header(header, pack_type, size);
+
+    if (pack_type == PACK_OBJ_OFS_DELTA) {
+        unsigned char ofs[16];
+        size_t pos = sizeof(ofs) - 1;
+        ofs[pos] = base_distance & 0x7f;
+        while (base_distance >>= 7) {
+            ofs[--pos] = 0x80 | (--base_distance & 0x7f);
+        }
+        memcpy(header + header_len, ofs + pos, sizeof(ofs) - pos);
+        header_len += sizeof(ofs) - pos;
+    }
+
+    int ret = 0;
+    if (fwrite(header, 1, header_len, fp) != header_len ||
+        fwrite(compressed, 1, compressed_size, fp) != compressed_size) {
+        ret = -1;
+    }
+    free(compressed);
+    *written = header_len + compressed_size;
+    return ret;
+}
+
+// Write all targets into a pack at path in list order, deltifying each object
+// against the best of the previous pack.window objects of the same type.
+// Fills in each target's offset.
+static int write_pack_file(const char *path, PackTargetList *list, size_t *delta_count) {
+    long window = config_get_int("pack.window", DEFAULT_PACK_WINDOW);
+    long max_depth = config_get_int("pack.depth", DEFAULT_PACK_DEPTH);
+    if (window < 0) {
+        window = 0;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        perror("fopen pack");
+        return -1;
+    }
+
+    WindowSlot *slots = window ? calloc(window, sizeof(WindowSlot)) : NULL;
+    if (window && !slots) {
+        fclose(fp);
+        return -1;
+    }
+
+    int ret = -1;
+    unsigned char header[PACK_HEADER_SIZE];
+    memcpy(header, PACK_SIGNATURE, 4);
+    put_be32(header + 4, PACK_VERSION);
+    put_be32(header + 8, (uint32_t)list->count);
+    if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+        goto done;
+    }
+
+    uint64_t offset = PACK_HEADER_SIZE;
+    *delta_count = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        PackTarget *target = &list->items[i];
+        size_t size;
+        ObjectType type;
+        unsigned char *data = read_object(&target->oid, &size, &type);
+        if (!data) {
+            fprintf(stderr, "Error: Failed to read object %s\n", oid_hex(&target->oid));
+            goto done;
+        }
+
+        // Pick the base yielding the smallest delta
+        WindowSlot *best = NULL;
+        void *best_delta = NULL;
+        size_t best_size = size / 2;
+        for (long w = 0; w < window; w++) {
+            WindowSlot *slot = &slots[w];
+            if (!slot->data || slot->target->type != type || slot->depth >= max_depth ||
+                slot->target->size < size / 32 || best_size <= 32) {
+                continue;
+            }
+
+            void *delta;
+            size_t delta_size;
+            if (create_delta(slot->data, slot->target->size, data, size,
+                             best_size - 1, &delta, &delta_size) == 0) {
+                free(best_delta);
+                best = slot;
+                best_delta = delta;
+                best_size = delta_size;
+            }
+        }
+
+        size_t written;
+        int write_ret;
+        if (best) {
+            write_ret = write_entry(fp, PACK_OBJ_OFS_DELTA, type, best_delta, best_size,
+                                    offset - best->target->offset, &written);
+            free(best_delta);
+            (*delta_count)++;
+        } else {
+            write_ret = write_entry(fp, object_type_to_pack_type(type), type,
+                                    data, size, 0, &written);
+        }
+        if (write_ret != 0) {
+            free(data);
+            goto done;
+        }
+
+        target->offset = offset;
+        offset += written;
+
+        // Replace the oldest window slot with this object
+        if (window) {
+            WindowSlot *slot = &slots[i % window];
+            free(slot->data);
+            slot->target = target;
+            slot->data = data;
+            slot->depth = best ? best->depth + 1 : 0;
+        } else {
+            free(data);
+        }
+    }
+    ret = 0;
+
+done:
+    for (long w = 0; w < window; w++) {
+        free(slots[w].data);
+    }
+    free(slots);
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+// Append the trailing checksum to a finished pack
+static int append_pack_checksum(const char *path, unsigned char *checksum) {
+    size_t size;
+    unsigned char *map = map_file(path, &size);
+    if (!map) {
+        return -1;
+    }
+    compute_hash(map, size, checksum);
+    munmap(map, size);
+
+    FILE *fp = fopen(path, "ab");
+    if (!fp) {
+        return -1;
+    }
+    size_t written = fwrite(checksum, 1, hash_size(), fp);
+    if (fclose(fp) != 0 || written != hash_size()) {
+        return -1;
+    }
+    return 0;
+}
+
+// Build the fanout index for a pack
+static int write_index_file(const char *path, PackTargetList *list,
+                            const unsigned char *pack_checksum) {
+    size_t hash_len = hash_size();
+    size_t size = IDX_HEADER_SIZE + IDX_FANOUT_SIZE +
+                  list->count * (hash_len + 8) + 2 * hash_len;
+    unsigned char *data = calloc(1, size);
+    if (!data) {
+        return -1;
+    }
+
+    memcpy(data, IDX_SIGNATURE, 4);
+    put_be32(data + 4, IDX_VERSION);
+
+    unsigned char *fanout = data + IDX_HEADER_SIZE;
+    unsigned char *oids = fanout + IDX_FANOUT_SIZE;
+    unsigned char *offsets = oids + list->count * hash_len;
+
+    size_t i = 0;
+    for (int byte = 0; byte < 256; byte++) {
+        while (i < list->count && list->items[i].oid.hash[0] == byte) {
+            i++;
+        }
+        put_be32(fanout + byte * 4, (uint32_t)i);
+    }
+
+    for (i = 0; i < list->count; i++) {
+        memcpy(oids + i * hash_len, list->items[i].oid.hash, hash_len);
+        put_be64(offsets + i * 8, list->items[i].offset);
+    }
+
+    unsigned char *trailer = offsets + list->count * 8;
+    memcpy(trailer, pack_checksum, hash_len);
+    compute_hash(data, size - hash_len, trailer + hash_len);
+
+    int ret = write_file(path, data, size);
+    free(data);
+    return ret;
+}
+
+// Remove the loose copy of an object and its fanout directory if empty
+static void remove_loose_object(const ObjectId *oid) {
+    char *path = get_object_path(oid);
+    unlink(path);
+
+    *strrchr(path, '/') = '\0';
+    rmdir(path);
+}
+
+// Pack loose objects (and with all, every packed object) into a single new pack
+int repack_objects(int all) {
+    PackTargetList list = {0};
+
+    if (collect_loose_objects(&list) != 0) {
+        free(list.items);
+        return -1;
+    }
+
+    pack_load_all();
+    if (all) {
+        for (PackFile *pack = packs; pack; pack = pack->next) {
+            for (uint32_t i = 0; i < pack->count; i++) {
+                ObjectId oid;
+                memcpy(oid.hash, pack->oids + (size_t)i * hash_size(), hash_size());
+                if (target_add(&list, &oid, 0) != 0) {
+                    free(list.items);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    // Sort by object ID and drop duplicates
+    qsort(list.items, list.count, sizeof(PackTarget), target_cmp);
+    size_t unique = 0;
+    size_t loose_count = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        if (unique > 0 && oid_equal(&list.items[unique - 1].oid, &list.items[i].oid)) {
+            continue;
+        }
+        list.items[unique++] = list.items[i];
+        loose_count += list.items[i].loose;
+    }
+    list.count = unique;
+
+    if (list.count == 0 || (!all && loose_count == 0)) {
+        printf("Nothing to pack\n");
+        free(list.items);
+        return 0;
+    }
+
+    // Gather type, size and path names to order the delta search
+    for (size_t i = 0; i < list.count; i++) {
+        PackTarget *target = &list.items[i];
+        if (read_object_header(&target->oid, &target->type, &target->size) != 0) {
+            fprintf(stderr, "Error: Failed to read object %s\n", oid_hex(&target->oid));
+            free(list.items);
+            return -1;
+        }
+    }
+    assign_name_hashes(&list);
+    qsort(list.items, list.count, sizeof(PackTarget), target_delta_cmp);
+
+    if (create_dir_recursive(PACK_DIR) != 0) {
+        free(list.items);
+        return -1;
+    }
+
+    char tmp_path[MAX_PATH];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/tmp_pack_XXXXXX", PACK_DIR);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        perror("mkstemp");
+        free(list.items);
+        return -1;
+    }
+    fchmod(fd, 0644);
+    close(fd);
+
+    unsigned char checksum[MAX_HASH_SIZE];
+    size_t delta_count = 0;
+    if (write_pack_file(tmp_path, &list, &delta_count) != 0 ||
+        append_pack_checksum(tmp_path, checksum) != 0) {
+        fprintf(stderr, "Error: Failed to write pack\n");
+        unlink(tmp_path);
+        free(list.items);
+        return -1;
+    }
+
+    char checksum_hex[MAX_HASH_HEX_SIZE + 1];
+    hash_to_hex(checksum, checksum_hex);
+
+    // The index wants the objects back in SHA-1 order
+    qsort(list.items, list.count, sizeof(PackTarget), target_oid_cmp);
+
+    char pack_path[MAX_PATH];
+    char idx_path[MAX_PATH];
+    char tmp_idx_path[MAX_PATH];
+    snprintf(pack_path, sizeof(pack_path), "%s/pack-%s.pack", PACK_DIR, checksum_hex);
+    snprintf(idx_path, sizeof(idx_path), "%s/pack-%s.idx", PACK_DIR, checksum_hex);
+    snprintf(tmp_idx_path, sizeof(tmp_idx_path), "%s/pack-%s.idx.tmp", PACK_DIR, checksum_hex);
+
+    // The index is renamed into place last so readers never see a partial pack
+    if (rename(tmp_path, pack_path) != 0 ||
+        write_index_file(tmp_idx_path, &list, checksum) != 0 ||
+        rename(tmp_idx_path, idx_path) != 0) {
+        fprintf(stderr, "Error: Failed to install pack\n");
+        unlink(tmp_path);
+        unlink(tmp_idx_path);
+        free(list.items);
+        return -1;
+    }
+
+    // Everything is now reachable through the new pack
+    if (all) {
+        for (PackFile *pack = packs; pack; pack = pack->next) {
+            char old_idx[MAX_PATH];
+            snprintf(old_idx, sizeof(old_idx), "%s", pack->name);
+            size_t len = strlen(old_idx);
+            strcpy(old_idx + len - 5, ".idx");
+            if (strcmp(pack->name, pack_path) != 0) {
+                unlink(old_idx);
+                unlink(pack->name);
+            }
+        }
+    }
+    for (size_t i = 0; i < list.count; i++) {
+        if (list.items[i].loose) {
+            remove_loose_object(&list.items[i].oid);
+        }
+    }
+    pack_reload();
+
+    printf("Packed %zu objects (%zu deltas) into pack-%s.pack\n",
+           list.count, delta_count, checksum_hex);
+    free(list.items);
+    return 0;
+}
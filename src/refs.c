@@ -1,7 +1,7 @@
 #include "vcs.h"
 
 // Write reference
-int write_ref(const char *ref_name, const char *sha1) {
+int write_ref(const char *ref_name, const ObjectId *oid) {
     char ref_path[MAX_PATH];
     snprintf(ref_path, sizeof(ref_path), "%s/%s", REFS_HEADS_DIR, ref_name);
 
@@ -20,71 +20,68 @@ int write_ref(const char *ref_name, const char *sha1) {
         return -1;
     }
 
-    fprintf(fp, "%s\n", sha1);
+    fprintf(fp, "%s\n", oid_hex(oid));
     fclose(fp);
     return 0;
 }
 
-// Read reference
-char *read_ref(const char *ref_name) {
-    static char sha1[SHA1_HEX_SIZE + 1];
+// Read reference; returns -1 if it is missing or malformed
+int read_ref(const char *ref_name, ObjectId *oid) {
+    char line[MAX_HASH_HEX_SIZE + 2];
     char ref_path[MAX_PATH];
     snprintf(ref_path, sizeof(ref_path), "%s/%s", REFS_HEADS_DIR, ref_name);
 
     FILE *fp = fopen(ref_path, "r");
     if (!fp) {
-        return NULL;
+        return -1;
     }
 
-    if (fgets(sha1, sizeof(sha1), fp) == NULL) {
+    if (fgets(line, sizeof(line), fp) == NULL) {
         fclose(fp);
-        return NULL;
-    }
-
-    // Remove newline
-    size_t len = strlen(sha1);
-    if (len > 0 && sha1[len - 1] == '\n') {
-        sha1[len - 1] = '\0';
+        return -1;
     }
 
     fclose(fp);
-    return sha1;
+    return hex_to_oid(line, oid);
 }
 
-// Update HEAD
-int update_head(const char *ref_or_sha1) {
+// Point HEAD at a branch
+int update_head(const char *branch_name) {
     FILE *fp = fopen(HEAD_FILE, "w");
     if (!fp) {
         perror("fopen HEAD");
         return -1;
     }
 
-    // Check if it's a branch reference or a direct SHA-1
-    if (strlen(ref_or_sha1) == SHA1_HEX_SIZE) {
-        // Detached HEAD (direct SHA-1)
-        fprintf(fp, "%s\n", ref_or_sha1);
-    } else {
-        // Branch reference
-        fprintf(fp, "ref: refs/heads/%s\n", ref_or_sha1);
+    fprintf(fp, "ref: refs/heads/%s\n", branch_name);
+    fclose(fp);
+    return 0;
+}
+
+// Point HEAD directly at a commit
+int detach_head(const ObjectId *oid) {
+    FILE *fp = fopen(HEAD_FILE, "w");
+    if (!fp) {
+        perror("fopen HEAD");
+        return -1;
     }
 
+    fprintf(fp, "%s\n", oid_hex(oid));
     fclose(fp);
     return 0;
 }
 
-// Get HEAD commit SHA-1
-char *get_head_commit(void) {
-    static char sha1[SHA1_HEX_SIZE + 1];
-    
+// Get HEAD commit; returns -1 when there is none yet
+int get_head_commit(ObjectId *oid) {
     FILE *fp = fopen(HEAD_FILE, "r");
     if (!fp) {
-        return NULL;
+        return -1;
     }
 
     char line[MAX_LINE];
     if (fgets(line, sizeof(line), fp) == NULL) {
         fclose(fp);
-        return NULL;
+        return -1;
     }
     fclose(fp);
 
@@ -100,19 +97,13 @@ char *get_head_commit(void) {
         const char *ref = line + 5;
         const char *branch_name = strrchr(ref, '/');
         if (branch_name) {
-            branch_name++;
-            char *commit_sha1 = read_ref(branch_name);
-            if (commit_sha1) {
-                strcpy(sha1, commit_sha1);
-                return sha1;
-            }
+            return read_ref(branch_name + 1, oid);
         }
-        return NULL;
-    } else {
-        // HEAD is a direct SHA-1 (detached)
-        strcpy(sha1, line);
-        return sha1;
+        return -1;
     }
+
+    // HEAD is a direct object ID (detached)
+    return hex_to_oid(line, oid);
 }
 
 // Check if HEAD is detached
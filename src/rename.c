@@ -0,0 +1,516 @@
+#include "vcs.h"
+
+// A file's sketch keeps the smallest hashes of its distinct lines; two
+// sketches estimate how many lines the files share without reading both
+#define RENAME_SKETCH_SIZE 64
+
+// Sketch values found in more sources than this (common lines such as "}")
+// are not used to suggest candidates
+#define RENAME_MAX_POSTINGS 256
+
+typedef struct {
+    uint64_t hash[RENAME_SKETCH_SIZE];  // ascending
+    size_t count;                       // fewer than the maximum for short files
+    size_t lines;                       // distinct lines in the file
+    size_t size;                        // bytes
+} RenameSketch;
+
+// One sketch value of one source, for finding sources by shared values
+typedef struct {
+    uint64_t value;
+    size_t source;
+} RenamePosting;
+
+// Scored pairing of an added file with a source
+typedef struct {
+    size_t dst;
+    size_t src;
+    int score;
+} RenamePair;
+
+// Source file for a rename (deleted) or copy (modified, or deleted with -C)
+typedef struct {
+    size_t item;        // index in the queue
+    int used;           // already renamed to some destination
+} RenameSource;
+
+// Keep a copy of a change for a pass over all of them; a DiffCallback
+int diff_queue_add(const DiffChange *change, void *data) {
+    DiffQueue *queue = data;
+    if (queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        DiffChange *items = realloc(queue->items, capacity * sizeof(DiffChange));
+        if (!items) {
+            return -1;
+        }
+        queue->items = items;
+        queue->capacity = capacity;
+    }
+    DiffChange *item = &queue->items[queue->count];
+    *item = *change;
+    item->path = strdup(change->path);
+    item->old_path = item->path;
+    if (!item->path) {
+        return -1;
+    }
+    if (change->old_path != change->path && strcmp(change->old_path, change->path) != 0) {
+        item->old_path = strdup(change->old_path);
+        if (!item->old_path) {
+            free((char *)item->path);
+            return -1;
+        }
+    }
+    queue->count++;
+    return 0;
+}
+
+static void diff_queue_free_item(DiffChange *item) {
+    if (item->old_path != item->path) {
+        free((char *)item->old_path);
+    }
+    free((char *)item->path);
+}
+
+void diff_queue_free(DiffQueue *queue) {
+    for (size_t i = 0; i < queue->count; i++) {
+        diff_queue_free_item(&queue->items[i]);
+    }
+    free(queue->items);
+    queue->items = NULL;
+    queue->count = 0;
+    queue->capacity = 0;
+}
+
+static int diff_change_path_cmp(const void *a, const void *b) {
+    return strcmp(((const DiffChange *)a)->path, ((const DiffChange *)b)->path);
+}
+
+// Pass the queued changes to fn in path order
+int diff_queue_flush(DiffQueue *queue, DiffCallback fn, void *data) {
+    if (queue->count > 1) {
+        qsort(queue->items, queue->count, sizeof(DiffChange), diff_change_path_cmp);
+    }
+    for (size_t i = 0; i < queue->count; i++) {
+        int ret = fn(&queue->items[i], data);
+        if (ret != 0) {
+            return ret > 0 ? 0 : -1;
+        }
+    }
+    return 0;
+}
+
+static uint64_t rename_line_hash(const unsigned char *p, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    }
+    // Spread the bits so the smallest values are a fair sample
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static int uint64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Sketch a blob: the RENAME_SKETCH_SIZE smallest hashes of its distinct lines
+static int rename_sketch(const ObjectId *oid, RenameSketch *sketch) {
+    size_t size;
+    ObjectType type;
+    unsigned char *data = read_object(oid, &size, &type);
+    if (!data) {
+        fprintf(stderr, "Error: Failed to read object %s\n", oid_hex(oid));
+        return -1;
+    }
+
+    size_t lines = 0, capacity = 64;
+    uint64_t *hashes = malloc(capacity * sizeof(uint64_t));
+    const unsigned char *p = data, *end = data + size;
+    while (hashes && p < end) {
+        const unsigned char *nl = memchr(p, '\n', end - p);
+        const unsigned char *next = nl ? nl + 1 : end;
+        if (lines == capacity) {
+            capacity *= 2;
+            uint64_t *grown = realloc(hashes, capacity * sizeof(uint64_t));
+            if (!grown) {
+                free(hashes);
+                hashes = NULL;
+                break;
+            }
+            hashes = grown;
+        }
+        hashes[lines++] = rename_line_hash(p, next - p);
+        p = next;
+    }
+    free(data);
+    if (!hashes) {
+        return -1;
+    }
+
+    if (lines > 1) {
+        qsort(hashes, lines, sizeof(uint64_t), uint64_cmp);
+    }
+    sketch->count = 0;
+    sketch->lines = 0;
+    sketch->size = size;
+    for (size_t i = 0; i < lines; i++) {
+        if (i == 0 || hashes[i] != hashes[i - 1]) {
+            if (sketch->count < RENAME_SKETCH_SIZE) {
+                sketch->hash[sketch->count++] = hashes[i];
+            }
+            sketch->lines++;
+        }
+    }
+    free(hashes);
+    return 0;
+}
+
+// Estimated percentage of the larger file's distinct lines that the other
+// file shares. The share of the smallest values of both sketches together
+// that is found in both estimates shared / union (values past the end of a
+// full sketch are unknown for that file); the line counts turn that into
+// shared / max.
+static int rename_similarity(const RenameSketch *a, const RenameSketch *b) {
+    uint64_t limit = UINT64_MAX;
+    if (a->count == RENAME_SKETCH_SIZE) {
+        limit = a->hash[a->count - 1];
+    }
+    if (b->count == RENAME_SKETCH_SIZE && b->hash[b->count - 1] < limit) {
+        limit = b->hash[b->count - 1];
+    }
+
+    size_t i = 0, j = 0, seen = 0, shared = 0;
+    while (seen < RENAME_SKETCH_SIZE && (i < a->count || j < b->count)) {
+        uint64_t value;
+        int both = 0;
+        if (j >= b->count || (i < a->count && a->hash[i] < b->hash[j])) {
+            value = a->hash[i++];
+        } else if (i >= a->count || b->hash[j] < a->hash[i]) {
+            value = b->hash[j++];
+        } else {
+            value = a->hash[i++];
+            j++;
+            both = 1;
+        }
+        if (value > limit) {
+            break;
+        }
+        seen++;
+        shared += both;
+    }
+    if (shared == 0) {
+        return 0;
+    }
+    size_t max = a->lines > b->lines ? a->lines : b->lines;
+    uint64_t score = (uint64_t)shared * (a->lines + b->lines) * 100 / ((seen + shared) * max);
+    return score > 100 ? 100 : (int)score;
+}
+
+static int posting_cmp(const void *a, const void *b) {
+    const RenamePosting *x = a, *y = b;
+    if (x->value != y->value) {
+        return x->value < y->value ? -1 : 1;
+    }
+    return (x->source > y->source) - (x->source < y->source);
+}
+
+static int pair_cmp(const void *a, const void *b) {
+    const RenamePair *x = a, *y = b;
+    if (x->score != y->score) {
+        return y->score - x->score;
+    }
+    if (x->dst != y->dst) {
+        return x->dst < y->dst ? -1 : 1;
+    }
+    return (x->src > y->src) - (x->src < y->src);
+}
+
+// Queue whose items source_cmp orders by; set before sorting
+static const DiffChange *rename_sort_items;
+
+// Order sources by object ID, then path
+static int source_cmp(const void *a, const void *b) {
+    const DiffChange *x = &rename_sort_items[((const RenameSource *)a)->item];
+    const DiffChange *y = &rename_sort_items[((const RenameSource *)b)->item];
+    int cmp = memcmp(x->old_oid.hash, y->old_oid.hash, hash_size());
+    if (cmp != 0) {
+        return cmp;
+    }
+    return strcmp(x->path, y->path);
+}
+
+static const char *rename_basename(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Turn added file dst into a rename or copy of source src
+static int rename_apply(DiffQueue *queue, size_t dst, RenameSource *src, int score, int copies) {
+    DiffChange *item = &queue->items[dst];
+    const DiffChange *from = &queue->items[src->item];
+    int rename = from->status == DIFF_DELETED && !src->used;
+    if (!rename && !copies) {
+        return 0;
+    }
+
+    char *old_path = strdup(from->path);
+    if (!old_path) {
+        return -1;
+    }
+    item->status = rename ? DIFF_RENAMED : DIFF_COPIED;
+    item->old_path = old_path;
+    item->old_oid = from->old_oid;
+    item->old_mode = from->old_mode;
+    item->similarity = score;
+    src->used |= rename;
+    return 1;
+}
+
+// Pair added files with deleted ones (and, with copies, modified ones) whose
+// content matches exactly or closely enough, turning them into renames and
+// copies. Exact matches are found by object ID. The rest are compared
+// through line sketches, scoring at most opts->candidates sources per added
+// file, chosen by the sketch values they share with it.
+int diff_detect_renames(DiffQueue *queue, const RenameOptions *opts) {
+    size_t dst_count = 0, src_count = 0;
+    for (size_t i = 0; i < queue->count; i++) {
+        DiffStatus status = queue->items[i].status;
+        dst_count += status == DIFF_ADDED;
+        src_count += status == DIFF_DELETED || (opts->copies && status == DIFF_MODIFIED);
+    }
+    if (dst_count == 0 || src_count == 0) {
+        return 0;
+    }
+
+    size_t *dsts = malloc(dst_count * sizeof(size_t));
+    RenameSource *srcs = malloc(src_count * sizeof(RenameSource));
+    unsigned char *done = calloc(dst_count, 1);
+    if (!dsts || !srcs || !done) {
+        free(dsts);
+        free(srcs);
+        free(done);
+        return -1;
+    }
+    dst_count = src_count = 0;
+    for (size_t i = 0; i < queue->count; i++) {
+        DiffStatus status = queue->items[i].status;
+        if (status == DIFF_ADDED) {
+            dsts[dst_count++] = i;
+        } else if (status == DIFF_DELETED || (opts->copies && status == DIFF_MODIFIED)) {
+            srcs[src_count].item = i;
+            srcs[src_count++].used = 0;
+        }
+    }
+
+    // Exact matches: binary search the sources sorted by object ID, taking
+    // an unused one with the same file name if there is one
+    rename_sort_items = queue->items;
+    qsort(srcs, src_count, sizeof(RenameSource), source_cmp);
+    int ret = 0;
+    size_t hash_len = hash_size();
+    for (size_t d = 0; d < dst_count && ret >= 0; d++) {
+        const DiffChange *item = &queue->items[dsts[d]];
+        size_t lo = 0, hi = src_count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (memcmp(queue->items[srcs[mid].item].old_oid.hash, item->new_oid.hash,
+                       hash_len) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        RenameSource *best = NULL;
+        int best_rank = -1;
+        for (size_t s = lo; s < src_count; s++) {
+            const DiffChange *from = &queue->items[srcs[s].item];
+            if (!oid_equal(&from->old_oid, &item->new_oid)) {
+                break;
+            }
+            int rank = 0;
+            if (from->status == DIFF_DELETED && !srcs[s].used) {
+                rank = 1 + (strcmp(rename_basename(from->path), rename_basename(item->path)) == 0);
+            }
+            if (rank > best_rank) {
+                best = &srcs[s];
+                best_rank = rank;
+            }
+        }
+
+        if (best) {
+            ret = rename_apply(queue, dsts[d], best, 100, opts->copies);
+            done[d] = ret > 0;
+        }
+    }
+
+    // Inexact matches: sketch what is left and score candidate pairs
+    size_t left_dsts = 0, left_srcs = 0;
+    for (size_t d = 0; d < dst_count; d++) {
+        left_dsts += !done[d];
+    }
+    for (size_t s = 0; s < src_count; s++) {
+        left_srcs += !srcs[s].used;
+    }
+
+    RenameSketch *src_sketches = NULL;
+    RenamePosting *postings = NULL;
+    RenamePair *pairs = NULL;
+    RenamePair *candidates = NULL;
+    size_t *shared = NULL, *touched = NULL;
+    size_t pair_count = 0, pair_capacity = 0, posting_count = 0;
+    if (ret >= 0 && left_dsts > 0 && left_srcs > 0 && opts->candidates > 0) {
+        src_sketches = malloc(src_count * sizeof(RenameSketch));
+        postings = malloc(src_count * RENAME_SKETCH_SIZE * sizeof(RenamePosting));
+        shared = calloc(src_count, sizeof(size_t));
+        touched = malloc(src_count * sizeof(size_t));
+        candidates = malloc(src_count * sizeof(RenamePair));
+        if (!src_sketches || !postings || !shared || !touched || !candidates) {
+            ret = -1;
+        }
+
+        for (size_t s = 0; s < src_count && ret >= 0; s++) {
+            src_sketches[s].count = 0;
+            if (srcs[s].used && !opts->copies) {
+                continue;
+            }
+            if (rename_sketch(&queue->items[srcs[s].item].old_oid, &src_sketches[s]) != 0) {
+                ret = -1;
+                break;
+            }
+            for (size_t k = 0; k < src_sketches[s].count; k++) {
+                postings[posting_count].value = src_sketches[s].hash[k];
+                postings[posting_count++].source = s;
+            }
+        }
+        if (ret >= 0 && posting_count > 1) {
+            qsort(postings, posting_count, sizeof(RenamePosting), posting_cmp);
+        }
+
+        for (size_t d = 0; d < dst_count && ret >= 0; d++) {
+            if (done[d]) {
+                continue;
+            }
+            RenameSketch sketch;
+            if (rename_sketch(&queue->items[dsts[d]].new_oid, &sketch) != 0) {
+                ret = -1;
+                break;
+            }
+            if (sketch.size == 0) {
+                continue;
+            }
+
+            // Count the values each source shares with this file
+            size_t touched_count = 0;
+            for (size_t k = 0; k < sketch.count; k++) {
+                size_t lo = 0, hi = posting_count;
+                while (lo < hi) {
+                    size_t mid = lo + (hi - lo) / 2;
+                    if (postings[mid].value < sketch.hash[k]) {
+                        lo = mid + 1;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                size_t end = lo;
+                while (end < posting_count && postings[end].value == sketch.hash[k]) {
+                    end++;
+                }
+                if (end - lo > RENAME_MAX_POSTINGS) {
+                    continue;
+                }
+                for (size_t p = lo; p < end; p++) {
+                    if (shared[postings[p].source]++ == 0) {
+                        touched[touched_count++] = postings[p].source;
+                    }
+                }
+            }
+
+            // Score the sources sharing the most values
+            for (size_t t = 0; t < touched_count; t++) {
+                candidates[t].dst = d;
+                candidates[t].src = touched[t];
+                candidates[t].score = (int)shared[touched[t]];
+                shared[touched[t]] = 0;
+            }
+            size_t limit = touched_count;
+            if (touched_count > opts->candidates) {
+                qsort(candidates, touched_count, sizeof(RenamePair), pair_cmp);
+                limit = opts->candidates;
+            }
+            for (size_t c = 0; c < limit && ret >= 0; c++) {
+                size_t s = candidates[c].src;
+                const RenameSketch *src = &src_sketches[s];
+                size_t small = src->size < sketch.size ? src->size : sketch.size;
+                size_t large = src->size < sketch.size ? sketch.size : src->size;
+                if (small * 100 < large * (size_t)opts->threshold) {
+                    continue;
+                }
+                int score = rename_similarity(src, &sketch);
+                if (score < opts->threshold) {
+                    continue;
+                }
+                if (pair_count == pair_capacity) {
+                    pair_capacity = pair_capacity ? pair_capacity * 2 : 64;
+                    RenamePair *grown = realloc(pairs, pair_capacity * sizeof(RenamePair));
+                    if (!grown) {
+                        ret = -1;
+                        break;
+                    }
+                    pairs = grown;
+                }
+                pairs[pair_count].dst = d;
+                pairs[pair_count].src = s;
+                pairs[pair_count++].score = score < 100 ? score : 99;
+            }
+        }
+
+        // Best pairs first; each added file takes one source
+        if (ret >= 0 && pair_count > 1) {
+            qsort(pairs, pair_count, sizeof(RenamePair), pair_cmp);
+        }
+        for (size_t p = 0; p < pair_count && ret >= 0; p++) {
+            if (!done[pairs[p].dst]) {
+                ret = rename_apply(queue, dsts[pairs[p].dst], &srcs[pairs[p].src],
+                                   pairs[p].score, opts->copies);
+                done[pairs[p].dst] = ret > 0;
+            }
+        }
+    }
+
+    // Deleted files that were renamed are no longer reported on their own
+    if (ret >= 0) {
+        unsigned char *drop = calloc(queue->count ? queue->count : 1, 1);
+        if (!drop) {
+            ret = -1;
+        } else {
+            for (size_t s = 0; s < src_count; s++) {
+                drop[srcs[s].item] = srcs[s].used;
+            }
+            size_t n = 0;
+            for (size_t i = 0; i < queue->count; i++) {
+                if (drop[i]) {
+                    diff_queue_free_item(&queue->items[i]);
+                } else {
+                    queue->items[n++] = queue->items[i];
+                }
+            }
+            queue->count = n;
+            free(drop);
+        }
+    }
+
+    free(src_sketches);
+    free(postings);
+    free(pairs);
+    free(shared);
+    free(touched);
+    free(candidates);
+    free(dsts);
+    free(srcs);
+    free(done);
+    return ret < 0 ? -1 : 0;
+}
@@ -1,7 +1,7 @@
 #include "vcs.h"
 
-// Initialize VCS repository
-int vcs_init(void) {
+// Initialize VCS repository with the given object hash algorithm
+int vcs_init(HashAlgo algo) {
     if (dir_exists(VCS_DIR)) {
         fprintf(stderr, "Error: Repository already initialized\n");
         return -1;
@@ -10,6 +10,7 @@ int vcs_init(void) {
     // Create directory structure
     if (create_dir(VCS_DIR) != 0 ||
         create_dir(OBJECTS_DIR) != 0 ||
+        create_dir(PACK_DIR) != 0 ||
         create_dir(REFS_DIR) != 0 ||
         create_dir(REFS_HEADS_DIR) != 0) {
         fprintf(stderr, "Error: Failed to create repository structure\n");
@@ -40,8 +41,13 @@ int vcs_init(void) {
         return -1;
     }
     fprintf(fp, "[core]\n");
-    fprintf(fp, "\trepositoryformatversion = 0\n");
+    fprintf(fp, "\trepositoryformatversion = %d\n", algo == HASH_SHA1 ? 0 : 1);
     fprintf(fp, "\tfilemode = true\n");
+    if (algo != HASH_SHA1) {
+        // Older versions must not misread the object IDs
+        fprintf(fp, "[extensions]\n");
+        fprintf(fp, "\tobjectFormat = %s\n", hash_algo_name(algo));
+    }
     fclose(fp);
 
     printf("Initialized empty VCS repository in %s/%s/\n", getcwd(NULL, 0), VCS_DIR);
@@ -0,0 +1,334 @@
+#include "vcs.h"
+
+// Directory of the sparse checkout trie, one per path component. A listed
+// directory includes everything below it; the directories leading to it
+// only include the files directly inside them.
+typedef struct SparseNode {
+    char *name;
+    size_t name_len;
+    int recursive;
+    struct SparseNode *children;    // sorted by name
+    size_t child_count;
+    size_t child_capacity;
+} SparseNode;
+
+// Cone-mode patterns: the root node stands for the top-level directory,
+// whose files are always included
+struct SparsePatterns {
+    SparseNode root;
+    char **dirs;                    // as listed, for writing back
+    size_t dir_count;
+};
+
+static int sparse_name_cmp(const SparseNode *node, const char *name, size_t len) {
+    size_t n = node->name_len < len ? node->name_len : len;
+    int cmp = memcmp(node->name, name, n);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return node->name_len < len ? -1 : node->name_len > len;
+}
+
+// Binary search a node's children; *pos is where name is or would go
+static SparseNode *sparse_child(const SparseNode *node, const char *name, size_t len,
+                                size_t *pos) {
+    size_t lo = 0, hi = node->child_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = sparse_name_cmp(&node->children[mid], name, len);
+        if (cmp == 0) {
+            *pos = mid;
+            return &node->children[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo;
+    return NULL;
+}
+
+static void sparse_node_free(SparseNode *node) {
+    for (size_t i = 0; i < node->child_count; i++) {
+        sparse_node_free(&node->children[i]);
+    }
+    free(node->children);
+    free(node->name);
+}
+
+// Add a directory (no leading or trailing slash) to the trie
+static int sparse_insert(SparsePatterns *sparse, const char *dir) {
+    SparseNode *node = &sparse->root;
+    const char *p = dir;
+    while (!node->recursive) {
+        const char *slash = strchr(p, '/');
+        size_t len = slash ? (size_t)(slash - p) : strlen(p);
+        size_t pos;
+        SparseNode *child = sparse_child(node, p, len, &pos);
+        if (!child) {
+            if (node->child_count == node->child_capacity) {
+                size_t capacity = node->child_capacity ? node->child_capacity * 2 : 4;
+                SparseNode *children = realloc(node->children, capacity * sizeof(SparseNode));
+                if (!children) {
+                    return -1;
+                }
+                node->children = children;
+                node->child_capacity = capacity;
+            }
+            child = &node->children[pos];
+            memmove(child + 1, child, (node->child_count - pos) * sizeof(SparseNode));
+            memset(child, 0, sizeof(SparseNode));
+            node->child_count++;
+            if (!(child->name = malloc(len + 1))) {
+                memmove(child, child + 1, (--node->child_count - pos) * sizeof(SparseNode));
+                return -1;
+            }
+            memcpy(child->name, p, len);
+            child->name[len] = '\0';
+            child->name_len = len;
+        }
+        node = child;
+        if (!slash) {
+            // Everything below is included now, so the subtree is not needed
+            for (size_t i = 0; i < node->child_count; i++) {
+                sparse_node_free(&node->children[i]);
+            }
+            node->child_count = 0;
+            node->recursive = 1;
+            break;
+        }
+        p = slash + 1;
+    }
+    return 0;
+}
+
+// Normalize a listed directory in place: no leading, trailing or doubled
+// slashes. Returns -1 for names that cannot be directories in a tree.
+static int sparse_clean_dir(char *dir) {
+    char *out = dir;
+    const char *p = dir;
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        const char *end = p;
+        while (*end && *end != '/') {
+            end++;
+        }
+        size_t len = end - p;
+        if (len == 0) {
+            break;
+        }
+        if ((len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.') ||
+            (len == strlen(VCS_DIR) && memcmp(p, VCS_DIR, len) == 0)) {
+            return -1;
+        }
+        if (out != dir) {
+            *out++ = '/';
+        }
+        memmove(out, p, len);
+        out += len;
+        p = end;
+    }
+    *out = '\0';
+    return out == dir ? -1 : 0;
+}
+
+void sparse_free(SparsePatterns *sparse) {
+    if (!sparse) {
+        return;
+    }
+    sparse_node_free(&sparse->root);
+    for (size_t i = 0; i < sparse->dir_count; i++) {
+        free(sparse->dirs[i]);
+    }
+    free(sparse->dirs);
+    free(sparse);
+}
+
+// Build patterns from a list of directories
+static SparsePatterns *sparse_new(const char *const *dirs, size_t count) {
+    SparsePatterns *sparse = calloc(1, sizeof(SparsePatterns));
+    if (!sparse || !(sparse->dirs = calloc(count ? count : 1, sizeof(char *)))) {
+        free(sparse);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        char *dir = strdup(dirs[i]);
+        if (!dir) {
+            sparse_free(sparse);
+            return NULL;
+        }
+        if (sparse_clean_dir(dir) != 0) {
+            fprintf(stderr, "Error: Invalid sparse checkout directory '%s'\n", dirs[i]);
+            free(dir);
+            sparse_free(sparse);
+            return NULL;
+        }
+        sparse->dirs[sparse->dir_count++] = dir;
+        if (sparse_insert(sparse, dir) != 0) {
+            sparse_free(sparse);
+            return NULL;
+        }
+    }
+    return sparse;
+}
+
+// Load the sparse checkout directories from SPARSE_FILE, one per line.
+// *out is NULL when the file does not exist and every path is checked out.
+int sparse_load(SparsePatterns **out) {
+    *out = NULL;
+    FILE *fp = fopen(SPARSE_FILE, "r");
+    if (!fp) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    char line[MAX_PATH];
+    char **dirs = NULL;
+    size_t count = 0, capacity = 0;
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            char **grown = realloc(dirs, capacity * sizeof(char *));
+            if (!grown) {
+                ret = -1;
+                break;
+            }
+            dirs = grown;
+        }
+        if (!(dirs[count] = strdup(line))) {
+            ret = -1;
+            break;
+        }
+        count++;
+    }
+    fclose(fp);
+
+    if (ret == 0 && !(*out = sparse_new((const char *const *)dirs, count))) {
+        ret = -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(dirs[i]);
+    }
+    free(dirs);
+    return ret;
+}
+
+// Whether a tracked path is in the sparse checkout: files at the top level
+// and directly inside a listed directory's parents, and everything below a
+// listed directory
+int sparse_includes(const SparsePatterns *sparse, const char *path) {
+    if (!sparse) {
+        return 1;
+    }
+    const SparseNode *node = &sparse->root;
+    for (const char *p = path;;) {
+        const char *slash = strchr(p, '/');
+        if (!slash) {
+            return 1;
+        }
+        size_t pos;
+        if (!(node = sparse_child(node, p, slash - p, &pos))) {
+            return 0;
+        }
+        if (node->recursive) {
+            return 1;
+        }
+        p = slash + 1;
+    }
+}
+
+static int sparse_save(const SparsePatterns *sparse) {
+    if (create_dir_recursive(VCS_DIR "/info") != 0) {
+        return -1;
+    }
+    FILE *fp = fopen(SPARSE_FILE ".tmp", "w");
+    if (!fp) {
+        fprintf(stderr, "Error: Cannot write %s\n", SPARSE_FILE);
+        return -1;
+    }
+    for (size_t i = 0; i < sparse->dir_count; i++) {
+        fprintf(fp, "%s\n", sparse->dirs[i]);
+    }
+    if (fclose(fp) != 0 || rename(SPARSE_FILE ".tmp", SPARSE_FILE) != 0) {
+        fprintf(stderr, "Error: Cannot write %s\n", SPARSE_FILE);
+        unlink(SPARSE_FILE ".tmp");
+        return -1;
+    }
+    return 0;
+}
+
+// Restrict the working tree to the top-level files and the given
+// directories (added to the current ones when add is set)
+int sparse_checkout_set(const char *const *dirs, size_t count, int add) {
+    SparsePatterns *current = NULL;
+    if (add && sparse_load(&current) != 0) {
+        fprintf(stderr, "Error: Cannot read %s\n", SPARSE_FILE);
+        return -1;
+    }
+
+    size_t total = (current ? current->dir_count : 0) + count;
+    const char **all = calloc(total ? total : 1, sizeof(char *));
+    if (!all) {
+        sparse_free(current);
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; current && i < current->dir_count; i++) {
+        all[n++] = current->dirs[i];
+    }
+    for (size_t i = 0; i < count; i++) {
+        all[n++] = dirs[i];
+    }
+    SparsePatterns *sparse = sparse_new(all, n);
+    free(all);
+    sparse_free(current);
+    if (!sparse) {
+        return -1;
+    }
+
+    // Update the working tree first; if that is refused, the patterns stay
+    int ret = checkout_sparse(sparse);
+    if (ret == 0) {
+        ret = sparse_save(sparse);
+    }
+    sparse_free(sparse);
+    return ret;
+}
+
+// Check out every path again and forget the patterns
+int sparse_checkout_disable(void) {
+    if (checkout_sparse(NULL) != 0) {
+        return -1;
+    }
+    if (unlink(SPARSE_FILE) != 0 && errno != ENOENT) {
+        fprintf(stderr, "Error: Cannot remove %s\n", SPARSE_FILE);
+        return -1;
+    }
+    return 0;
+}
+
+// Print the sparse checkout directories
+int sparse_checkout_list(void) {
+    SparsePatterns *sparse;
+    if (sparse_load(&sparse) != 0) {
+        fprintf(stderr, "Error: Cannot read %s\n", SPARSE_FILE);
+        return -1;
+    }
+    if (!sparse) {
+        fprintf(stderr, "Error: Sparse checkout is not enabled\n");
+        return -1;
+    }
+    for (size_t i = 0; i < sparse->dir_count; i++) {
+        printf("%s\n", sparse->dirs[i]);
+    }
+    sparse_free(sparse);
+    return 0;
+}
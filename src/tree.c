@@ -1,4 +1,5 @@
 #include "vcs.h"
+#include <stddef.h>
 
 // Create new tree
 Tree *tree_new(void) {
@@ -25,8 +26,8 @@ void tree_free(Tree *tree) {
 }
 
 // Add entry to tree
-int tree_add_entry(Tree *tree, const char *mode, const char *type, 
-                   const char *sha1, const char *name) {
+int tree_add_entry(Tree *tree, const char *mode, const char *type,
+                   const ObjectId *oid, const char *name) {
     if (tree->count >= tree->capacity) {
         tree->capacity *= 2;
         TreeEntry *new_entries = realloc(tree->entries,
@@ -42,44 +43,340 @@ int tree_add_entry(Tree *tree, const char *mode, const char *type,
     entry->mode[sizeof(entry->mode) - 1] = '\0';
     strncpy(entry->type, type, sizeof(entry->type) - 1);
     entry->type[sizeof(entry->type) - 1] = '\0';
-    strncpy(entry->sha1, sha1, SHA1_HEX_SIZE);
-    entry->sha1[SHA1_HEX_SIZE] = '\0';
+    entry->oid = *oid;
     strncpy(entry->name, name, sizeof(entry->name) - 1);
     entry->name[sizeof(entry->name) - 1] = '\0';
 
     return 0;
 }
 
-// Compare function for sorting tree entries
-static int tree_entry_cmp(const void *a, const void *b) {
-    const TreeEntry *ea = (const TreeEntry *)a;
-    const TreeEntry *eb = (const TreeEntry *)b;
-    return strcmp(ea->name, eb->name);
+// Cache-tree records, stored depth first in the TREE index extension. A
+// directory's record is followed by its name and then by the records of
+// its subdirectories in tree order; the root's name is empty. Staging a
+// path marks the records along it invalid, so the next write_index_tree
+// only hashes the trees of directories that changed.
+typedef struct {
+    int32_t entry_count;    // index entries below the directory, -1 if invalid
+    uint32_t subtree_count;
+    uint32_t name_len;
+    uint32_t size;          // bytes of the subdirectory records that follow
+    ObjectId oid;
+} CacheTreeRecord;
+
+// Growable buffer for the records of a new cache-tree
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+} CacheTreeBuffer;
+
+// State for writing the trees of an index
+typedef struct {
+    Index *idx;
+    CacheTreeBuffer *cache;     // new cache-tree, or NULL when not kept
+} TreeBuild;
+
+// Parse the record at data into rec; returns its total length (header,
+// name and subdirectory records), or 0 if it overruns size bytes
+static size_t cache_tree_record(const unsigned char *data, size_t size, CacheTreeRecord *rec) {
+    if (size < sizeof(*rec)) {
+        return 0;
+    }
+    memcpy(rec, data, sizeof(*rec));
+    if (rec->name_len > size || rec->size > size ||
+        sizeof(*rec) + (size_t)rec->name_len + rec->size > size) {
+        return 0;
+    }
+    return sizeof(*rec) + rec->name_len + rec->size;
 }
 
-// Build tree from index
-int tree_from_index(Index *idx, Tree *tree) {
-    tree->count = 0;
+// Find the record of subdirectory name among the records from *pos up to
+// end. Records are in tree order, so a hit moves *pos past it.
+static const unsigned char *cache_tree_find(const unsigned char **pos, const unsigned char *end,
+                                            const char *name, size_t name_len,
+                                            CacheTreeRecord *rec) {
+    const unsigned char *p = *pos;
+    while (p < end) {
+        size_t len = cache_tree_record(p, end - p, rec);
+        if (len == 0) {
+            return NULL;
+        }
+        if (rec->name_len == name_len && memcmp(p + sizeof(*rec), name, name_len) == 0) {
+            *pos = p + len;
+            return p;
+        }
+        p += len;
+    }
+    return NULL;
+}
 
-    for (size_t i = 0; i < idx->count; i++) {
-        IndexEntry *entry = &idx->entries[i];
-        if (tree_add_entry(tree, "100644", "blob", entry->sha1, entry->path) != 0) {
+static int cache_tree_append(CacheTreeBuffer *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 4096;
+        while (capacity < buf->len + len) {
+            capacity *= 2;
+        }
+        unsigned char *grown = realloc(buf->data, capacity);
+        if (!grown) {
             return -1;
         }
+        buf->data = grown;
+        buf->capacity = capacity;
     }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+// Mark the cached trees of the root and of every directory above path
+// invalid. The records are edited in place; their entry counts and object
+// IDs are only recomputed by the next write_index_tree.
+void cache_tree_invalidate(Index *idx, const char *path) {
+    size_t size;
+    if (!index_extension(idx, INDEX_EXT_CACHE_TREE, &size)) {
+        return;
+    }
+    unsigned char *data = index_edit_extension(idx, INDEX_EXT_CACHE_TREE, &size);
+    CacheTreeRecord rec;
+    if (!data || cache_tree_record(data, size, &rec) == 0) {
+        index_drop_extension(idx, INDEX_EXT_CACHE_TREE);
+        return;
+    }
+
+    unsigned char *record = data;
+    for (;;) {
+        int32_t invalid = -1;
+        memcpy(record + offsetof(CacheTreeRecord, entry_count), &invalid, sizeof(invalid));
 
-    // Sort entries
-    qsort(tree->entries, tree->count, sizeof(TreeEntry), tree_entry_cmp);
+        const char *slash = strchr(path, '/');
+        if (!slash) {
+            return;
+        }
+        const unsigned char *children = record + sizeof(rec) + rec.name_len;
+        const unsigned char *child = cache_tree_find(&children, children + rec.size, path,
+                                                     (size_t)(slash - path), &rec);
+        if (!child) {
+            return;
+        }
+        record = data + (child - data);
+        path = slash + 1;
+    }
+}
+
+// Blob mode for an index entry: executable if the file was when staged
+static const char *tree_blob_mode(const IndexEntry *entry) {
+    return (entry->mode & 0111) ? "100755" : "100644";
+}
+
+// Cached tree ID and entry count of directory dir (dir_len bytes, without
+// the trailing '/'; empty for the root). Returns 1 if the directory has a
+// valid record, 0 if it has none or it was invalidated.
+int cache_tree_lookup(Index *idx, const char *dir, size_t dir_len, ObjectId *oid_out,
+                      size_t *count_out) {
+    size_t size;
+    const unsigned char *data = index_extension(idx, INDEX_EXT_CACHE_TREE, &size);
+    CacheTreeRecord rec;
+    if (!data || cache_tree_record(data, size, &rec) == 0) {
+        return 0;
+    }
+
+    const char *end = dir + dir_len;
+    const unsigned char *record = data;
+    while (dir < end) {
+        const char *slash = memchr(dir, '/', end - dir);
+        size_t name_len = slash ? (size_t)(slash - dir) : (size_t)(end - dir);
+        const unsigned char *children = record + sizeof(rec) + rec.name_len;
+        record = cache_tree_find(&children, children + rec.size, dir, name_len, &rec);
+        if (!record) {
+            return 0;
+        }
+        dir += name_len + (slash ? 1 : 0);
+    }
+
+    if (rec.entry_count < 0) {
+        return 0;
+    }
+    *oid_out = rec.oid;
+    *count_out = (size_t)rec.entry_count;
+    return 1;
+}
+
+// Whether a valid cached record for the directory whose first entry is i
+// still spans a whole directory of entries [i, end)
+static int tree_cache_usable(Index *idx, const CacheTreeRecord *rec, size_t i, size_t end,
+                             const char *dir, size_t dir_len) {
+    if (rec->entry_count <= 0 || (size_t)rec->entry_count > end - i) {
+        return 0;
+    }
+    size_t last = i + (size_t)rec->entry_count - 1;
+    if (idx->entries[last].path_len <= dir_len ||
+        memcmp(index_path(idx, &idx->entries[last]), dir, dir_len) != 0) {
+        return 0;
+    }
+    return last + 1 == end || idx->entries[last + 1].path_len <= dir_len ||
+           memcmp(index_path(idx, &idx->entries[last + 1]), dir, dir_len) != 0;
+}
+
+static int tree_write_dir(TreeBuild *b, size_t start, size_t end, size_t prefix_len,
+                          const char *name, size_t name_len,
+                          const unsigned char *cached, size_t cached_size, ObjectId *oid_out);
+
+// Fill tree with index entries [start, end), whose paths all begin with the
+// prefix_len bytes of their directory (including the trailing '/'). Each
+// subdirectory is built and written as a tree of its own, unless cached
+// (the directory's subdirectory records, cached_size bytes) holds a valid
+// record for it. Index order is tree order: a directory sorts as its name
+// followed by '/'.
+static int tree_build(TreeBuild *b, size_t start, size_t end, size_t prefix_len,
+                      const unsigned char *cached, size_t cached_size, Tree *tree) {
+    Index *idx = b->idx;
+    const unsigned char *cursor = cached;
+    const unsigned char *cached_end = cached ? cached + cached_size : NULL;
+    size_t i = start;
+    while (i < end) {
+        const char *path = index_path(idx, &idx->entries[i]);
+        const char *name = path + prefix_len;
+        const char *slash = strchr(name, '/');
+        size_t name_len = slash ? (size_t)(slash - name) : strlen(name);
+        if (name_len == 0 || name_len >= sizeof(tree->entries[0].name)) {
+            fprintf(stderr, "Error: Invalid path '%s' in index\n", path);
+            return -1;
+        }
+        if (!slash) {
+            if (tree_add_entry(tree, tree_blob_mode(&idx->entries[i]), "blob",
+                               &idx->entries[i].oid, name) != 0) {
+                return -1;
+            }
+            i++;
+            continue;
+        }
+
+        // A file of the same name sorts before the directory, but siblings
+        // such as "a-b" can sort between them, so look it up by name
+        char file_path[MAX_PATH];
+        snprintf(file_path, sizeof(file_path), "%.*s", (int)(prefix_len + name_len), path);
+        if (index_find_entry(idx, file_path)) {
+            fprintf(stderr, "Error: '%s' is both a file and a directory in the index\n",
+                    file_path);
+            return -1;
+        }
+
+        size_t dir_len = prefix_len + name_len + 1;
+        CacheTreeRecord rec;
+        const unsigned char *record = cached ?
+            cache_tree_find(&cursor, cached_end, name, name_len, &rec) : NULL;
+        size_t j;
+        ObjectId oid;
+        if (record && tree_cache_usable(idx, &rec, i, end, path, dir_len)) {
+            // Unchanged since it was last written: take its tree as is
+            j = i + (size_t)rec.entry_count;
+            oid = rec.oid;
+            if (b->cache && cache_tree_append(b->cache, record, sizeof(rec) + rec.name_len +
+                                              rec.size) != 0) {
+                return -1;
+            }
+        } else {
+            // Entries below this directory are contiguous in the sorted index
+            j = i + 1;
+            while (j < end && idx->entries[j].path_len > dir_len &&
+                   memcmp(index_path(idx, &idx->entries[j]), path, dir_len) == 0) {
+                j++;
+            }
+            const unsigned char *children = record ? record + sizeof(rec) + rec.name_len : NULL;
+            if (tree_write_dir(b, i, j, dir_len, name, name_len, children,
+                               record ? rec.size : 0, &oid) != 0) {
+                return -1;
+            }
+        }
+
+        char dir_name[sizeof(tree->entries[0].name)];
+        memcpy(dir_name, name, name_len);
+        dir_name[name_len] = '\0';
+        if (tree_add_entry(tree, "40000", "tree", &oid, dir_name) != 0) {
+            return -1;
+        }
+        i = j;
+    }
     return 0;
 }
 
+// Build and write the tree of one directory, appending its record (and
+// those of its subdirectories) to the new cache-tree
+static int tree_write_dir(TreeBuild *b, size_t start, size_t end, size_t prefix_len,
+                          const char *name, size_t name_len,
+                          const unsigned char *cached, size_t cached_size, ObjectId *oid_out) {
+    CacheTreeRecord rec = {0};
+    size_t offset = 0;
+    if (b->cache) {
+        offset = b->cache->len;
+        if (cache_tree_append(b->cache, &rec, sizeof(rec)) != 0 ||
+            cache_tree_append(b->cache, name, name_len) != 0) {
+            return -1;
+        }
+    }
+
+    Tree *tree = tree_new();
+    int ret = tree ? tree_build(b, start, end, prefix_len, cached, cached_size, tree) : -1;
+    if (ret == 0) {
+        ret = write_tree(tree, oid_out);
+    }
+    if (ret == 0 && b->cache) {
+        rec.entry_count = (int32_t)(end - start);
+        for (size_t i = 0; i < tree->count; i++) {
+            rec.subtree_count += strcmp(tree->entries[i].type, "tree") == 0;
+        }
+        rec.name_len = (uint32_t)name_len;
+        rec.size = (uint32_t)(b->cache->len - offset - sizeof(rec) - name_len);
+        rec.oid = *oid_out;
+        memcpy(b->cache->data + offset, &rec, sizeof(rec));
+    }
+    tree_free(tree);
+    return ret;
+}
+
+// Build the root tree from the index, writing a tree object for every
+// directory below it. Trees of unchanged directories hash to their existing
+// objects, so only the trees along changed paths are stored.
+int tree_from_index(Index *idx, Tree *tree) {
+    TreeBuild b = {idx, NULL};
+    tree->count = 0;
+    return tree_build(&b, 0, idx->count, 0, NULL, 0, tree);
+}
+
+// Write the root tree of the index, reusing the cache-tree for directories
+// nothing was staged under since the last call and storing the refreshed
+// cache back in the index. Returns 1 if the cache changed (so the index is
+// worth saving), 0 if the whole tree was cached, -1 on error.
+int write_index_tree(Index *idx, ObjectId *oid_out) {
+    size_t size = 0;
+    const unsigned char *data = index_extension(idx, INDEX_EXT_CACHE_TREE, &size);
+    CacheTreeRecord rec;
+    size_t len = data ? cache_tree_record(data, size, &rec) : 0;
+    if (len > 0 && rec.entry_count >= 0 && (size_t)rec.entry_count == idx->count) {
+        *oid_out = rec.oid;
+        return 0;
+    }
+
+    CacheTreeBuffer cache = {0};
+    TreeBuild b = {idx, &cache};
+    int ret = tree_write_dir(&b, 0, idx->count, 0, "", 0,
+                             len > 0 ? data + sizeof(rec) + rec.name_len : NULL,
+                             len > 0 ? rec.size : 0, oid_out);
+    if (ret == 0) {
+        ret = index_set_extension(idx, INDEX_EXT_CACHE_TREE, cache.data, cache.len) == 0 ? 1 : -1;
+    }
+    free(cache.data);
+    return ret;
+}
+
 // Write tree object
-int write_tree(Tree *tree, char *sha1_out) {
+int write_tree(Tree *tree, ObjectId *oid_out) {
     // Calculate total size
+    size_t hash_len = hash_size();
     size_t total_size = 0;
     for (size_t i = 0; i < tree->count; i++) {
         TreeEntry *entry = &tree->entries[i];
-        total_size += strlen(entry->mode) + 1 + strlen(entry->name) + 1 + SHA1_SIZE;
+        total_size += strlen(entry->mode) + 1 + strlen(entry->name) + 1 + hash_len;
     }
 
     // Build tree data
@@ -94,22 +391,69 @@ int write_tree(Tree *tree, char *sha1_out) {
         int len = sprintf((char *)ptr, "%s %s", entry->mode, entry->name);
         ptr += len + 1;
 
-        unsigned char sha1[SHA1_SIZE];
-        hex_to_sha1(entry->sha1, sha1);
-        memcpy(ptr, sha1, SHA1_SIZE);
-        ptr += SHA1_SIZE;
+        memcpy(ptr, entry->oid.hash, hash_len);
+        ptr += hash_len;
     }
 
-    int ret = write_object(data, total_size, OBJ_TREE, sha1_out);
+    int ret = write_object(data, total_size, OBJ_TREE, oid_out);
     free(data);
     return ret;
 }
 
-// Read tree object
-Tree *read_tree(const char *sha1) {
+// Start iterating over the entries of a tree object's data
+void tree_iter_init(TreeIter *it, const void *data, size_t size) {
+    it->pos = data;
+    it->end = it->pos + size;
+    it->name = NULL;
+    it->name_len = 0;
+    it->mode = 0;
+    it->hash = NULL;
+}
+
+// Advance to the next entry: "<octal mode> <name>\0<binary hash>". Returns 1
+// for an entry, 0 at the end of the tree, -1 if the data is malformed.
+int tree_iter_next(TreeIter *it) {
+    if (it->pos >= it->end) {
+        return 0;
+    }
+
+    const unsigned char *p = it->pos;
+    uint32_t mode = 0;
+    int digits = 0;
+    while (p < it->end && *p >= '0' && *p <= '7' && digits < 7) {
+        mode = (mode << 3) | (uint32_t)(*p++ - '0');
+        digits++;
+    }
+    if (digits == 0 || p >= it->end || *p != ' ') {
+        return -1;
+    }
+    p++;
+
+    const unsigned char *nul = memchr(p, '\0', it->end - p);
+    size_t hash_len = hash_size();
+    if (!nul || nul == p || (size_t)(it->end - nul - 1) < hash_len) {
+        return -1;
+    }
+
+    it->mode = mode;
+    it->name = (const char *)p;
+    it->name_len = nul - p;
+    it->hash = nul + 1;
+    it->pos = it->hash + hash_len;
+    return 1;
+}
+
+// Copy the current entry's object ID out of the tree data
+void tree_iter_oid(const TreeIter *it, ObjectId *oid_out) {
+    oid_clear(oid_out);
+    memcpy(oid_out->hash, it->hash, hash_size());
+}
+
+// Read tree object into a Tree; entries keep the mode as stored
+Tree *read_tree(const ObjectId *oid) {
     size_t size;
     ObjectType type;
-    unsigned char *data = read_object(sha1, &size, &type);
+    unsigned char *data = read_object(oid, &size, &type);
 
     if (!data || type != OBJ_TREE) {
         free(data);
@@ -122,50 +466,31 @@ Tree *read_tree(const char *sha1) {
         return NULL;
     }
 
-    unsigned char *ptr = data;
-    unsigned char *end = data + size;
-
-    while (ptr < end) {
-        TreeEntry entry;
-        
-        // Parse mode
-        char *space = strchr((char *)ptr, ' ');
-        if (!space) break;
-        *space = '\0';
-        strncpy(entry.mode, (char *)ptr, sizeof(entry.mode) - 1);
-        entry.mode[sizeof(entry.mode) - 1] = '\0';
-        ptr = (unsigned char *)(space + 1);
-
-        // Parse name
-        char *null = strchr((char *)ptr, '\0');
-        if (!null) break;
-        strncpy(entry.name, (char *)ptr, sizeof(entry.name) - 1);
-        entry.name[sizeof(entry.name) - 1] = '\0';
-        ptr = (unsigned char *)(null + 1);
-
-        // Parse SHA-1
-        if (ptr + SHA1_SIZE > end) break;
-        sha1_to_hex(ptr, entry.sha1);
-        ptr += SHA1_SIZE;
-
-        // Determine type (blob for files)
-        strcpy(entry.type, "blob");
-
-        if (tree->count >= tree->capacity) {
-            tree->capacity *= 2;
-            TreeEntry *new_entries = realloc(tree->entries,
-                                             sizeof(TreeEntry) * tree->capacity);
-            if (!new_entries) {
-                tree_free(tree);
-                free(data);
-                return NULL;
-            }
-            tree->entries = new_entries;
+    TreeIter it;
+    int ret;
+    tree_iter_init(&it, data, size);
+    while ((ret = tree_iter_next(&it)) > 0) {
+        if (it.name_len >= sizeof(tree->entries[0].name)) {
+            fprintf(stderr, "Error: Tree entry name too long in %s\n", oid_hex(oid));
+            ret = -1;
+            break;
         }
 
-        tree->entries[tree->count++] = entry;
+        char mode[10];
+        snprintf(mode, sizeof(mode), "%o", (unsigned)it.mode);
+        ObjectId entry_oid;
+        tree_iter_oid(&it, &entry_oid);
+        if (tree_add_entry(tree, mode, S_ISDIR(it.mode) ? "tree" : "blob", &entry_oid,
+                           it.name) != 0) {
+            ret = -1;
+            break;
+        }
     }
 
     free(data);
+    if (ret < 0) {
+        tree_free(tree);
+        return NULL;
+    }
     return tree;
 }
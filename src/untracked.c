@@ -0,0 +1,567 @@
+#include "vcs.h"
+#include <fcntl.h>
+
+// Untracked cache, stored in the index as the UNTR extension. For every
+// directory not ignored it records the directory's stat data, the stat data
+// of its .nitignore and the names of its untracked files. A directory whose
+// stat data still matches, and was not modified in the second the cache was
+// built, cannot have gained or lost entries, so its names are reused without
+// reading it. A changed .nitignore (or exclude file) rescans everything
+// below it, since its rules apply to the whole subtree. The untracked names
+// depend on which paths are tracked, so the index drops the cache whenever
+// paths are added or removed.
+//
+// Extension layout, in host byte order like the rest of the index:
+//   header      UntrackedHeader
+//   root        directory record, then its subdirectories depth first
+// Directory record: UntrackedRecord, name, then file_count names each as a
+// u32 length followed by the bytes.
+
+#define UNTRACKED_VERSION 1
+#define UNTRACKED_DEPTH_MAX (MAX_PATH / 2)
+
+// Stat data that changes whenever a directory gains or loses entries, or a
+// file is rewritten
+typedef struct {
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t size;
+    uint64_t ino;
+    uint64_t dev;
+} UntrackedStat;
+
+typedef struct {
+    uint32_t version;
+    uint32_t reserved;
+    int64_t built;              // when the cache was written
+    UntrackedStat exclude;      // .vcs/info/exclude; zero if missing
+} UntrackedHeader;
+
+typedef struct {
+    uint32_t name_len;
+    uint32_t file_count;
+    uint32_t dir_count;
+    uint32_t reserved;
+    UntrackedStat st;
+    UntrackedStat ignore;       // the directory's .nitignore; zero if missing
+} UntrackedRecord;
+
+typedef struct UntrackedDir UntrackedDir;
+
+struct UntrackedDir {
+    char *name;                 // "" for the root
+    UntrackedStat st;
+    UntrackedStat ignore;
+    char **files;               // untracked files, sorted
+    size_t file_count;
+    UntrackedDir *dirs;         // subdirectories not ignored, sorted by name
+    size_t dir_count;
+};
+
+// Ignore rules of one directory on the current path, read only when a
+// directory below it has to be scanned
+typedef struct UntrackedRules UntrackedRules;
+
+struct UntrackedRules {
+    UntrackedRules *parent;
+    const char *path;
+    int loaded;
+    IgnoreList *own;
+    const IgnoreList *list;     // rules in effect, own or inherited
+};
+
+typedef struct {
+    Index *idx;
+    int root_fd;
+    int64_t built;              // build time of the cache being reused
+    IgnoreList *exclude;
+    int exclude_loaded;
+    int changed;
+    char **paths;               // untracked files found
+    size_t count;
+    size_t capacity;
+} UntrackedScan;
+
+// Growable buffer for the serialized cache
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+    int error;
+} UntrackedBuffer;
+
+static void untracked_stat_set(UntrackedStat *ust, const struct stat *st) {
+    ust->mtime = st->st_mtime;
+    ust->ctime = st->st_ctime;
+    ust->size = st->st_size;
+    ust->ino = st->st_ino;
+    ust->dev = st->st_dev;
+}
+
+// Stat data of a regular file relative to the root; zero if it is missing
+static void untracked_stat_file(int root_fd, const char *path, UntrackedStat *ust) {
+    struct stat st;
+    memset(ust, 0, sizeof(*ust));
+    if (fstatat(root_fd, path, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+        untracked_stat_set(ust, &st);
+    }
+}
+
+// Whether recorded stat data proves nothing changed. Like racily clean index
+// entries, anything modified in the second the cache was built may have
+// changed again without its stat data changing.
+static int untracked_stat_clean(const UntrackedScan *scan, const UntrackedStat *cached,
+                                const UntrackedStat *current) {
+    return memcmp(cached, current, sizeof(UntrackedStat)) == 0 && cached->mtime < scan->built;
+}
+
+static void untracked_dir_free(UntrackedDir *dir) {
+    for (size_t i = 0; i < dir->file_count; i++) {
+        free(dir->files[i]);
+    }
+    for (size_t i = 0; i < dir->dir_count; i++) {
+        untracked_dir_free(&dir->dirs[i]);
+    }
+    free(dir->files);
+    free(dir->dirs);
+    free(dir->name);
+    memset(dir, 0, sizeof(*dir));
+}
+
+// Parse one directory record and everything below it
+static int untracked_parse_dir(const unsigned char **pos, const unsigned char *end,
+                               int depth, UntrackedDir *dir) {
+    UntrackedRecord record;
+    if (depth > UNTRACKED_DEPTH_MAX || (size_t)(end - *pos) < sizeof(record)) {
+        return -1;
+    }
+    memcpy(&record, *pos, sizeof(record));
+    *pos += sizeof(record);
+    if (record.name_len > (size_t)(end - *pos) || record.name_len >= MAX_PATH) {
+        return -1;
+    }
+    dir->name = strndup((const char *)*pos, record.name_len);
+    *pos += record.name_len;
+    dir->st = record.st;
+    dir->ignore = record.ignore;
+
+    // Each name and record takes at least 4 bytes, which bounds the counts
+    if (!dir->name || record.file_count > (size_t)(end - *pos) / 4 ||
+        record.dir_count > (size_t)(end - *pos) / 4) {
+        return -1;
+    }
+    dir->files = calloc(record.file_count ? record.file_count : 1, sizeof(char *));
+    dir->dirs = calloc(record.dir_count ? record.dir_count : 1, sizeof(UntrackedDir));
+    if (!dir->files || !dir->dirs) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < record.file_count; i++) {
+        uint32_t len;
+        if ((size_t)(end - *pos) < 4) {
+            return -1;
+        }
+        memcpy(&len, *pos, 4);
+        *pos += 4;
+        if (len > (size_t)(end - *pos) || len >= MAX_PATH) {
+            return -1;
+        }
+        if (!(dir->files[i] = strndup((const char *)*pos, len))) {
+            return -1;
+        }
+        dir->file_count++;
+        *pos += len;
+    }
+    for (uint32_t i = 0; i < record.dir_count; i++) {
+        dir->dir_count++;
+        if (untracked_parse_dir(pos, end, depth + 1, &dir->dirs[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Load the cache from the index; a missing or unreadable cache is empty
+static int untracked_load(const Index *idx, UntrackedHeader *header, UntrackedDir *root) {
+    size_t size;
+    const unsigned char *data = index_extension(idx, INDEX_EXT_UNTRACKED, &size);
+    if (!data || size < sizeof(UntrackedHeader)) {
+        return -1;
+    }
+    memcpy(header, data, sizeof(UntrackedHeader));
+    if (header->version != UNTRACKED_VERSION) {
+        return -1;
+    }
+
+    const unsigned char *pos = data + sizeof(UntrackedHeader);
+    if (untracked_parse_dir(&pos, data + size, 0, root) != 0 || pos != data + size) {
+        untracked_dir_free(root);
+        return -1;
+    }
+    return 0;
+}
+
+static void untracked_put(UntrackedBuffer *buf, const void *data, size_t len) {
+    if (buf->error) {
+        return;
+    }
+    if (buf->len + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity * 2 : 4096;
+        while (capacity < buf->len + len) {
+            capacity *= 2;
+        }
+        unsigned char *grown = realloc(buf->data, capacity);
+        if (!grown) {
+            buf->error = 1;
+            return;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void untracked_put_dir(UntrackedBuffer *buf, const UntrackedDir *dir) {
+    UntrackedRecord record;
+    memset(&record, 0, sizeof(record));
+    record.name_len = (uint32_t)strlen(dir->name);
+    record.file_count = (uint32_t)dir->file_count;
+    record.dir_count = (uint32_t)dir->dir_count;
+    record.st = dir->st;
+    record.ignore = dir->ignore;
+    untracked_put(buf, &record, sizeof(record));
+    untracked_put(buf, dir->name, record.name_len);
+
+    for (size_t i = 0; i < dir->file_count; i++) {
+        uint32_t len = (uint32_t)strlen(dir->files[i]);
+        untracked_put(buf, &len, 4);
+        untracked_put(buf, dir->files[i], len);
+    }
+    for (size_t i = 0; i < dir->dir_count; i++) {
+        untracked_put_dir(buf, &dir->dirs[i]);
+    }
+}
+
+static int untracked_add_path(UntrackedScan *scan, const char *dir, const char *name) {
+    if (scan->count == scan->capacity) {
+        size_t capacity = scan->capacity ? scan->capacity * 2 : 64;
+        char **paths = realloc(scan->paths, capacity * sizeof(char *));
+        if (!paths) {
+            return -1;
+        }
+        scan->paths = paths;
+        scan->capacity = capacity;
+    }
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (!path) {
+        return -1;
+    }
+    snprintf(path, len, "%s%s%s", dir, *dir ? "/" : "", name);
+    scan->paths[scan->count++] = path;
+    return 0;
+}
+
+// Rules in effect for a directory, reading its .nitignore on first use
+static const IgnoreList *untracked_rules(UntrackedScan *scan, UntrackedRules *rules) {
+    if (rules->loaded) {
+        return rules->list;
+    }
+
+    const IgnoreList *parent;
+    if (rules->parent) {
+        parent = untracked_rules(scan, rules->parent);
+    } else {
+        if (!scan->exclude_loaded) {
+            scan->exclude = ignore_list_read(NULL, scan->root_fd, EXCLUDE_FILE, "");
+            scan->exclude_loaded = 1;
+        }
+        parent = scan->exclude;
+    }
+
+    char file[MAX_PATH];
+    snprintf(file, sizeof(file), "%s%s%s", rules->path, *rules->path ? "/" : "", IGNORE_FILE);
+    rules->own = ignore_list_read(parent, scan->root_fd, file, rules->path);
+    rules->list = rules->own ? rules->own : parent;
+    rules->loaded = 1;
+    return rules->list;
+}
+
+// Classify one directory entry like the walker: 1 for a file, 2 for a
+// directory, 0 for anything skipped. Regular files need no stat call.
+static int untracked_classify(int dfd, const struct dirent *entry) {
+    struct stat st;
+#ifdef DT_DIR
+    if (entry->d_type == DT_DIR) {
+        return 2;
+    }
+    if (entry->d_type == DT_REG) {
+        return 1;
+    }
+    if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
+        return 0;
+    }
+#endif
+    if (fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return 0;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        return 2;
+    }
+    if (S_ISLNK(st.st_mode) && fstatat(dfd, entry->d_name, &st, 0) != 0) {
+        return 0;
+    }
+    return S_ISREG(st.st_mode) ? 1 : 0;
+}
+
+static int untracked_push(char ***names, size_t *count, size_t *capacity, const char *name) {
+    if (*count == *capacity) {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 16;
+        char **grown = realloc(*names, grown_capacity * sizeof(char *));
+        if (!grown) {
+            return -1;
+        }
+        *names = grown;
+        *capacity = grown_capacity;
+    }
+    if (!((*names)[*count] = strdup(name))) {
+        return -1;
+    }
+    (*count)++;
+    return 0;
+}
+
+static int untracked_name_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int untracked_visit(UntrackedScan *scan, UntrackedRules *parent, const char *path,
+                           UntrackedDir *old, int force, UntrackedDir *out);
+
+// Subdirectory of a cached directory by name
+static UntrackedDir *untracked_find_dir(UntrackedDir *dir, const char *name) {
+    size_t lo = 0;
+    size_t hi = dir ? dir->dir_count : 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(dir->dirs[mid].name, name);
+        if (cmp == 0) {
+            return &dir->dirs[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+// Visit the subdirectories named in names, reusing their cached entries in old
+static int untracked_visit_dirs(UntrackedScan *scan, UntrackedRules *rules, const char *path,
+                                char **names, size_t count, UntrackedDir *old, int force,
+                                UntrackedDir *out) {
+    out->dirs = calloc(count ? count : 1, sizeof(UntrackedDir));
+    if (!out->dirs) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        char child[MAX_PATH];
+        snprintf(child, sizeof(child), "%s%s%s", path, *path ? "/" : "", names[i]);
+        UntrackedDir *dir = &out->dirs[out->dir_count];
+        if (untracked_visit(scan, rules, child, untracked_find_dir(old, names[i]), force,
+                            dir) == 0) {
+            if (!(dir->name = strdup(names[i]))) {
+                untracked_dir_free(dir);
+                return -1;
+            }
+            out->dir_count++;
+        } else {
+            // Gone since it was listed
+            untracked_dir_free(dir);
+            scan->changed = 1;
+        }
+    }
+    return 0;
+}
+
+// Read a directory, listing its untracked files and its subdirectories
+static int untracked_read_dir(UntrackedScan *scan, UntrackedRules *rules, const char *path,
+                              UntrackedDir *old, int force, UntrackedDir *out) {
+    int fd = openat(scan->root_fd, *path ? path : ".",
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    char **names = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t files_capacity = 0;
+    size_t prefix_len = *path ? strlen(path) + 1 : 0;
+    int ret = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        // Skip hidden files and the VCS directory
+        if (entry->d_name[0] == '.' || prefix_len + strlen(entry->d_name) >= MAX_PATH) {
+            continue;
+        }
+        int kind = untracked_classify(dirfd(d), entry);
+        if (kind == 0) {
+            continue;
+        }
+
+        char full[MAX_PATH];
+        snprintf(full, sizeof(full), "%s%s%s", path, prefix_len ? "/" : "", entry->d_name);
+        const IgnoreList *ignore = untracked_rules(scan, rules);
+        if ((ignore && ignore_match(ignore, full, kind == 2)) ||
+            (kind == 1 && index_find_entry(scan->idx, full))) {
+            continue;
+        }
+
+        if (kind == 1 ? untracked_push(&out->files, &out->file_count, &files_capacity,
+                                       entry->d_name) != 0
+                      : untracked_push(&names, &count, &capacity, entry->d_name) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    closedir(d);
+
+    if (ret == 0) {
+        if (out->file_count > 1) {
+            qsort(out->files, out->file_count, sizeof(char *), untracked_name_cmp);
+        }
+        if (count > 1) {
+            qsort(names, count, sizeof(char *), untracked_name_cmp);
+        }
+        ret = untracked_visit_dirs(scan, rules, path, names, count, old, force, out);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+// Fill out for the directory at path, reusing old where its stat data shows
+// nothing changed. force rescans the whole subtree, for when ignore rules
+// above it changed. Returns -1 if the directory cannot be read.
+static int untracked_visit(UntrackedScan *scan, UntrackedRules *parent, const char *path,
+                           UntrackedDir *old, int force, UntrackedDir *out) {
+    struct stat st;
+    if (fstatat(scan->root_fd, *path ? path : ".", &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+        !S_ISDIR(st.st_mode)) {
+        return -1;
+    }
+    untracked_stat_set(&out->st, &st);
+
+    char file[MAX_PATH];
+    snprintf(file, sizeof(file), "%s%s%s", path, *path ? "/" : "", IGNORE_FILE);
+    untracked_stat_file(scan->root_fd, file, &out->ignore);
+    if (!old || !untracked_stat_clean(scan, &old->ignore, &out->ignore)) {
+        force = 1;
+    }
+
+    UntrackedRules rules;
+    memset(&rules, 0, sizeof(rules));
+    rules.parent = parent;
+    rules.path = path;
+
+    int ret;
+    if (!force && untracked_stat_clean(scan, &old->st, &out->st)) {
+        // Same entries as when cached: take the names, check the subdirectories
+        out->files = old->files;
+        out->file_count = old->file_count;
+        old->files = NULL;
+        old->file_count = 0;
+
+        char **names = malloc((old->dir_count ? old->dir_count : 1) * sizeof(char *));
+        ret = names ? 0 : -1;
+        for (size_t i = 0; names && i < old->dir_count; i++) {
+            names[i] = old->dirs[i].name;
+        }
+        if (ret == 0) {
+            ret = untracked_visit_dirs(scan, &rules, path, names, old->dir_count, old, 0, out);
+        }
+        free(names);
+    } else {
+        scan->changed = 1;
+        ret = untracked_read_dir(scan, &rules, path, old, force, out);
+    }
+
+    for (size_t i = 0; ret == 0 && i < out->file_count; i++) {
+        ret = untracked_add_path(scan, path, out->files[i]);
+    }
+    ignore_list_free(rules.own);
+    return ret;
+}
+
+// Untracked files in index order, not counting ignored or hidden ones. Only
+// directories changed since the cache in the index was built are read; the
+// refreshed cache is stored back into idx for the caller to save. Returns 1
+// if the cache changed, 0 if not and -1 on error.
+int untracked_files(Index *idx, char ***paths_out, size_t *count_out) {
+    UntrackedScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.idx = idx;
+    scan.root_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scan.root_fd < 0) {
+        perror("open .");
+        return -1;
+    }
+
+    UntrackedHeader header;
+    UntrackedDir old;
+    memset(&old, 0, sizeof(old));
+    int cached = untracked_load(idx, &header, &old) == 0;
+    scan.built = cached ? header.built : 0;
+
+    UntrackedHeader fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    fresh.version = UNTRACKED_VERSION;
+    fresh.built = time(NULL);
+    untracked_stat_file(scan.root_fd, EXCLUDE_FILE, &fresh.exclude);
+    int force = !cached || !untracked_stat_clean(&scan, &header.exclude, &fresh.exclude);
+
+    UntrackedDir root;
+    memset(&root, 0, sizeof(root));
+    int ret = untracked_visit(&scan, NULL, "", cached ? &old : NULL, force, &root);
+    if (ret == 0 && (root.name = strdup(""))) {
+        if (scan.changed || force) {
+            UntrackedBuffer buf;
+            memset(&buf, 0, sizeof(buf));
+            untracked_put(&buf, &fresh, sizeof(fresh));
+            untracked_put_dir(&buf, &root);
+            if (!buf.error && index_set_extension(idx, INDEX_EXT_UNTRACKED, buf.data, buf.len) == 0) {
+                ret = 1;
+            }
+            free(buf.data);
+        }
+    } else {
+        ret = -1;
+    }
+
+    if (ret >= 0) {
+        if (scan.count > 1) {
+            qsort(scan.paths, scan.count, sizeof(char *), untracked_name_cmp);
+        }
+        *paths_out = scan.paths;
+        *count_out = scan.count;
+    } else {
+        for (size_t i = 0; i < scan.count; i++) {
+            free(scan.paths[i]);
+        }
+        free(scan.paths);
+    }
+    untracked_dir_free(&root);
+    untracked_dir_free(&old);
+    ignore_list_free(scan.exclude);
+    close(scan.root_fd);
+    return ret;
+}
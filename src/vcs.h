@@ -1,6 +1,15 @@
 #ifndef VCS_H
 #define VCS_H
 
+// Expose POSIX/BSD interfaces (mmap, mkstemp, gethostname) under -std=c11
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#ifndef _DARWIN_C_SOURCE
+#define _DARWIN_C_SOURCE
+#endif
+
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,16 +29,34 @@
 // Constants
 #define VCS_DIR ".vcs"
 #define OBJECTS_DIR ".vcs/objects"
+#define PACK_DIR ".vcs/objects/pack"
 #define REFS_DIR ".vcs/refs"
 #define REFS_HEADS_DIR ".vcs/refs/heads"
 #define HEAD_FILE ".vcs/HEAD"
 #define INDEX_FILE ".vcs/index"
+#define INDEX_LOCK_FILE ".vcs/index.lock"
 #define CONFIG_FILE ".vcs/config"
-#define SHA1_HEX_SIZE 40
-#define SHA1_SIZE 20
+#define IGNORE_FILE ".nitignore"
+#define EXCLUDE_FILE ".vcs/info/exclude"
+#define SPARSE_FILE ".vcs/info/sparse-checkout"
+#define FSMONITOR_SOCKET ".vcs/fsmonitor.sock"
+#define MAX_HASH_SIZE 32          // SHA-256; SHA-1 uses the first 20 bytes
+#define MAX_HASH_HEX_SIZE 64
 #define MAX_PATH 4096
 #define MAX_LINE 8192
 
+// Object hash algorithm, fixed per repository by extensions.objectFormat
+typedef enum {
+    HASH_SHA1,
+    HASH_SHA256
+} HashAlgo;
+
+// Binary object ID; hex only at the text boundary. Only the first
+// hash_size() bytes are meaningful.
+typedef struct {
+    unsigned char hash[MAX_HASH_SIZE];
+} ObjectId;
+
 // Object types
 typedef enum {
     OBJ_BLOB,
@@ -37,29 +64,164 @@ typedef enum {
     OBJ_COMMIT
 } ObjectType;
 
-// Index entry structure
+// Index entry: the fixed-size record stored in .vcs/index, used in place
+// from the mapping. The path lives in the index path table; use index_path().
+// The stat fields let unchanged files be skipped without reading them; a
+// mode of 0 means the stat data is unknown and the file must be re-read.
 typedef struct {
-    char sha1[SHA1_HEX_SIZE + 1];
-    char path[MAX_PATH];
-    time_t mtime;
-    size_t size;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t size;
+    uint64_t ino;
+    uint64_t dev;
+    uint32_t mode;
+    uint32_t flags;
+    uint32_t path_offset;
+    uint32_t path_len;
+    ObjectId oid;
 } IndexEntry;
 
-// Index structure
+// Index entry flags
+#define INDEX_ENTRY_FRESH 0x80000000u   // stat taken by this process; not saved
+#define INDEX_ENTRY_FSMONITOR_VALID 0x40000000u // clean as of the fsmonitor token
+#define INDEX_ENTRY_SKIP_WORKTREE 0x20000000u   // outside the sparse checkout; no file
+
+// Index extension signatures
+#define INDEX_EXT_UNTRACKED "UNTR"      // untracked cache; dropped when paths change
+#define INDEX_EXT_FSMONITOR "FSMN"      // fsmonitor token the valid flags refer to
+#define INDEX_EXT_CACHE_TREE "TREE"     // tree object of each directory; see tree.c
+
+// Optional section of the index file, kept across loads and saves. data
+// points into the mapping unless owned.
+typedef struct {
+    char signature[4];
+    void *data;
+    size_t size;
+    int owned;
+} IndexExtension;
+
+// New or updated index entry for index_merge()
+typedef struct {
+    const char *path;
+    ObjectId oid;
+    struct stat st;
+} IndexUpdate;
+
+// Index structure, kept sorted by path. entries and paths point into the
+// mapped file until the first change, then into owned copies (capacity and
+// paths_capacity > 0). timestamp is the index file's mtime when loaded; lock
+// is the open lock file while a transaction is in progress; extensions are
+// the optional sections that follow the path table.
 typedef struct {
     IndexEntry *entries;
     size_t count;
     size_t capacity;
+    char *paths;
+    size_t paths_len;
+    size_t paths_capacity;
+    void *map;
+    size_t map_size;
+    time_t timestamp;
+    FILE *lock;
+    IndexExtension *extensions;
+    size_t extension_count;
 } Index;
 
 // Tree entry structure
 typedef struct {
     char mode[10];
     char type[10];
-    char sha1[SHA1_HEX_SIZE + 1];
+    ObjectId oid;
     char name[256];
 } TreeEntry;
 
+// Tree iterator: walks the data of a tree object in place. The current
+// entry's name and hash point into that data and stay valid while it lives.
+typedef struct {
+    const unsigned char *pos;
+    const unsigned char *end;
+    const char *name;               // NUL-terminated, name_len bytes
+    size_t name_len;
+    uint32_t mode;                  // S_ISDIR(mode) for subtrees
+    const unsigned char *hash;      // hash_size() bytes of binary object ID
+} TreeIter;
+
+// Kind of change reported by a diff
+typedef enum {
+    DIFF_ADDED = 'A',
+    DIFF_MODIFIED = 'M',
+    DIFF_DELETED = 'D',
+    DIFF_RENAMED = 'R',
+    DIFF_COPIED = 'C'
+} DiffStatus;
+
+// One changed file; the ID and mode of a missing side are null and 0
+typedef struct {
+    DiffStatus status;
+    const char *path;
+    const char *old_path;       // source of a rename or copy, else path
+    int similarity;             // percent, for renames and copies
+    ObjectId old_oid;
+    ObjectId new_oid;
+    uint32_t old_mode;
+    uint32_t new_mode;
+} DiffChange;
+
+// Called for each change in path order; a positive return stops the diff,
+// a negative one fails it
+typedef int (*DiffCallback)(const DiffChange *change, void *data);
+
+// Line diff algorithm (diff.algorithm)
+typedef enum {
+    DIFF_HISTOGRAM,
+    DIFF_MYERS
+} DiffAlgorithm;
+
+// One side of a line diff: a buffer split into lines, and which changed
+typedef struct {
+    const char *data;
+    size_t size;
+    size_t count;               // lines; the last may lack its newline
+    size_t *lines;              // start offset of each line, count + 1 entries
+    uint32_t *ids;              // equal for equal lines on either side
+    unsigned char *changed;     // 1 for lines deleted (old) or added (new)
+} DiffLines;
+
+typedef struct {
+    DiffLines old;
+    DiffLines new;
+} LineDiff;
+
+// Output of nit diff
+typedef enum {
+    DIFF_FORMAT_PATCH,
+    DIFF_FORMAT_NAME_STATUS,
+    DIFF_FORMAT_STAT,
+    DIFF_FORMAT_NUMSTAT
+} DiffFormat;
+
+typedef struct {
+    DiffFormat format;
+    int context;                // lines around each hunk; -1 for diff.context
+    int renames;                // 1 on, 0 off, -1 for diff.renames
+    int copies;                 // also detect copies of modified files
+    int threshold;              // rename similarity percent; -1 for diff.renameThreshold
+} DiffOptions;
+
+// Changes collected for a pass over all of them, such as rename detection
+typedef struct {
+    DiffChange *items;          // paths owned by the queue
+    size_t count;
+    size_t capacity;
+} DiffQueue;
+
+// Rename detection settings
+typedef struct {
+    int threshold;              // minimum similarity, percent
+    size_t candidates;          // sources scored per added file
+    int copies;                 // also pair added files with modified ones
+} RenameOptions;
+
 // Tree structure
 typedef struct {
     TreeEntry *entries;
@@ -69,8 +231,8 @@ typedef struct {
 
 // Commit structure
 typedef struct {
-    char tree_sha1[SHA1_HEX_SIZE + 1];
-    char parent_sha1[SHA1_HEX_SIZE + 1];
+    ObjectId tree;
+    ObjectId parent;     // null ID for a root commit
     char author[256];
     char committer[256];
     time_t timestamp;
@@ -80,15 +242,66 @@ typedef struct {
 // Branch structure
 typedef struct {
     char name[256];
-    char commit_sha1[SHA1_HEX_SIZE + 1];
+    ObjectId commit;
 } Branch;
 
+// Compression backends
+typedef enum {
+    CODEC_ZLIB,
+    CODEC_ZSTD,
+    CODEC_STORE
+} CompressionCodec;
+
+// Object cache counters
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    size_t entries;
+    size_t bytes;
+    long limit;
+} ObjectCacheStats;
+
+// Incremental hash context (opaque)
+typedef struct HashCtx HashCtx;
+
+// Streaming object writer (opaque)
+typedef struct ObjectWriter ObjectWriter;
+
+// Streaming object reader (opaque)
+typedef struct ObjectStream ObjectStream;
+
+// Streaming compressor/decompressor (opaque)
+typedef struct Compressor Compressor;
+typedef struct Decompressor Decompressor;
+
+// Compiled ignore patterns of one file, chained to its parent directory's (opaque)
+typedef struct IgnoreList IgnoreList;
+
+// Called for each file found by walk_worktree(); nonzero stops the walk
+typedef int (*WalkFn)(const char *path, const struct stat *st, void *data);
+
+// Thread pool returning jobs in submission order (opaque)
+typedef struct WorkerPool WorkerPool;
+typedef void (*WorkerFn)(void *job);
+
+// Sparse checkout directories, matched with a prefix trie (opaque)
+typedef struct SparsePatterns SparsePatterns;
+
 // Function declarations
 
 // Utility functions
-void compute_sha1(const void *data, size_t len, unsigned char *hash);
-void sha1_to_hex(const unsigned char *sha1, char *hex);
-void hex_to_sha1(const char *hex, unsigned char *sha1);
+HashAlgo hash_algo(void);
+size_t hash_size(void);
+size_t hash_hex_size(void);
+const char *hash_algo_name(HashAlgo algo);
+int hash_algo_by_name(const char *name, HashAlgo *algo);
+void compute_hash(const void *data, size_t len, unsigned char *hash);
+HashCtx *hash_ctx_new(void);
+void hash_update(HashCtx *ctx, const void *data, size_t len);
+void hash_digest(HashCtx *ctx, unsigned char *hash);
+void hash_reset(HashCtx *ctx);
+void hash_final(HashCtx *ctx, unsigned char *hash);
+void hash_ctx_free(HashCtx *ctx);
 int file_exists(const char *path);
 int dir_exists(const char *path);
 int create_dir(const char *path);
@@ -98,71 +311,215 @@ int write_file(const char *path, const void *data, size_t size);
 void get_current_time(char *buffer, size_t size);
 char *get_user_info(void);
 
+// Object ID functions
+void hash_to_hex(const unsigned char *hash, char *hex);
+int hex_to_hash(const char *hex, unsigned char *hash);
+void oid_to_hex(const ObjectId *oid, char *hex);
+const char *oid_hex(const ObjectId *oid);
+int hex_to_oid(const char *hex, ObjectId *oid);
+int oid_cmp(const ObjectId *a, const ObjectId *b);
+int oid_equal(const ObjectId *a, const ObjectId *b);
+int oid_is_null(const ObjectId *oid);
+void oid_clear(ObjectId *oid);
+
 // Repository functions
-int vcs_init(void);
+int vcs_init(HashAlgo algo);
 int is_vcs_repo(void);
 char *get_vcs_root(void);
 
 // Object functions
-int write_object(const void *data, size_t size, ObjectType type, char *sha1_out);
-void *read_object(const char *sha1, size_t *size, ObjectType *type);
-int object_exists(const char *sha1);
-char *get_object_path(const char *sha1);
+int write_object(const void *data, size_t size, ObjectType type, ObjectId *oid_out);
+int hash_object_batch(ObjectType type, const void *const *data, const size_t *sizes,
+                      size_t count, ObjectId *oids);
+int write_object_batch(ObjectType type, const void *const *data, const size_t *sizes,
+                       size_t count, ObjectId *oids);
+int write_object_file(const char *path, ObjectType type, ObjectId *oid_out, struct stat *st_out);
+int hash_object_file(const char *path, ObjectType type, ObjectId *oid_out);
+ObjectWriter *object_writer_open(ObjectType type, size_t size,
+                                 const void *sample, size_t sample_len);
+int object_writer_write(ObjectWriter *writer, const void *data, size_t len);
+int object_writer_close(ObjectWriter *writer, ObjectId *oid_out);
+void object_writer_abort(ObjectWriter *writer);
+void *read_object(const ObjectId *oid, size_t *size, ObjectType *type);
+int object_exists(const ObjectId *oid);
+char *get_object_path(const ObjectId *oid);
+ObjectStream *object_stream_open(const ObjectId *oid, ObjectType *type, size_t *size);
+ssize_t object_stream_read(ObjectStream *stream, void *buf, size_t len);
+void object_stream_close(ObjectStream *stream);
+int read_object_header(const ObjectId *oid, ObjectType *type, size_t *size);
+void *read_loose_object(const ObjectId *oid, size_t *size, ObjectType *type);
+int loose_object_exists(const ObjectId *oid);
+
+// Object cache functions
+void *object_cache_get(const ObjectId *oid, size_t *size, ObjectType *type);
+void object_cache_put(const ObjectId *oid, const void *data, size_t size, ObjectType type);
+void object_cache_get_stats(ObjectCacheStats *stats);
+void object_cache_clear(void);
+
+// Pack functions
+void *pack_read_object(const ObjectId *oid, size_t *size, ObjectType *type);
+int pack_has_object(const ObjectId *oid);
+int pack_object_info(const ObjectId *oid, ObjectType *type, size_t *size);
+const unsigned char *pack_object_stream(const ObjectId *oid, ObjectType *type,
+                                        size_t *size, size_t *avail);
+void pack_reload(void);
+int repack_objects(int all);
 
 // Index functions
 Index *index_new(void);
 void index_free(Index *idx);
 int index_load(Index *idx);
 int index_save(Index *idx);
-int index_add_entry(Index *idx, const char *path, const char *sha1, time_t mtime, size_t size);
+int index_lock(Index *idx);
+int index_try_lock(Index *idx);
+int index_commit(Index *idx);
+void index_rollback(Index *idx);
+int index_add_entry(Index *idx, const char *path, const ObjectId *oid, const struct stat *st);
+int index_merge(Index *idx, const IndexUpdate *updates, size_t count);
 int index_remove_entry(Index *idx, const char *path);
+int index_remove_entries(Index *idx, const char *const *paths, size_t count);
 IndexEntry *index_find_entry(Index *idx, const char *path);
+size_t index_position(const Index *idx, const char *path, int *found);
+int index_set_flags(Index *idx, size_t pos, uint32_t set, uint32_t clear);
+const char *index_path(const Index *idx, const IndexEntry *entry);
+int index_entry_uptodate(const Index *idx, const IndexEntry *entry, const struct stat *st);
+const void *index_extension(const Index *idx, const char *signature, size_t *size);
+int index_set_extension(Index *idx, const char *signature, const void *data, size_t size);
+void *index_edit_extension(Index *idx, const char *signature, size_t *size);
+void index_drop_extension(Index *idx, const char *signature);
 
 // Tree functions
 Tree *tree_new(void);
 void tree_free(Tree *tree);
-int tree_add_entry(Tree *tree, const char *mode, const char *type, const char *sha1, const char *name);
+int tree_add_entry(Tree *tree, const char *mode, const char *type, const ObjectId *oid, const char *name);
 int tree_from_index(Index *idx, Tree *tree);
-int write_tree(Tree *tree, char *sha1_out);
-Tree *read_tree(const char *sha1);
+int write_index_tree(Index *idx, ObjectId *oid_out);
+void cache_tree_invalidate(Index *idx, const char *path);
+int cache_tree_lookup(Index *idx, const char *dir, size_t dir_len, ObjectId *oid_out,
+                      size_t *count_out);
+int write_tree(Tree *tree, ObjectId *oid_out);
+Tree *read_tree(const ObjectId *oid);
+void tree_iter_init(TreeIter *it, const void *data, size_t size);
+int tree_iter_next(TreeIter *it);
+void tree_iter_oid(const TreeIter *it, ObjectId *oid_out);
 
 // Commit functions
 Commit *commit_new(void);
 void commit_free(Commit *commit);
-int write_commit(Commit *commit, char *sha1_out);
-Commit *read_commit(const char *sha1);
+int write_commit(Commit *commit, ObjectId *oid_out);
+Commit *read_commit(const ObjectId *oid);
 
 // Reference functions
-int write_ref(const char *ref_name, const char *sha1);
-char *read_ref(const char *ref_name);
-int update_head(const char *ref_or_sha1);
-char *get_head_commit(void);
+int write_ref(const char *ref_name, const ObjectId *oid);
+int read_ref(const char *ref_name, ObjectId *oid);
+int update_head(const char *branch_name);
+int detach_head(const ObjectId *oid);
+int get_head_commit(ObjectId *oid);
 int is_head_detached(void);
 char *get_current_branch(void);
 
 // Branch functions
-int create_branch(const char *branch_name, const char *commit_sha1);
+int create_branch(const char *branch_name, const ObjectId *commit);
 int delete_branch(const char *branch_name);
 int list_branches(void);
 int branch_exists(const char *branch_name);
 
 // Working directory functions
 int add_file(const char *path);
+int add_files(const char *const *paths, size_t count);
 int add_all(void);
 int vcs_status(void);
 int vcs_log(int limit);
-int vcs_diff(const char *commit_sha1);
+int vcs_diff(const char *from, const char *to, int cached, const DiffOptions *opts);
 
 // Checkout functions
 int checkout_branch(const char *branch_name);
-int checkout_commit(const char *commit_sha1);
+int checkout_commit(const ObjectId *commit);
+int checkout_sparse(const SparsePatterns *sparse);
+
+// Sparse checkout functions
+int sparse_load(SparsePatterns **out);
+void sparse_free(SparsePatterns *sparse);
+int sparse_includes(const SparsePatterns *sparse, const char *path);
+int sparse_checkout_set(const char *const *dirs, size_t count, int add);
+int sparse_checkout_disable(void);
+int sparse_checkout_list(void);
 
 // Merge functions
 int merge_branch(const char *branch_name);
-char *find_merge_base(const char *commit1_sha1, const char *commit2_sha1);
+int find_merge_base(const ObjectId *commit1, const ObjectId *commit2, ObjectId *base);
+
+// Delta functions
+int create_delta(const void *src, size_t src_size, const void *dst, size_t dst_size,
+                 size_t max_size, void **delta_out, size_t *delta_size);
+int apply_delta(const void *base, size_t base_size, const void *delta, size_t delta_size,
+                void **out, size_t *out_size);
+
+// Config functions
+const char *config_get(const char *name);
+long config_get_int(const char *name, long default_value);
+int config_get_bool(const char *name, int default_value);
 
 // Compression functions
-int compress_data(const void *src, size_t src_len, void **dst, size_t *dst_len);
-int decompress_data(const void *src, size_t src_len, void **dst, size_t *dst_len);
+void compression_settings(ObjectType type, CompressionCodec *codec, int *level);
+int compression_probe_incompressible(const void *sample, size_t len);
+void compression_choose(ObjectType type, const void *sample, size_t sample_len,
+                        CompressionCodec *codec, int *level);
+Compressor *compressor_new(CompressionCodec codec, int level);
+int compressor_run(Compressor *c, const unsigned char **in, size_t *in_len,
+                   unsigned char **out, size_t *out_len, int finish);
+void compressor_free(Compressor *c);
+Decompressor *decompressor_new(const unsigned char *head, size_t head_len);
+int decompressor_run(Decompressor *d, const unsigned char **in, size_t *in_len,
+                     unsigned char **out, size_t *out_len);
+void decompressor_free(Decompressor *d);
+int compress_data(const void *src, size_t src_len, ObjectType type, void **dst, size_t *dst_len);
+int decompress_exact(const void *src, size_t src_len, void *dst, size_t dst_len);
+
+// Worker pool functions
+int worker_thread_count(void);
+WorkerPool *worker_pool_new(int threads, size_t capacity, WorkerFn fn);
+int worker_pool_full(WorkerPool *pool);
+int worker_pool_submit(WorkerPool *pool, void *job);
+void *worker_pool_next(WorkerPool *pool);
+void worker_pool_free(WorkerPool *pool);
+
+// Working tree walk functions
+int walk_worktree(WalkFn fn, void *data);
+
+// Untracked cache functions
+int untracked_files(Index *idx, char ***paths_out, size_t *count_out);
+
+// Filesystem monitor functions
+int fsmonitor_run(int daemonize);
+int fsmonitor_stop(void);
+int fsmonitor_status(void);
+int fsmonitor_refresh(Index *idx, int *updated);
+
+// Diff functions
+int diff_trees(const ObjectId *old_tree, const ObjectId *new_tree, DiffCallback fn, void *data);
+int diff_tree_index(const ObjectId *tree, Index *idx, DiffCallback fn, void *data);
+int diff_index_worktree(Index *idx, DiffCallback fn, void *data);
+
+// Rename detection functions
+int diff_queue_add(const DiffChange *change, void *data);
+int diff_queue_flush(DiffQueue *queue, DiffCallback fn, void *data);
+void diff_queue_free(DiffQueue *queue);
+int diff_detect_renames(DiffQueue *queue, const RenameOptions *opts);
+
+// Line diff functions
+int line_diff(const void *old_data, size_t old_size, const void *new_data, size_t new_size,
+              DiffAlgorithm algorithm, LineDiff *diff);
+void line_diff_free(LineDiff *diff);
+void line_diff_count(const LineDiff *diff, size_t *added, size_t *deleted);
+void line_diff_print(const LineDiff *diff, int context, FILE *out);
+int diff_is_binary(const void *data, size_t size);
+
+// Ignore functions
+IgnoreList *ignore_list_read(const IgnoreList *parent, int dir_fd, const char *file,
+                             const char *base);
+void ignore_list_free(IgnoreList *list);
+int ignore_match(const IgnoreList *list, const char *path, int is_dir);
+int ignore_path_excluded(int root_fd, const char *path);
 
 #endif // VCS_H
@@ -0,0 +1,449 @@
+#include "vcs.h"
+#include <fcntl.h>
+#include <pthread.h>
+
+// Working tree walk. Each directory is scanned once with readdir() and
+// fstatat() relative to its own fd. Subdirectories found by a scan are pushed
+// onto the scanning thread's deque; the owner pops the newest, idle threads
+// steal the oldest from other deques. The calling thread visits directories
+// depth first with entries sorted so that paths come out in index order,
+// scanning a directory itself if no worker has claimed it yet. Each scan
+// loads the directory's .nitignore; ignored entries are dropped before
+// anything below them is read.
+
+#define WALK_DEQUE_INITIAL 64
+
+typedef struct WalkDir WalkDir;
+
+// File or subdirectory found by a scan
+typedef struct {
+    char *name;
+    struct stat st;
+    WalkDir *dir;            // NULL for a file
+} WalkItem;
+
+typedef enum {
+    WALK_PENDING,
+    WALK_SCANNING,
+    WALK_SCANNED
+} WalkState;
+
+struct WalkDir {
+    char *path;              // relative to the root; "" for the root itself
+    const IgnoreList *ignore; // rules inherited from the parent directories
+    WalkState state;
+    WalkItem *items;
+    size_t count;
+    WalkDir *next;           // every directory, freed when the walk ends
+};
+
+// Directories waiting to be scanned
+typedef struct {
+    pthread_mutex_t lock;
+    WalkDir **dirs;
+    size_t head;             // oldest, taken by thieves
+    size_t tail;             // newest, taken by the owner
+    size_t capacity;
+} WalkDeque;
+
+typedef struct {
+    int root_fd;
+    WalkDeque *deques;       // deques[0] belongs to the calling thread
+    int ndeques;
+    pthread_mutex_t lock;    // guards directory states, queued, stopping, dirs
+    pthread_cond_t work;     // directories were queued, or the walk is over
+    pthread_cond_t scanned;  // a directory finished scanning
+    size_t queued;
+    int stopping;
+    WalkDir *dirs;
+    IgnoreList **ignores;    // every ignore file loaded, freed when the walk ends
+    size_t ignore_count;
+    size_t ignore_capacity;
+} Walker;
+
+typedef struct {
+    Walker *walker;
+    int self;
+} WalkWorker;
+
+static int deque_push(WalkDeque *deque, WalkDir *dir) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity) {
+        // Reuse the space freed by thieves before growing
+        size_t live = deque->tail - deque->head;
+        if (deque->head > 0) {
+            memmove(deque->dirs, deque->dirs + deque->head, live * sizeof(WalkDir *));
+        }
+        deque->head = 0;
+        deque->tail = live;
+        if (live == deque->capacity) {
+            size_t capacity = deque->capacity ? deque->capacity * 2 : WALK_DEQUE_INITIAL;
+            WalkDir **dirs = realloc(deque->dirs, capacity * sizeof(WalkDir *));
+            if (!dirs) {
+                pthread_mutex_unlock(&deque->lock);
+                return -1;
+            }
+            deque->dirs = dirs;
+            deque->capacity = capacity;
+        }
+    }
+    deque->dirs[deque->tail++] = dir;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+static WalkDir *deque_pop(WalkDeque *deque, int steal) {
+    WalkDir *dir = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        dir = steal ? deque->dirs[deque->head++] : deque->dirs[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return dir;
+}
+
+// Order entries by name, treating a directory as if its name ended in '/',
+// so a depth-first visit yields full paths in byte order
+static int walk_item_cmp(const void *a, const void *b) {
+    const WalkItem *x = a;
+    const WalkItem *y = b;
+    const unsigned char *p = (const unsigned char *)x->name;
+    const unsigned char *q = (const unsigned char *)y->name;
+    while (*p && *p == *q) {
+        p++;
+        q++;
+    }
+    int c1 = *p ? *p : (x->dir ? '/' : 0);
+    int c2 = *q ? *q : (y->dir ? '/' : 0);
+    return c1 - c2;
+}
+
+static WalkDir *walk_dir_new(Walker *walker, const char *parent, const char *name,
+                             const IgnoreList *ignore) {
+    WalkDir *dir = calloc(1, sizeof(WalkDir));
+    size_t len = strlen(parent) + strlen(name) + 2;
+    if (!dir || !(dir->path = malloc(len))) {
+        free(dir);
+        return NULL;
+    }
+    snprintf(dir->path, len, "%s%s%s", parent, *parent ? "/" : "", name);
+    dir->ignore = ignore;
+
+    pthread_mutex_lock(&walker->lock);
+    dir->next = walker->dirs;
+    walker->dirs = dir;
+    pthread_mutex_unlock(&walker->lock);
+    return dir;
+}
+
+// Load a directory's .nitignore; its rules apply on top of the parent's
+static const IgnoreList *walk_load_ignore(Walker *walker, WalkDir *dir, int dfd) {
+    IgnoreList *list = ignore_list_read(dir->ignore, dfd, IGNORE_FILE, dir->path);
+    if (!list) {
+        return dir->ignore;
+    }
+
+    pthread_mutex_lock(&walker->lock);
+    if (walker->ignore_count == walker->ignore_capacity) {
+        size_t capacity = walker->ignore_capacity ? walker->ignore_capacity * 2 : 16;
+        IgnoreList **ignores = realloc(walker->ignores, capacity * sizeof(IgnoreList *));
+        if (!ignores) {
+            pthread_mutex_unlock(&walker->lock);
+            ignore_list_free(list);
+            return dir->ignore;
+        }
+        walker->ignores = ignores;
+        walker->ignore_capacity = capacity;
+    }
+    walker->ignores[walker->ignore_count++] = list;
+    pthread_mutex_unlock(&walker->lock);
+    return list;
+}
+
+// Classify one directory entry; returns 1 for a file, 2 for a directory and
+// 0 for anything skipped. Symlinks to files count as files; symlinked
+// directories are not followed.
+static int walk_classify(int dfd, const struct dirent *entry, struct stat *st) {
+#ifdef DT_DIR
+    if (entry->d_type == DT_DIR) {
+        return 2;
+    }
+#endif
+    // Only a real directory is queued; a symlink is resolved below
+    if (fstatat(dfd, entry->d_name, st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return 0;
+    }
+    if (S_ISDIR(st->st_mode)) {
+        return 2;
+    }
+    if (S_ISLNK(st->st_mode) && fstatat(dfd, entry->d_name, st, 0) != 0) {
+        return 0;
+    }
+    return S_ISREG(st->st_mode) ? 1 : 0;
+}
+
+// Read one directory, sort its entries and queue its subdirectories on the
+// deque of the scanning thread
+static void walk_scan(Walker *walker, WalkDir *dir, int self) {
+    int fd = *dir->path
+        ? openat(walker->root_fd, dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+        : dup(walker->root_fd);
+    DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!d && fd >= 0) {
+        close(fd);
+    }
+
+    const IgnoreList *ignore = d ? walk_load_ignore(walker, dir, dirfd(d)) : NULL;
+    size_t capacity = 0;
+    size_t prefix_len = *dir->path ? strlen(dir->path) + 1 : 0;
+    struct dirent *entry;
+    while (d && (entry = readdir(d)) != NULL) {
+        // Skip hidden files and the VCS directory
+        if (entry->d_name[0] == '.' || prefix_len + strlen(entry->d_name) >= MAX_PATH) {
+            continue;
+        }
+
+        struct stat st;
+        int kind = walk_classify(dirfd(d), entry, &st);
+        if (kind == 0) {
+            continue;
+        }
+        if (ignore) {
+            char path[MAX_PATH];
+            snprintf(path, sizeof(path), "%s%s%s", dir->path, prefix_len ? "/" : "",
+                     entry->d_name);
+            if (ignore_match(ignore, path, kind == 2)) {
+                continue;
+            }
+        }
+
+        if (dir->count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            WalkItem *items = realloc(dir->items, capacity * sizeof(WalkItem));
+            if (!items) {
+                break;
+            }
+            dir->items = items;
+        }
+        WalkItem *item = &dir->items[dir->count];
+        item->name = strdup(entry->d_name);
+        item->st = st;
+        item->dir = NULL;
+        if (!item->name) {
+            break;
+        }
+        if (kind == 2 && !(item->dir = walk_dir_new(walker, dir->path, item->name, ignore))) {
+            free(item->name);
+            break;
+        }
+        dir->count++;
+    }
+    if (d) {
+        closedir(d);
+    }
+
+    qsort(dir->items, dir->count, sizeof(WalkItem), walk_item_cmp);
+
+    // Count subdirectories as queued before pushing them, so a thief never
+    // takes one that has not been counted. Push in reverse so the owner,
+    // popping the newest, goes in path order.
+    size_t subdirs = 0;
+    for (size_t i = 0; i < dir->count; i++) {
+        subdirs += dir->items[i].dir != NULL;
+    }
+    pthread_mutex_lock(&walker->lock);
+    walker->queued += subdirs;
+    pthread_mutex_unlock(&walker->lock);
+
+    size_t failed = 0;
+    for (size_t i = dir->count; i > 0; i--) {
+        if (dir->items[i - 1].dir &&
+            deque_push(&walker->deques[self], dir->items[i - 1].dir) != 0) {
+            failed++;   // left for the visiting thread to scan
+        }
+    }
+
+    pthread_mutex_lock(&walker->lock);
+    dir->state = WALK_SCANNED;
+    walker->queued -= failed;
+    pthread_cond_broadcast(&walker->scanned);
+    if (subdirs > failed) {
+        pthread_cond_broadcast(&walker->work);
+    }
+    pthread_mutex_unlock(&walker->lock);
+}
+
+// Claim a pending directory for scanning
+static int walk_claim(Walker *walker, WalkDir *dir) {
+    pthread_mutex_lock(&walker->lock);
+    int claimed = dir->state == WALK_PENDING;
+    if (claimed) {
+        dir->state = WALK_SCANNING;
+    }
+    pthread_mutex_unlock(&walker->lock);
+    return claimed;
+}
+
+// Next queued directory: the newest from our own deque, else the oldest
+// from another thread's
+static WalkDir *walk_take(Walker *walker, int self) {
+    WalkDir *dir = deque_pop(&walker->deques[self], 0);
+    for (int i = 1; !dir && i < walker->ndeques; i++) {
+        dir = deque_pop(&walker->deques[(self + i) % walker->ndeques], 1);
+    }
+    if (dir) {
+        pthread_mutex_lock(&walker->lock);
+        walker->queued--;
+        pthread_mutex_unlock(&walker->lock);
+    }
+    return dir;
+}
+
+static void *walk_worker_main(void *arg) {
+    WalkWorker *worker = arg;
+    Walker *walker = worker->walker;
+
+    for (;;) {
+        WalkDir *dir = walk_take(walker, worker->self);
+        if (dir) {
+            if (walk_claim(walker, dir)) {
+                walk_scan(walker, dir, worker->self);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&walker->lock);
+        while (walker->queued == 0 && !walker->stopping) {
+            pthread_cond_wait(&walker->work, &walker->lock);
+        }
+        int stopping = walker->stopping;
+        pthread_mutex_unlock(&walker->lock);
+        if (stopping) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void walk_free_items(WalkDir *dir) {
+    for (size_t i = 0; i < dir->count; i++) {
+        free(dir->items[i].name);
+    }
+    free(dir->items);
+    dir->items = NULL;
+    dir->count = 0;
+}
+
+// Visit a directory's files and subdirectories in order on the calling
+// thread, waiting for (or doing) each scan
+static int walk_visit(Walker *walker, WalkDir *dir, WalkFn fn, void *data) {
+    if (walk_claim(walker, dir)) {
+        walk_scan(walker, dir, 0);
+    } else {
+        pthread_mutex_lock(&walker->lock);
+        while (dir->state != WALK_SCANNED) {
+            pthread_cond_wait(&walker->scanned, &walker->lock);
+        }
+        pthread_mutex_unlock(&walker->lock);
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < dir->count && ret == 0; i++) {
+        WalkItem *item = &dir->items[i];
+        if (item->dir) {
+            ret = walk_visit(walker, item->dir, fn, data);
+            continue;
+        }
+
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s%s%s", dir->path, *dir->path ? "/" : "", item->name);
+        ret = fn(path, &item->st, data);
+    }
+    walk_free_items(dir);
+    return ret;
+}
+
+// Call fn for every regular file below the current directory, in index
+// (byte) order and on the calling thread. Hidden and ignored entries are
+// skipped, as is everything below an ignored directory. A
+// nonzero return from fn stops the walk and is returned.
+int walk_worktree(WalkFn fn, void *data) {
+    Walker walker;
+    memset(&walker, 0, sizeof(walker));
+    walker.root_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (walker.root_fd < 0) {
+        perror("open .");
+        return -1;
+    }
+
+    int nthreads = worker_thread_count() - 1;
+    walker.ndeques = nthreads + 1;
+    walker.deques = calloc(walker.ndeques, sizeof(WalkDeque));
+    pthread_t *threads = calloc(nthreads > 0 ? nthreads : 1, sizeof(pthread_t));
+    WalkWorker *workers = calloc(walker.ndeques, sizeof(WalkWorker));
+    if (!walker.deques || !threads || !workers) {
+        free(walker.deques);
+        free(threads);
+        free(workers);
+        close(walker.root_fd);
+        return -1;
+    }
+
+    pthread_mutex_init(&walker.lock, NULL);
+    pthread_cond_init(&walker.work, NULL);
+    pthread_cond_init(&walker.scanned, NULL);
+    for (int i = 0; i < walker.ndeques; i++) {
+        pthread_mutex_init(&walker.deques[i].lock, NULL);
+    }
+
+    IgnoreList *exclude = ignore_list_read(NULL, walker.root_fd, EXCLUDE_FILE, "");
+    WalkDir *root = walk_dir_new(&walker, "", "", exclude);
+    int ret = -1;
+
+    int started = 0;
+    for (int i = 0; root && i < nthreads; i++) {
+        workers[i + 1].walker = &walker;
+        workers[i + 1].self = i + 1;
+        if (pthread_create(&threads[i], NULL, walk_worker_main, &workers[i + 1]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    if (root) {
+        ret = walk_visit(&walker, root, fn, data);
+    }
+
+    pthread_mutex_lock(&walker.lock);
+    walker.stopping = 1;
+    pthread_cond_broadcast(&walker.work);
+    pthread_mutex_unlock(&walker.lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    while (walker.dirs) {
+        WalkDir *next = walker.dirs->next;
+        walk_free_items(walker.dirs);
+        free(walker.dirs->path);
+        free(walker.dirs);
+        walker.dirs = next;
+    }
+    for (size_t i = 0; i < walker.ignore_count; i++) {
+        ignore_list_free(walker.ignores[i]);
+    }
+    ignore_list_free(exclude);
+    free(walker.ignores);
+    for (int i = 0; i < walker.ndeques; i++) {
+        pthread_mutex_destroy(&walker.deques[i].lock);
+        free(walker.deques[i].dirs);
+    }
+    pthread_cond_destroy(&walker.scanned);
+    pthread_cond_destroy(&walker.work);
+    pthread_mutex_destroy(&walker.lock);
+    free(walker.deques);
+    free(threads);
+    free(workers);
+    close(walker.root_fd);
+    return ret;
+}
@@ -1,86 +1,586 @@
 #include "vcs.h"
+#include <fcntl.h>
 
-// Add file to staging area
-int add_file(const char *path) {
-    if (!file_exists(path)) {
-        fprintf(stderr, "Error: File '%s' does not exist\n", path);
-        return -1;
-    }
+// Files up to this size are read whole by a worker so their object IDs can
+// be computed in batches; larger files are streamed in a job of their own
+#define ADD_BATCH_FILE_MAX (64 * 1024)
+#define ADD_BATCH_COUNT 64
 
-    // Read file content
+// File to be stored as a blob by an add job
+typedef struct {
+    char *path;
+    struct stat st;
+    ObjectId oid;
+    void *data;         // contents while a small file waits to be hashed
     size_t size;
-    char *content = read_file(path, &size);
-    if (!content) {
-        fprintf(stderr, "Error: Failed to read file '%s'\n", path);
-        return -1;
+} AddFile;
+
+// Unit of work for the add worker pool: a batch of small files or one large
+// file. Workers read, hash, compress and store them; the results are staged
+// by the calling thread in the order the jobs were submitted.
+typedef struct {
+    AddFile files[ADD_BATCH_COUNT];
+    size_t count;
+    int failed;
+} AddJob;
+
+// Files staged in one index transaction: the index is locked and loaded
+// once, and written once when all paths have been staged
+typedef struct {
+    Index *idx;
+    WorkerPool *pool;
+    AddJob *job;        // batch still being filled
+    int failed;
+} Staging;
+
+// Whether a file's index entry still describes it, judged by stat data only
+static int file_unchanged(Index *idx, const char *path, const struct stat *st) {
+    IndexEntry *entry = index_find_entry(idx, path);
+    return entry && index_entry_uptodate(idx, entry, st);
+}
+
+static void add_job_free(AddJob *job) {
+    for (size_t i = 0; i < job->count; i++) {
+        free(job->files[i].path);
+        free(job->files[i].data);
     }
+    free(job);
+}
 
-    // Write blob object
-    char sha1[SHA1_HEX_SIZE + 1];
-    if (write_object(content, size, OBJ_BLOB, sha1) != 0) {
-        free(content);
-        fprintf(stderr, "Error: Failed to write object\n");
+// Read a small file whole; fails if it changes size while being read
+static int read_small_file(AddFile *file) {
+    int fd = open(file->path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &file->st) != 0 || file->st.st_size > ADD_BATCH_FILE_MAX) {
+        close(fd);
         return -1;
     }
-    free(content);
 
-    // Get file stats
-    struct stat st;
-    if (stat(path, &st) != 0) {
-        perror("stat");
+    file->size = file->st.st_size;
+    file->data = malloc(file->size + 1);
+    if (!file->data) {
+        close(fd);
         return -1;
     }
 
-    // Load index, add entry, save
-    Index *idx = index_new();
-    if (!idx) {
-        fprintf(stderr, "Error: Failed to create index\n");
+    size_t total = 0;
+    ssize_t n = 0;
+    while (total < file->size + 1) {
+        n = read(fd, (char *)file->data + total, file->size + 1 - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        total += n;
+    }
+    close(fd);
+
+    if (n < 0 || total != file->size) {
+        free(file->data);
+        file->data = NULL;
         return -1;
     }
+    return 0;
+}
 
-    if (index_load(idx) != 0) {
-        index_free(idx);
+// Read, hash, compress and store the files of a job. Runs on a worker
+// thread and touches nothing but the job itself.
+static void add_job_run(void *arg) {
+    AddJob *job = arg;
+    const void *data[ADD_BATCH_COUNT] = {0};
+    size_t sizes[ADD_BATCH_COUNT] = {0};
+    ObjectId oids[ADD_BATCH_COUNT];
+    AddFile *batch[ADD_BATCH_COUNT];
+    size_t n = 0;
+
+    for (size_t i = 0; i < job->count; i++) {
+        AddFile *file = &job->files[i];
+        if (file->st.st_size <= ADD_BATCH_FILE_MAX && read_small_file(file) == 0) {
+            batch[n] = file;
+            data[n] = file->data;
+            sizes[n] = file->size;
+            n++;
+        } else if (write_object_file(file->path, OBJ_BLOB, &file->oid, &file->st) != 0) {
+            fprintf(stderr, "Error: Failed to write object for '%s'\n", file->path);
+            job->failed = 1;
+        }
+    }
+
+    if (n > 0 && write_object_batch(OBJ_BLOB, data, sizes, n, oids) != 0) {
+        fprintf(stderr, "Error: Failed to write objects\n");
+        job->failed = 1;
+    }
+    for (size_t k = 0; k < n; k++) {
+        batch[k]->oid = oids[k];
+        free(batch[k]->data);
+        batch[k]->data = NULL;
+    }
+}
+
+static int staging_begin(Staging *staging) {
+    memset(staging, 0, sizeof(Staging));
+    int threads = worker_thread_count();
+    staging->idx = index_new();
+    staging->pool = worker_pool_new(threads, (size_t)threads * 2, add_job_run);
+    if (!staging->idx || !staging->pool || index_lock(staging->idx) != 0) {
+        index_free(staging->idx);
+        worker_pool_free(staging->pool);
         return -1;
     }
+    return 0;
+}
+
+// Merge the files of a finished job into the index
+static void staging_apply(Staging *staging, AddJob *job) {
+    if (job->failed) {
+        staging->failed = 1;
+        add_job_free(job);
+        return;
+    }
 
-    if (index_add_entry(idx, path, sha1, st.st_mtime, st.st_size) != 0) {
-        index_free(idx);
+    IndexUpdate updates[ADD_BATCH_COUNT];
+    for (size_t i = 0; i < job->count; i++) {
+        updates[i].path = job->files[i].path;
+        updates[i].oid = job->files[i].oid;
+        updates[i].st = job->files[i].st;
+    }
+    if (index_merge(staging->idx, updates, job->count) == 0) {
+        for (size_t i = 0; i < job->count; i++) {
+            printf("Added '%s'\n", job->files[i].path);
+        }
+    } else {
         fprintf(stderr, "Error: Failed to add entry to index\n");
+        staging->failed = 1;
+    }
+    add_job_free(job);
+}
+
+// Hand the current job to the pool. When the pool is full the oldest job is
+// staged first, so results are always applied in submission order.
+static void staging_submit(Staging *staging) {
+    AddJob *job = staging->job;
+    if (!job) {
+        return;
+    }
+    staging->job = NULL;
+
+    if (worker_pool_full(staging->pool)) {
+        staging_apply(staging, worker_pool_next(staging->pool));
+    }
+    worker_pool_submit(staging->pool, job);
+}
+
+// Queue one regular file unless its stat data matches the index. Paths
+// outside the sparse checkout keep their committed content.
+static void staging_add(Staging *staging, const char *path, const struct stat *st) {
+    IndexEntry *entry = index_find_entry(staging->idx, path);
+    if (entry && ((entry->flags & INDEX_ENTRY_SKIP_WORKTREE) ||
+                  index_entry_uptodate(staging->idx, entry, st))) {
+        return;
+    }
+
+    int large = st->st_size > ADD_BATCH_FILE_MAX;
+    if (large) {
+        staging_submit(staging);
+    }
+    if (!staging->job && !(staging->job = calloc(1, sizeof(AddJob)))) {
+        staging->failed = 1;
+        return;
+    }
+
+    AddJob *job = staging->job;
+    AddFile *file = &job->files[job->count];
+    file->path = strdup(path);
+    if (!file->path) {
+        staging->failed = 1;
+        return;
+    }
+    file->st = *st;
+    job->count++;
+
+    if (large || job->count == ADD_BATCH_COUNT) {
+        staging_submit(staging);
+    }
+}
+
+// Wait for outstanding jobs, then write the index if every path was staged;
+// otherwise leave it untouched
+static int staging_finish(Staging *staging) {
+    staging_submit(staging);
+
+    AddJob *job;
+    while ((job = worker_pool_next(staging->pool)) != NULL) {
+        staging_apply(staging, job);
+    }
+    worker_pool_free(staging->pool);
+
+    int ret;
+    if (staging->failed) {
+        index_rollback(staging->idx);
+        ret = -1;
+    } else {
+        ret = index_commit(staging->idx);
+    }
+
+    index_free(staging->idx);
+    return ret;
+}
+
+// Add files to the staging area in a single index transaction. Nothing is
+// staged unless every path can be added.
+int add_files(const char *const *paths, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!file_exists(paths[i])) {
+            fprintf(stderr, "Error: File '%s' does not exist\n", paths[i]);
+            return -1;
+        }
+    }
+
+    Staging staging;
+    if (staging_begin(&staging) != 0) {
         return -1;
     }
 
-    if (index_save(idx) != 0) {
-        index_free(idx);
+    for (size_t i = 0; i < count && !staging.failed; i++) {
+        struct stat st;
+        if (stat(paths[i], &st) != 0) {
+            fprintf(stderr, "Error: File '%s' does not exist\n", paths[i]);
+            staging.failed = 1;
+            break;
+        }
+        staging_add(&staging, paths[i], &st);
+    }
+
+    return staging_finish(&staging);
+}
+
+// Add file to staging area
+int add_file(const char *path) {
+    return add_files(&path, 1);
+}
+
+static int staging_walk_file(const char *path, const struct stat *st, void *data) {
+    Staging *staging = data;
+    staging_add(staging, path, st);
+    return staging->failed ? -1 : 0;
+}
+
+static int path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Stage one path found through the filesystem monitor. Tracked files found
+// unchanged are flagged valid; changed ones are skipped if the walk would
+// have left them out.
+static void staging_add_monitored(Staging *staging, int root_fd, const char *path,
+                                  int tracked) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    if (tracked && file_unchanged(staging->idx, path, &st)) {
+        int found;
+        size_t pos = index_position(staging->idx, path, &found);
+        if (found) {
+            index_set_flags(staging->idx, pos, INDEX_ENTRY_FSMONITOR_VALID, 0);
+        }
+        return;
+    }
+    if (!tracked || !ignore_path_excluded(root_fd, path)) {
+        staging_add(staging, path, &st);
+    }
+}
+
+// Instead of walking the tree, examine the tracked files not flagged valid
+// and the untracked files from the untracked cache, merged into path order
+static int staging_add_changed(Staging *staging) {
+    Index *idx = staging->idx;
+    char **untracked = NULL;
+    size_t untracked_count = 0;
+    if (untracked_files(idx, &untracked, &untracked_count) < 0) {
         return -1;
     }
 
-    index_free(idx);
-    printf("Added '%s'\n", path);
-    return 0;
+    // Collected up front, since staging changes the index as jobs finish
+    char **tracked = malloc((idx->count ? idx->count : 1) * sizeof(char *));
+    size_t tracked_count = 0;
+    int ret = tracked ? 0 : -1;
+    for (size_t i = 0; ret == 0 && i < idx->count; i++) {
+        if (idx->entries[i].flags & (INDEX_ENTRY_FSMONITOR_VALID | INDEX_ENTRY_SKIP_WORKTREE)) {
+            continue;
+        }
+        if (!(tracked[tracked_count] = strdup(index_path(idx, &idx->entries[i])))) {
+            ret = -1;
+            break;
+        }
+        tracked_count++;
+    }
+
+    int root_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (root_fd < 0) {
+        ret = -1;
+    }
+    size_t t = 0;
+    size_t u = 0;
+    while (ret == 0 && !staging->failed && (t < tracked_count || u < untracked_count)) {
+        if (u == untracked_count ||
+            (t < tracked_count && path_cmp(&tracked[t], &untracked[u]) < 0)) {
+            staging_add_monitored(staging, root_fd, tracked[t++], 1);
+        } else {
+            staging_add_monitored(staging, root_fd, untracked[u++], 0);
+        }
+    }
+
+    if (root_fd >= 0) {
+        close(root_fd);
+    }
+    for (size_t i = 0; i < tracked_count; i++) {
+        free(tracked[i]);
+    }
+    for (size_t i = 0; i < untracked_count; i++) {
+        free(untracked[i]);
+    }
+    free(tracked);
+    free(untracked);
+    return ret;
 }
 
-// Add all files in current directory
+// Add all files in the working tree, in path order. With a filesystem
+// monitor and the untracked cache, only files that may have changed are
+// examined.
 int add_all(void) {
-    DIR *dir = opendir(".");
-    if (!dir) {
-        perror("opendir");
+    Staging staging;
+    if (staging_begin(&staging) != 0) {
         return -1;
     }
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip hidden files and VCS directory
-        if (entry->d_name[0] == '.' || strcmp(entry->d_name, VCS_DIR) == 0) {
-            continue;
+    int updated;
+    if (config_get_bool("core.untrackedCache", 1) && fsmonitor_refresh(staging.idx, &updated)) {
+        if (staging_add_changed(&staging) != 0) {
+            staging.failed = 1;
         }
+    } else if (walk_worktree(staging_walk_file, &staging) != 0) {
+        staging.failed = 1;
+    }
+    return staging_finish(&staging);
+}
 
-        struct stat st;
-        if (stat(entry->d_name, &st) == 0 && S_ISREG(st.st_mode)) {
-            add_file(entry->d_name);
+// Lines collected for one section of the status output
+typedef struct {
+    char **lines;
+    size_t count;
+    size_t capacity;
+} StatusList;
+
+// Working tree compared with the index in one pass: the walk delivers files
+// in index order, so both are merged like sorted lists. Without a walk,
+// tracked files are checked by path and untracked ones come from the cache.
+typedef struct {
+    Index *idx;
+    size_t next;                // first index entry not yet matched
+    StatusList unstaged;
+    StatusList untracked;
+    IndexUpdate *refresh;       // entries found clean by content, with new stat data
+    size_t refresh_count;
+    size_t refresh_capacity;
+} StatusScan;
+
+static void status_list_add(StatusList *list, const char *label, const char *path) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        char **lines = realloc(list->lines, capacity * sizeof(char *));
+        if (!lines) {
+            return;
+        }
+        list->lines = lines;
+        list->capacity = capacity;
+    }
+    size_t len = strlen(label) + strlen(path) + 1;
+    char *line = malloc(len);
+    if (line) {
+        snprintf(line, len, "%s%s", label, path);
+        list->lines[list->count++] = line;
+    }
+}
+
+static void status_list_free(StatusList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->lines[i]);
+    }
+    free(list->lines);
+}
+
+static void status_list_print(StatusList *list, const char *title) {
+    if (list->count > 0) {
+        printf("%s\n", title);
+        for (size_t i = 0; i < list->count; i++) {
+            printf("  %s\n", list->lines[i]);
+        }
+        printf("\n");
+    }
+    status_list_free(list);
+}
+
+// Remember new stat data for an entry whose file only looked changed, so the
+// next status can skip reading it; kept only if the index could be locked
+static void status_refresh(StatusScan *scan, const IndexEntry *entry, const char *path,
+                           const struct stat *st) {
+    if (!scan->idx->lock) {
+        return;
+    }
+    if (scan->refresh_count == scan->refresh_capacity) {
+        size_t capacity = scan->refresh_capacity ? scan->refresh_capacity * 2 : 16;
+        IndexUpdate *refresh = realloc(scan->refresh, capacity * sizeof(IndexUpdate));
+        if (!refresh) {
+            return;
         }
+        scan->refresh = refresh;
+        scan->refresh_capacity = capacity;
+    }
+    IndexUpdate *update = &scan->refresh[scan->refresh_count];
+    if ((update->path = strdup(path)) != NULL) {
+        update->oid = entry->oid;
+        update->st = *st;
+        scan->refresh_count++;
+    }
+}
+
+// Report a tracked file as modified unless its stat data matches or its
+// content hashes to the staged blob; returns 1 if it is clean. Paths outside
+// the sparse checkout are always clean.
+static int status_check_tracked(StatusScan *scan, const IndexEntry *entry,
+                                const char *path, const struct stat *st) {
+    ObjectId oid;
+    if ((entry->flags & INDEX_ENTRY_SKIP_WORKTREE) ||
+        index_entry_uptodate(scan->idx, entry, st)) {
+        return 1;
+    }
+    if (hash_object_file(path, OBJ_BLOB, &oid) != 0 || !oid_equal(&oid, &entry->oid)) {
+        status_list_add(&scan->unstaged, "modified:   ", path);
+        return 0;
     }
+    status_refresh(scan, entry, path, st);
+    return 1;
+}
 
-    closedir(dir);
+// A tracked file the walk did not report, or any tracked file when there
+// is no walk: deleted, or checked by path
+static int status_check_unseen(StatusScan *scan, const IndexEntry *entry) {
+    const char *path = index_path(scan->idx, entry);
+    struct stat st;
+    if (entry->flags & INDEX_ENTRY_SKIP_WORKTREE) {
+        return 1;
+    }
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        status_list_add(&scan->unstaged, "deleted:    ", path);
+        return 0;
+    }
+    return status_check_tracked(scan, entry, path, &st);
+}
+
+// List a change staged on top of HEAD
+static int status_staged(const DiffChange *change, void *data) {
+    if (change->status == DIFF_RENAMED || change->status == DIFF_COPIED) {
+        size_t len = strlen(change->old_path) + strlen(change->path) + 5;
+        char *paths = malloc(len);
+        if (!paths) {
+            return -1;
+        }
+        snprintf(paths, len, "%s -> %s", change->old_path, change->path);
+        status_list_add(data, change->status == DIFF_RENAMED ? "renamed:    " : "copied:     ",
+                        paths);
+        free(paths);
+        return 0;
+    }
+    const char *label = change->status == DIFF_ADDED ? "new file:   " :
+                        change->status == DIFF_DELETED ? "deleted:    " : "modified:   ";
+    status_list_add(data, label, change->path);
+    return 0;
+}
+
+// Rename detection settings from the command line, falling back to
+// diff.renames, diff.renameThreshold and diff.renameCandidates; returns 0
+// if detection is off
+static int diff_rename_options(const DiffOptions *opts, RenameOptions *renames) {
+    const char *config = config_get("diff.renames");
+    int copies = config && strcasecmp(config, "copies") == 0;
+    int enabled = copies || config_get_bool("diff.renames", 1);
+    if (opts && opts->renames >= 0) {
+        enabled = opts->renames;
+    }
+    if (opts && opts->copies) {
+        enabled = copies = 1;
+    }
+
+    long threshold = opts && opts->threshold >= 0 ? opts->threshold
+                                                  : config_get_int("diff.renameThreshold", 50);
+    long candidates = config_get_int("diff.renameCandidates", 100);
+    renames->threshold = threshold < 0 ? 0 : threshold > 100 ? 100 : (int)threshold;
+    renames->candidates = candidates < 0 ? 0 : (size_t)candidates;
+    renames->copies = copies;
+    return enabled;
+}
+
+// Pair renames among the queued changes, then pass them all to fn
+static int diff_flush_renames(DiffQueue *queue, const RenameOptions *renames,
+                              DiffCallback fn, void *data) {
+    int ret = diff_detect_renames(queue, renames);
+    if (ret == 0) {
+        ret = diff_queue_flush(queue, fn, data);
+    }
+    diff_queue_free(queue);
+    return ret;
+}
+
+// Tree of the HEAD commit; the null ID (empty tree) before the first commit
+static int head_tree(ObjectId *tree) {
+    ObjectId head;
+    if (get_head_commit(&head) != 0 || oid_is_null(&head)) {
+        oid_clear(tree);
+        return 0;
+    }
+    Commit *commit = read_commit(&head);
+    if (!commit) {
+        fprintf(stderr, "Error: Failed to read HEAD commit\n");
+        return -1;
+    }
+    *tree = commit->tree;
+    commit_free(commit);
+    return 0;
+}
+
+// Only files whose stat data no longer matches their entry are read and hashed
+static int status_walk_file(const char *path, const struct stat *st, void *data) {
+    StatusScan *scan = data;
+    Index *idx = scan->idx;
+    size_t len = strlen(path);
+
+    while (scan->next < idx->count) {
+        const IndexEntry *entry = &idx->entries[scan->next];
+        const char *entry_path = index_path(idx, entry);
+        size_t n = entry->path_len < len ? entry->path_len : len;
+        int cmp = memcmp(entry_path, path, n);
+        if (cmp == 0) {
+            cmp = entry->path_len < len ? -1 : entry->path_len > len;
+        }
+        if (cmp > 0) {
+            break;
+        }
+        scan->next++;
+        if (cmp < 0) {
+            status_check_unseen(scan, entry);
+            continue;
+        }
+
+        status_check_tracked(scan, entry, path, st);
+        return 0;
+    }
+
+    status_list_add(&scan->untracked, "", path);
     return 0;
 }
 
@@ -96,60 +596,100 @@ int vcs_status(void) {
     if (branch) {
         printf("On branch %s\n", branch);
     } else if (is_head_detached()) {
-        char *head = get_head_commit();
-        printf("HEAD detached at %.*s\n", 7, head ? head : "unknown");
+        ObjectId head;
+        printf("HEAD detached at %.*s\n", 7,
+               get_head_commit(&head) == 0 ? oid_hex(&head) : "unknown");
     } else {
         printf("On branch master (no commits yet)\n");
     }
 
     printf("\n");
 
-    // Load index
+    // Lock the index if nobody else holds it, so refreshed stat data and the
+    // untracked cache can be written back; otherwise only read it
     Index *idx = index_new();
     if (!idx) {
         return -1;
     }
-    index_load(idx);
+    if (index_try_lock(idx) != 0) {
+        index_load(idx);
+    }
 
-    if (idx->count > 0) {
-        printf("Changes to be committed:\n");
-        for (size_t i = 0; i < idx->count; i++) {
-            printf("  modified:   %s\n", idx->entries[i].path);
-        }
-        printf("\n");
-    } else {
+    // Staged changes: HEAD's tree against the index, skipping directories
+    // whose cached tree still matches
+    StatusList staged;
+    memset(&staged, 0, sizeof(staged));
+    DiffQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    RenameOptions renames;
+    int detect = diff_rename_options(NULL, &renames);
+    ObjectId head;
+    int ret = head_tree(&head);
+    if (ret == 0) {
+        ret = diff_tree_index(&head, idx, detect ? diff_queue_add : status_staged,
+                              detect ? (void *)&queue : &staged);
+    }
+    if (ret == 0 && detect) {
+        ret = diff_flush_renames(&queue, &renames, status_staged, &staged);
+    }
+    diff_queue_free(&queue);
+    if (ret != 0) {
+        status_list_free(&staged);
+        index_free(idx);
+        return -1;
+    }
+    if (staged.count == 0) {
         printf("No changes staged for commit\n\n");
     }
+    status_list_print(&staged, "Changes to be committed:");
 
-    // Check for untracked files
-    DIR *dir = opendir(".");
-    if (dir) {
-        int has_untracked = 0;
-        struct dirent *entry;
-        
-        while ((entry = readdir(dir)) != NULL) {
-            if (entry->d_name[0] == '.' || strcmp(entry->d_name, VCS_DIR) == 0) {
+    // Compare the working tree with the index. With the untracked cache,
+    // only directories changed since the last status are read; with a
+    // filesystem monitor, only tracked files it reported are checked.
+    StatusScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.idx = idx;
+    int cache_changed = 0;
+    int index_changed = 0;
+    if (config_get_bool("core.untrackedCache", 1)) {
+        int monitored = fsmonitor_refresh(idx, &index_changed);
+        for (size_t i = 0; i < idx->count; i++) {
+            if (monitored && (idx->entries[i].flags & INDEX_ENTRY_FSMONITOR_VALID)) {
                 continue;
             }
-
-            struct stat st;
-            if (stat(entry->d_name, &st) == 0 && S_ISREG(st.st_mode)) {
-                if (!index_find_entry(idx, entry->d_name)) {
-                    if (!has_untracked) {
-                        printf("Untracked files:\n");
-                        has_untracked = 1;
-                    }
-                    printf("  %s\n", entry->d_name);
-                }
+            if (status_check_unseen(&scan, &idx->entries[i]) && monitored &&
+                index_set_flags(idx, i, INDEX_ENTRY_FSMONITOR_VALID, 0) == 0) {
+                index_changed = 1;
             }
         }
-        closedir(dir);
-        
-        if (has_untracked) {
-            printf("\n");
+        char **paths;
+        size_t count;
+        cache_changed = untracked_files(idx, &paths, &count);
+        for (size_t i = 0; cache_changed >= 0 && i < count; i++) {
+            status_list_add(&scan.untracked, "", paths[i]);
+            free(paths[i]);
+        }
+        if (cache_changed >= 0) {
+            free(paths);
+        }
+    } else {
+        walk_worktree(status_walk_file, &scan);
+        while (scan.next < idx->count) {
+            status_check_unseen(&scan, &idx->entries[scan.next++]);
         }
     }
+    status_list_print(&scan.unstaged, "Changes not staged for commit:");
+    status_list_print(&scan.untracked, "Untracked files:");
 
+    if (idx->lock && (scan.refresh_count > 0 || cache_changed > 0 || index_changed)) {
+        if (index_merge(idx, scan.refresh, scan.refresh_count) == 0) {
+            index_commit(idx);
+        }
+    }
+    for (size_t i = 0; i < scan.refresh_count; i++) {
+        free((char *)scan.refresh[i].path);
+    }
+    free(scan.refresh);
     index_free(idx);
     return 0;
 }
@@ -161,23 +701,20 @@ int vcs_log(int limit) {
         return -1;
     }
 
-    char *head_sha1 = get_head_commit();
-    if (!head_sha1) {
+    ObjectId current;
+    if (get_head_commit(&current) != 0) {
         printf("No commits yet\n");
         return 0;
     }
 
-    char current_sha1[SHA1_HEX_SIZE + 1];
-    strcpy(current_sha1, head_sha1);
-
     int count = 0;
-    while (strlen(current_sha1) > 0 && (limit == 0 || count < limit)) {
-        Commit *commit = read_commit(current_sha1);
+    while (!oid_is_null(&current) && (limit == 0 || count < limit)) {
+        Commit *commit = read_commit(&current);
         if (!commit) {
             break;
         }
 
-        printf("commit %s\n", current_sha1);
+        printf("commit %s\n", oid_hex(&current));
         printf("Author: %s\n", commit->author);
         
         char time_buf[64];
@@ -186,7 +723,7 @@ int vcs_log(int limit) {
         printf("Date:   %s\n", time_buf);
         printf("\n    %s\n\n", commit->message);
 
-        strcpy(current_sha1, commit->parent_sha1);
+        current = commit->parent;
         commit_free(commit);
         count++;
     }
@@ -194,27 +731,353 @@ int vcs_log(int limit) {
     return 0;
 }
 
-// Show diff (simplified version)
-int vcs_diff(const char *commit_sha1) {
-    if (!is_vcs_repo()) {
-        fprintf(stderr, "Error: Not a VCS repository\n");
+// Tree of a commit named by branch or full ID; NULL names HEAD
+static int diff_resolve_tree(const char *name, ObjectId *tree) {
+    if (!name) {
+        return head_tree(tree);
+    }
+
+    ObjectId oid;
+    if (branch_exists(name)) {
+        if (read_ref(name, &oid) != 0) {
+            fprintf(stderr, "Error: Failed to read branch reference\n");
+            return -1;
+        }
+    } else if (strlen(name) != hash_hex_size() || hex_to_oid(name, &oid) != 0) {
+        fprintf(stderr, "Error: Branch or commit '%s' not found\n", name);
         return -1;
     }
 
-    printf("Diff functionality - comparing with commit %s\n", 
-           commit_sha1 ? commit_sha1 : "HEAD");
-    
-    // Load index
-    Index *idx = index_new();
-    if (!idx) {
+    Commit *commit = read_commit(&oid);
+    if (!commit) {
+        fprintf(stderr, "Error: '%s' is not a commit\n", name);
         return -1;
     }
-    index_load(idx);
+    *tree = commit->tree;
+    commit_free(commit);
+    return 0;
+}
 
-    for (size_t i = 0; i < idx->count; i++) {
-        printf("File: %s (SHA-1: %s)\n", idx->entries[i].path, idx->entries[i].sha1);
+// nit diff --stat line for one file
+typedef struct {
+    char *path;
+    size_t added;
+    size_t deleted;
+    int binary;
+} DiffStat;
+
+// Output state of nit diff, handed to the diff engine's callback
+typedef struct {
+    DiffFormat format;
+    int context;
+    DiffAlgorithm algorithm;
+    int worktree;           // the new side of each change is a working tree file
+    DiffStat *stats;
+    size_t stat_count;
+    size_t stat_capacity;
+} DiffPrinter;
+
+// Contents of one side of a change: its blob, its working tree file, or
+// nothing for the missing side of an added or deleted file
+static void *diff_load(const ObjectId *oid, const char *path, int from_file, size_t *size) {
+    if (oid_is_null(oid)) {
+        *size = 0;
+        return malloc(1);
+    }
+    if (from_file) {
+        return read_file(path, size);
+    }
+    ObjectType type;
+    void *data = read_object(oid, size, &type);
+    if (data && type != OBJ_BLOB) {
+        free(data);
+        return NULL;
     }
+    return data;
+}
 
-    index_free(idx);
-    return 0;
+static void diff_print_header(const DiffChange *change) {
+    char old_hex[MAX_HASH_HEX_SIZE + 1], new_hex[MAX_HASH_HEX_SIZE + 1];
+    strcpy(old_hex, oid_hex(&change->old_oid));
+    strcpy(new_hex, oid_hex(&change->new_oid));
+
+    printf("diff --git a/%s b/%s\n", change->old_path, change->path);
+    if (change->status == DIFF_ADDED) {
+        printf("new file mode %06o\n", (unsigned)change->new_mode);
+    } else if (change->status == DIFF_DELETED) {
+        printf("deleted file mode %06o\n", (unsigned)change->old_mode);
+    } else if (change->old_mode != change->new_mode) {
+        printf("old mode %06o\nnew mode %06o\n", (unsigned)change->old_mode,
+               (unsigned)change->new_mode);
+    }
+    if (change->status == DIFF_RENAMED || change->status == DIFF_COPIED) {
+        const char *verb = change->status == DIFF_RENAMED ? "rename" : "copy";
+        printf("similarity index %d%%\n", change->similarity);
+        printf("%s from %s\n%s to %s\n", verb, change->old_path, verb, change->path);
+    }
+    if (oid_equal(&change->old_oid, &change->new_oid)) {
+        return;
+    }
+    printf("index %.7s..%.7s", old_hex, new_hex);
+    if (change->status != DIFF_ADDED && change->status != DIFF_DELETED &&
+        change->old_mode == change->new_mode) {
+        printf(" %06o", (unsigned)change->old_mode);
+    }
+    printf("\n");
+}
+
+// Path shown by --stat and --numstat: for a rename or copy, both paths
+// with their common leading directories and trailing part factored out,
+// as in "src/{old => new}/file.c"
+static char *diff_stat_name(const DiffChange *change) {
+    if (change->status != DIFF_RENAMED && change->status != DIFF_COPIED) {
+        return strdup(change->path);
+    }
+    const char *a = change->old_path, *b = change->path;
+    size_t len_a = strlen(a), len_b = strlen(b);
+
+    size_t prefix = 0;
+    for (size_t i = 0; a[i] && a[i] == b[i]; i++) {
+        if (a[i] == '/') {
+            prefix = i + 1;
+        }
+    }
+    // The suffix may reach back to the slash ending the prefix
+    size_t suffix = 0, stop = prefix ? prefix - 1 : 0;
+    for (size_t i = 1; i <= len_a - stop && i <= len_b - stop; i++) {
+        if (a[len_a - i] != b[len_b - i]) {
+            break;
+        }
+        if (a[len_a - i] == '/') {
+            suffix = i;
+        }
+    }
+    size_t mid_a = len_a > prefix + suffix ? len_a - prefix - suffix : 0;
+    size_t mid_b = len_b > prefix + suffix ? len_b - prefix - suffix : 0;
+
+    size_t len = len_a + len_b + 7;
+    char *name = malloc(len);
+    if (!name) {
+        return NULL;
+    }
+    if (prefix + suffix > 0) {
+        snprintf(name, len, "%.*s{%.*s => %.*s}%s", (int)prefix, a, (int)mid_a, a + prefix,
+                 (int)mid_b, b + prefix, a + len_a - suffix);
+    } else {
+        snprintf(name, len, "%s => %s", a, b);
+    }
+    return name;
+}
+
+// Print or count one changed file. Blobs whose IDs are equal (a mode
+// change) have no content diff.
+static int diff_print_change(const DiffChange *change, void *data) {
+    DiffPrinter *p = data;
+    if (p->format == DIFF_FORMAT_NAME_STATUS) {
+        if (change->status == DIFF_RENAMED || change->status == DIFF_COPIED) {
+            printf("%c%03d\t%s\t%s\n", (char)change->status, change->similarity,
+                   change->old_path, change->path);
+        } else {
+            printf("%c\t%s\n", (char)change->status, change->path);
+        }
+        return 0;
+    }
+
+    size_t old_size = 0, new_size = 0;
+    void *old_data = diff_load(&change->old_oid, change->path, 0, &old_size);
+    void *new_data = diff_load(&change->new_oid, change->path, p->worktree, &new_size);
+    if (!old_data || !new_data) {
+        fprintf(stderr, "Error: Failed to read '%s'\n", change->path);
+        free(old_data);
+        free(new_data);
+        return -1;
+    }
+
+    int binary = diff_is_binary(old_data, old_size) || diff_is_binary(new_data, new_size);
+    int same = oid_equal(&change->old_oid, &change->new_oid);
+    LineDiff diff;
+    size_t added = 0, deleted = 0;
+    int ret = 0;
+    if (!binary && !same) {
+        ret = line_diff(old_data, old_size, new_data, new_size, p->algorithm, &diff);
+        if (ret == 0) {
+            line_diff_count(&diff, &added, &deleted);
+        }
+    }
+
+    if (ret == 0 && p->format == DIFF_FORMAT_PATCH) {
+        diff_print_header(change);
+        if (binary && !same) {
+            printf("Binary files %s%s and %s%s differ\n",
+                   change->status == DIFF_ADDED ? "" : "a/",
+                   change->status == DIFF_ADDED ? "/dev/null" : change->old_path,
+                   change->status == DIFF_DELETED ? "" : "b/",
+                   change->status == DIFF_DELETED ? "/dev/null" : change->path);
+        } else if (added > 0 || deleted > 0) {
+            printf("--- %s%s\n", change->status == DIFF_ADDED ? "" : "a/",
+                   change->status == DIFF_ADDED ? "/dev/null" : change->old_path);
+            printf("+++ %s%s\n", change->status == DIFF_DELETED ? "" : "b/",
+                   change->status == DIFF_DELETED ? "/dev/null" : change->path);
+            line_diff_print(&diff, p->context, stdout);
+        }
+    } else if (ret == 0 && p->format == DIFF_FORMAT_NUMSTAT) {
+        char *name = diff_stat_name(change);
+        if (!name) {
+            ret = -1;
+        } else if (binary) {
+            printf("-\t-\t%s\n", name);
+        } else {
+            printf("%zu\t%zu\t%s\n", added, deleted, name);
+        }
+        free(name);
+    } else if (ret == 0) {
+        // --stat lines are aligned, so they are printed once all are known
+        if (p->stat_count == p->stat_capacity) {
+            size_t capacity = p->stat_capacity ? p->stat_capacity * 2 : 16;
+            DiffStat *stats = realloc(p->stats, capacity * sizeof(DiffStat));
+            if (!stats) {
+                ret = -1;
+            } else {
+                p->stats = stats;
+                p->stat_capacity = capacity;
+            }
+        }
+        if (ret == 0) {
+            DiffStat *stat = &p->stats[p->stat_count];
+            stat->path = diff_stat_name(change);
+            stat->added = added;
+            stat->deleted = deleted;
+            stat->binary = binary && !same;
+            ret = stat->path ? 0 : -1;
+            p->stat_count += stat->path != NULL;
+        }
+    }
+
+    if (!binary && !same && ret == 0) {
+        line_diff_free(&diff);
+    }
+    free(old_data);
+    free(new_data);
+    return ret;
+}
+
+// Print the --stat table: one "path | count +++--" line per file, with the
+// bars scaled to fit, then totals
+static void diff_print_stat(DiffPrinter *p) {
+    size_t name_width = 0, max_total = 0, added = 0, deleted = 0;
+    int binary = 0;
+    for (size_t i = 0; i < p->stat_count; i++) {
+        binary |= p->stats[i].binary;
+        size_t len = strlen(p->stats[i].path);
+        size_t total = p->stats[i].added + p->stats[i].deleted;
+        name_width = len > name_width ? len : name_width;
+        max_total = total > max_total ? total : max_total;
+        added += p->stats[i].added;
+        deleted += p->stats[i].deleted;
+    }
+    int count_width = snprintf(NULL, 0, "%zu", max_total);
+    if (binary && count_width < 3) {
+        count_width = 3;
+    }
+    size_t bar_width = 50;
+
+    for (size_t i = 0; i < p->stat_count; i++) {
+        DiffStat *stat = &p->stats[i];
+        if (stat->binary) {
+            printf(" %-*s | %*s\n", (int)name_width, stat->path, count_width, "Bin");
+            continue;
+        }
+        size_t plus = stat->added, minus = stat->deleted;
+        if (max_total > bar_width) {
+            plus = (plus * bar_width + max_total - 1) / max_total;
+            minus = (minus * bar_width + max_total - 1) / max_total;
+        }
+        printf(" %-*s | %*zu%s", (int)name_width, stat->path, count_width,
+               stat->added + stat->deleted, plus + minus > 0 ? " " : "");
+        for (size_t k = 0; k < plus; k++) {
+            putchar('+');
+        }
+        for (size_t k = 0; k < minus; k++) {
+            putchar('-');
+        }
+        printf("\n");
+    }
+    if (p->stat_count > 0) {
+        printf(" %zu file%s changed", p->stat_count, p->stat_count == 1 ? "" : "s");
+        if (added > 0 || deleted == 0) {
+            printf(", %zu insertion%s(+)", added, added == 1 ? "" : "s");
+        }
+        if (deleted > 0 || added == 0) {
+            printf(", %zu deletion%s(-)", deleted, deleted == 1 ? "" : "s");
+        }
+        printf("\n");
+    }
+}
+
+// Show what changed: between two commits, from a commit (HEAD by default)
+// to the index when cached, or from the index to the working tree
+int vcs_diff(const char *from, const char *to, int cached, const DiffOptions *opts) {
+    if (!is_vcs_repo()) {
+        fprintf(stderr, "Error: Not a VCS repository\n");
+        return -1;
+    }
+
+    DiffPrinter printer;
+    memset(&printer, 0, sizeof(printer));
+    printer.format = opts->format;
+    printer.context = opts->context >= 0 ? opts->context : config_get_int("diff.context", 3);
+    const char *algorithm = config_get("diff.algorithm");
+    printer.algorithm = algorithm && strcmp(algorithm, "myers") == 0 ? DIFF_MYERS
+                                                                     : DIFF_HISTOGRAM;
+
+    // With rename detection, changes are collected first so added and
+    // deleted files can be paired
+    DiffQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    RenameOptions renames;
+    int detect = diff_rename_options(opts, &renames);
+    DiffCallback fn = detect ? diff_queue_add : diff_print_change;
+    void *data = detect ? (void *)&queue : &printer;
+
+    ObjectId old_tree, new_tree;
+    int ret;
+    if (to) {
+        ret = diff_resolve_tree(from, &old_tree);
+        if (ret == 0) {
+            ret = diff_resolve_tree(to, &new_tree);
+        }
+        if (ret == 0) {
+            ret = diff_trees(&old_tree, &new_tree, fn, data);
+        }
+    } else {
+        Index *idx = index_new();
+        if (!idx) {
+            return -1;
+        }
+        ret = index_load(idx);
+        if (ret == 0 && (cached || from)) {
+            ret = diff_resolve_tree(from, &old_tree);
+            if (ret == 0) {
+                ret = diff_tree_index(&old_tree, idx, fn, data);
+            }
+        } else if (ret == 0) {
+            // Only tracked files are compared, so nothing is added here
+            printer.worktree = 1;
+            ret = diff_index_worktree(idx, diff_print_change, &printer);
+        }
+        index_free(idx);
+    }
+    if (ret == 0 && detect && !printer.worktree) {
+        ret = diff_flush_renames(&queue, &renames, diff_print_change, &printer);
+    }
+    diff_queue_free(&queue);
+
+    if (ret == 0 && printer.format == DIFF_FORMAT_STAT) {
+        diff_print_stat(&printer);
+    }
+    for (size_t i = 0; i < printer.stat_count; i++) {
+        free(printer.stats[i].path);
+    }
+    free(printer.stats);
+    return ret;
 }
@@ -0,0 +1,173 @@
+#include "vcs.h"
+#include <pthread.h>
+
+#define WORKER_THREADS_MAX 256
+
+// Jobs run on a fixed set of threads and are handed back in the order they
+// were submitted. At most `capacity` jobs are in flight, which bounds the
+// memory they hold. With no threads, jobs run inline in worker_pool_submit().
+struct WorkerPool {
+    pthread_t *threads;
+    int nthreads;
+    WorkerFn fn;
+    void **jobs;               // ring of in-flight jobs
+    unsigned char *done;
+    size_t capacity;
+    size_t submitted;          // jobs handed to the pool
+    size_t claimed;            // jobs picked up by a worker
+    size_t retired;            // jobs handed back by worker_pool_next()
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work;       // a job was submitted, or the pool is stopping
+    pthread_cond_t finished;   // a job completed
+};
+
+// Number of worker threads: core.threads, or the number of online CPUs
+int worker_thread_count(void) {
+    long threads = config_get_int("core.threads", 0);
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    return threads > WORKER_THREADS_MAX ? WORKER_THREADS_MAX : (int)threads;
+}
+
+static void *worker_main(void *arg) {
+    WorkerPool *pool = arg;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->claimed == pool->submitted && !pool->stopping) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->claimed == pool->submitted) {
+            break;
+        }
+
+        size_t slot = pool->claimed++ % pool->capacity;
+        void *job = pool->jobs[slot];
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->fn(job);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done[slot] = 1;
+        pthread_cond_broadcast(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Start a pool; threads <= 1 runs every job inline on the caller's thread
+WorkerPool *worker_pool_new(int threads, size_t capacity, WorkerFn fn) {
+    WorkerPool *pool = calloc(1, sizeof(WorkerPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->fn = fn;
+    pool->capacity = capacity ? capacity : 1;
+    pool->jobs = calloc(pool->capacity, sizeof(void *));
+    pool->done = calloc(pool->capacity, 1);
+    if (!pool->jobs || !pool->done) {
+        free(pool->jobs);
+        free(pool->done);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    if (threads > 1) {
+        pool->threads = malloc(sizeof(pthread_t) * threads);
+        if (!pool->threads) {
+            worker_pool_free(pool);
+            return NULL;
+        }
+        for (int i = 0; i < threads; i++) {
+            if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+                break;
+            }
+            pool->nthreads++;
+        }
+    }
+    return pool;
+}
+
+// Whether the pool is holding as many jobs as it may; retire one with
+// worker_pool_next() before submitting another
+int worker_pool_full(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    int full = pool->submitted - pool->retired >= pool->capacity;
+    pthread_mutex_unlock(&pool->lock);
+    return full;
+}
+
+// Queue a job; fails if the pool is full
+int worker_pool_submit(WorkerPool *pool, void *job) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->submitted - pool->retired >= pool->capacity) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    size_t slot = pool->submitted % pool->capacity;
+    pool->jobs[slot] = job;
+    pool->done[slot] = 0;
+
+    if (pool->nthreads == 0) {
+        pool->claimed = ++pool->submitted;
+        pthread_mutex_unlock(&pool->lock);
+        pool->fn(job);
+        pool->done[slot] = 1;
+        return 0;
+    }
+
+    pool->submitted++;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Oldest submitted job, waiting for it to finish; NULL when none are left
+void *worker_pool_next(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->retired == pool->submitted) {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    size_t slot = pool->retired % pool->capacity;
+    while (!pool->done[slot]) {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    void *job = pool->jobs[slot];
+    pool->retired++;
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+// Stop the threads once queued jobs have run. Jobs not yet retired are
+// still owned by the caller.
+void worker_pool_free(WorkerPool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->finished);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->jobs);
+    free(pool->done);
+    free(pool);
+}